@@ -0,0 +1,69 @@
+/////////////////////////////////////////////////////////////////////////
+// Pixel shader for the clustered local lights pass
+//
+// One full screen pass adds the light of every local light reaching
+// each pixel.  The view frustum is cut into clusters: TILE_SIZE pixel
+// screen tiles, each split into SLICES depth slices spaced
+// logarithmically between front and back.  LightClusters (clusters.h)
+// lists the lights overlapping each cluster, so a pixel only loops
+// over its own cluster's list.
+////////////////////////////////////////////////////////////////////////
+#version 430
+
+uniform mat4 WorldInverse;
+
+#include "gbuffer.glsl"
+#include "local_light.glsl"
+
+struct Light {
+    vec4 posRadius;             // World position, and radius in w
+    vec4 color;
+};
+
+layout (std430, binding = 1) readonly buffer LightBlock {
+    Light lights[];
+};
+
+// Per cluster, the first entry in lightIndices and the count
+layout (std430, binding = 2) readonly buffer ClusterBlock {
+    uvec2 clusters[];
+};
+
+layout (std430, binding = 3) readonly buffer LightIndexBlock {
+    uint lightIndices[];
+};
+
+uniform int tileSize;
+uniform int tilesX, tilesY, slices;
+uniform float front, back;
+uniform int width, height;      // Of the window this pass draws into
+
+out vec4 fragColor;
+
+void main()
+{
+    ivec2 pixel = GbufferPixel(gl_FragCoord.xy, vec2(width, height));
+    vec4 worldPos = GbufferPosition(pixel);
+    fragColor = vec4(0);
+    if (GbufferIsSky(pixel) || worldPos.w < front)
+        return;
+
+    vec3 normalVec = GbufferNormal(pixel);
+    vec3 Kd = GbufferDiffuse(pixel);
+    vec3 Ks = GbufferSpecular(pixel);
+    float shininess = GbufferShininess(pixel);
+    vec3 eyePos = (WorldInverse*vec4(0, 0, 0, 1)).xyz;
+
+    // The same cluster LightClusters::Slice picks for this depth
+    ivec2 tile = min(pixel / tileSize, ivec2(tilesX, tilesY) - 1);
+    int slice = clamp(int(log(worldPos.w/front) / log(back/front) * slices), 0, slices - 1);
+    uvec2 cluster = clusters[(slice*tilesY + tile.y)*tilesX + tile.x];
+
+    vec3 outColor = vec3(0);
+    for (uint k = cluster.x; k < cluster.x + cluster.y; k++) {
+        Light l = lights[lightIndices[k]];
+        outColor += LocalLight(l.posRadius.xyz, l.posRadius.w, l.color.xyz,
+                               worldPos.xyz, normalVec, eyePos, Kd, Ks, shininess);
+    }
+    fragColor.xyz = outColor;
+}
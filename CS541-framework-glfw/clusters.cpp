@@ -0,0 +1,140 @@
+///////////////////////////////////////////////////////////////////////
+// Clustered light culling for the local lights.  See clusters.h.
+////////////////////////////////////////////////////////////////////////
+
+#include "math.h"
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#include <glm/glm.hpp>
+
+#include "clusters.h"
+#include "lights.h"
+#include "trace.h"
+#include "workers.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line clusters.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+void LightClusters::Create()
+{
+    tilesX = tilesY = 1;
+    lightCount = indexCount = 0;
+    glGenBuffers(1, &clusterBuffer);
+    glGenBuffers(1, &indexBuffer);
+}
+
+// Depth slices are spaced logarithmically, so each spans the same
+// ratio of far to near depth
+int LightClusters::Slice(const float depth)
+{
+    int s = int(log(depth/front)/log(back/front)*Slices);
+    return std::min(std::max(s, 0), Slices - 1);
+}
+
+void LightClusters::BinLights(const int first, const int last, std::vector<glm::uvec2>& pairs, LightSystem& lights,
+                              const glm::mat4& view, const glm::mat4& proj, const int width, const int height)
+{
+    TRACE_SCOPE("Light binning");
+    pairs.clear();
+    for (int i = first; i < last; i++) {
+        glm::vec3 c = glm::vec3(view*glm::vec4(lights.x[i], lights.y[i], lights.z[i], 1.0f));
+        const float r = lights.radius[i];
+
+        // Depth range of the sphere, clipped to the frustum
+        const float depth = -c.z;
+        const float dmin = std::max(depth - r, front);
+        const float dmax = std::min(depth + r, back);
+        if (dmax <= dmin)
+            continue;
+
+        // Screen rectangle of the sphere's view space box.  x/depth is
+        // extreme at the box's corners, so the nearest and farthest
+        // depths bound it.
+        const float x0 = proj[0][0]*std::min((c.x - r)/dmin, (c.x - r)/dmax);
+        const float x1 = proj[0][0]*std::max((c.x + r)/dmin, (c.x + r)/dmax);
+        const float y0 = proj[1][1]*std::min((c.y - r)/dmin, (c.y - r)/dmax);
+        const float y1 = proj[1][1]*std::max((c.y + r)/dmin, (c.y + r)/dmax);
+        if (x1 < -1.0f || x0 > 1.0f || y1 < -1.0f || y0 > 1.0f)
+            continue;
+
+        const int tx0 = std::max(0, int((x0*0.5f + 0.5f)*width)/TileSize);
+        const int tx1 = std::min(tilesX - 1, int((x1*0.5f + 0.5f)*width)/TileSize);
+        const int ty0 = std::max(0, int((y0*0.5f + 0.5f)*height)/TileSize);
+        const int ty1 = std::min(tilesY - 1, int((y1*0.5f + 0.5f)*height)/TileSize);
+        const int s0 = Slice(dmin), s1 = Slice(dmax);
+
+        for (int s = s0; s <= s1; s++)
+            for (int ty = ty0; ty <= ty1; ty++)
+                for (int tx = tx0; tx <= tx1; tx++)
+                    pairs.push_back(glm::uvec2((s*tilesY + ty)*tilesX + tx, i));
+    }
+}
+
+void LightClusters::Build(LightSystem& lights, const glm::mat4& view, const glm::mat4& proj,
+                          const int width, const int height, const float _front, const float _back)
+{
+    tilesX = (width + TileSize - 1)/TileSize;
+    tilesY = (height + TileSize - 1)/TileSize;
+    front = _front;
+    back = _back;
+    lightCount = lights.count;
+    const int clusterCount = tilesX*tilesY*Slices;
+
+    // Split the lights between the worker threads
+    const int threadCount = Workers::Tasks(lightCount);
+    binned.resize(threadCount);
+    Workers::ParallelFor(lightCount, [&](int t, int first, int last) {
+        BinLights(first, last, binned[t], lights, view, proj, width, height); });
+
+    // Counting sort of the pairs by cluster: count, prefix sum, fill
+    clusterData.assign(clusterCount, glm::uvec2(0));
+    for (int t = 0; t < threadCount; t++)
+        for (unsigned int p = 0; p < binned[t].size(); p++)
+            clusterData[binned[t][p].x].y++;
+    unsigned int offset = 0;
+    for (int c = 0; c < clusterCount; c++) {
+        clusterData[c].x = offset;
+        offset += clusterData[c].y;
+        clusterData[c].y = 0;
+    }
+    indexCount = offset;
+    indexData.resize(std::max(indexCount, 1));
+    for (int t = 0; t < threadCount; t++)
+        for (unsigned int p = 0; p < binned[t].size(); p++) {
+            glm::uvec2& cluster = clusterData[binned[t][p].x];
+            indexData[cluster.x + cluster.y++] = binned[t][p].y;
+        }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clusterData.size()*sizeof(glm::uvec2), &clusterData[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, indexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, indexData.size()*sizeof(unsigned int), &indexData[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    CHECKERROR;
+}
+
+void LightClusters::Bind(LightSystem& lights, const int programId)
+{
+    lights.Bind(LightBinding);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ClusterBinding, clusterBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, IndexBinding, indexBuffer);
+
+    int loc = glGetUniformLocation(programId, "tileSize");
+    glUniform1i(loc, TileSize);
+    loc = glGetUniformLocation(programId, "tilesX");
+    glUniform1i(loc, tilesX);
+    loc = glGetUniformLocation(programId, "tilesY");
+    glUniform1i(loc, tilesY);
+    loc = glGetUniformLocation(programId, "slices");
+    glUniform1i(loc, Slices);
+    loc = glGetUniformLocation(programId, "front");
+    glUniform1f(loc, front);
+    loc = glGetUniformLocation(programId, "back");
+    glUniform1f(loc, back);
+}
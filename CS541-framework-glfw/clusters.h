@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////
+// Clustered light culling for the local lights.
+//
+// The view frustum is divided into clusters: TileSize x TileSize pixel
+// screen tiles, each cut into Slices depth slices spaced
+// logarithmically between the front and back planes.  Build bins each
+// light into the clusters its sphere's bounds overlap, on worker
+// threads, and uploads each cluster's (first, count) range and the
+// packed light index lists to shader storage buffers for
+// clustered_lights.frag.  The lights themselves are bound from the
+// LightSystem's buffer.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _CLUSTERS_
+#define _CLUSTERS_
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class LightSystem;
+
+class LightClusters
+{
+public:
+    static const int TileSize = 64;
+    static const int Slices = 16;
+    // Shader storage bindings, see clustered_lights.frag
+    static const int LightBinding = 1;
+    static const int ClusterBinding = 2;
+    static const int IndexBinding = 3;
+
+    int tilesX, tilesY;
+    float front, back;
+    int lightCount;
+    int indexCount;             // Total over all clusters' lists
+
+    void Create();
+    void Build(LightSystem& lights, const glm::mat4& view, const glm::mat4& proj,
+               const int width, const int height, const float _front, const float _back);
+    // Binds the lights and lists and sets the grid's uniforms
+    void Bind(LightSystem& lights, const int programId);
+
+    int Slice(const float depth);
+
+private:
+    unsigned int clusterBuffer, indexBuffer;
+    std::vector<glm::uvec2> clusterData;
+    std::vector<unsigned int> indexData;
+
+    // (cluster, light) pairs found by each worker thread
+    std::vector<std::vector<glm::uvec2> > binned;
+
+    void BinLights(const int first, const int last, std::vector<glm::uvec2>& pairs, LightSystem& lights,
+                   const glm::mat4& view, const glm::mat4& proj, const int width, const int height);
+};
+
+#endif
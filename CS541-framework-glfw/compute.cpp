@@ -0,0 +1,287 @@
+///////////////////////////////////////////////////////////////////////
+// Compute kernels with a tunable work group size.  See compute.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <algorithm>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#include "shader.h"
+#include "compute.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line compute.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+// File (relative to the working directory) holding the tuned sizes
+static const char* tuningFile = "compute_tuning.txt";
+
+std::vector<ComputeKernel*> ComputeKernel::kernels;
+bool ComputeKernel::autotuning = false;
+int ComputeKernel::frame = 0;
+int ComputeKernel::autotuneStart = 0;
+
+ComputeKernel::ComputeKernel(const char* _name, const char* fileName, const std::vector<glm::ivec2>& _candidates)
+    : name(_name), candidates(_candidates), current(0), tuning(-1), timing(false), tuned(false), lastFrame(-1)
+{
+    variants = new ShaderVariants();
+    variants->AddShader(fileName, GL_COMPUTE_SHADER);
+    seconds.assign(candidates.size(), 0.0);
+    frames.assign(candidates.size(), 0);
+    kernels.push_back(this);
+}
+
+glm::ivec2 ComputeKernel::GroupSize()
+{
+    if (timing)
+        return candidates[tuning];
+    return candidates[current];
+}
+
+ShaderProgram* ComputeKernel::Program(const int candidate, const std::string& defines)
+{
+    return variants->Get(defines
+                         + ShaderDefine("GROUP_SIZE_X", candidates[candidate].x)
+                         + ShaderDefine("GROUP_SIZE_Y", candidates[candidate].y));
+}
+
+// Issues the compile of every candidate with this preamble, for the
+// driver to finish in the background
+void ComputeKernel::RequestCandidates(const std::string& defines)
+{
+    for (unsigned int c = 0; c < candidates.size(); c++)
+        Program(c, defines);
+}
+
+bool ComputeKernel::CandidateLinked(const int candidate)
+{
+    for (unsigned int d = 0; d < defineSets.size(); d++)
+        if (!Program(candidate, defineSets[d])->Linked())
+            return false;
+    return true;
+}
+
+ShaderProgram* ComputeKernel::Select(const std::string& defines)
+{
+    if (std::find(defineSets.begin(), defineSets.end(), defines) == defineSets.end()) {
+        defineSets.push_back(defines);
+        // A preamble new to the tuning: its candidates compile while
+        // this frame runs the current size
+        if (tuning >= 0) {
+            RequestCandidates(defines);
+            timing = false;
+        }
+    }
+    return Program(timing ? tuning : current, defines);
+}
+
+double ComputeKernel::Milliseconds(const int candidate)
+{
+    if (frames[candidate] == 0)
+        return 0.0;
+    return 1000.0*seconds[candidate]/frames[candidate];
+}
+
+void ComputeKernel::Dispatch(const int w, const int h)
+{
+    glm::ivec2 size = GroupSize();
+    DispatchGroups((w + size.x - 1)/size.x, (h + size.y - 1)/size.y);
+}
+
+void ComputeKernel::DispatchGroups(const int x, const int y)
+{
+    if (!timing) {
+        glDispatchCompute(x, y, 1);
+        return;
+    }
+
+    unsigned int id;
+    if (freeQueries.empty())
+        glGenQueries(1, &id);
+    else {
+        id = freeQueries.back();
+        freeQueries.pop_back();
+    }
+    glBeginQuery(GL_TIME_ELAPSED, id);
+    glDispatchCompute(x, y, 1);
+    glEndQuery(GL_TIME_ELAPSED);
+    CHECKERROR;
+
+    Query q = { id, tuning };
+    queries.push_back(q);
+
+    // A pass may dispatch several times per frame (e.g. once per
+    // shadow cascade); the time per frame is what gets compared.
+    if (lastFrame != frame) {
+        frames[tuning]++;
+        lastFrame = frame;
+    }
+}
+
+// Reads back the queries whose results have arrived.  They complete
+// in the order issued, so the first one still pending ends the scan.
+void ComputeKernel::CollectQueries()
+{
+    unsigned int done = 0;
+    for (; done < queries.size(); done++) {
+        GLint available = 0;
+        glGetQueryObjectiv(queries[done].id, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(queries[done].id, GL_QUERY_RESULT, &ns);
+        seconds[queries[done].candidate] += ns*1e-9;
+        freeQueries.push_back(queries[done].id);
+    }
+    queries.erase(queries.begin(), queries.begin() + done);
+}
+
+// Moves on to the next candidate once this one has run for enough
+// frames, and after the last one (and its results) keeps the fastest.
+// Returns true when this kernel's tuning is finished.
+bool ComputeKernel::AdvanceTuning()
+{
+    if (tuning < 0)
+        return true;
+    if (tuning < (int)candidates.size() && frames[tuning] >= FramesPerCandidate)
+        tuning++;
+    if (tuning < (int)candidates.size() || !queries.empty())
+        return false;
+
+    for (unsigned int c = 0; c < candidates.size(); c++)
+        if (frames[c] > 0 && (frames[current] == 0 || Milliseconds(c) < Milliseconds(current)))
+            current = c;
+    tuning = -1;
+    timing = false;
+    tuned = true;
+    return true;
+}
+
+void ComputeKernel::StartAutotune()
+{
+    for (unsigned int k = 0; k < kernels.size(); k++) {
+        ComputeKernel* kernel = kernels[k];
+        kernel->seconds.assign(kernel->candidates.size(), 0.0);
+        kernel->frames.assign(kernel->candidates.size(), 0);
+        kernel->lastFrame = -1;
+        // One size leaves nothing to choose (e.g. the kernels only run
+        // when the skydome changes)
+        kernel->tuning = kernel->candidates.size() > 1 ? 0 : -1;
+        kernel->timing = false;
+        if (kernel->tuning >= 0)
+            for (unsigned int d = 0; d < kernel->defineSets.size(); d++)
+                kernel->RequestCandidates(kernel->defineSets[d]);
+    }
+    autotuning = true;
+    autotuneStart = frame;
+    printf("Autotuning compute work group sizes on %s\n", (const char*)glGetString(GL_RENDERER));
+}
+
+void ComputeKernel::NextFrame()
+{
+    frame++;
+
+    bool finished = true;
+    for (unsigned int k = 0; k < kernels.size(); k++) {
+        ComputeKernel* kernel = kernels[k];
+        kernel->CollectQueries();
+        if (autotuning && !kernel->AdvanceTuning())
+            finished = false;
+        // Past the last candidate the tuning only waits for query results
+        kernel->timing = kernel->tuning >= 0 && kernel->tuning < (int)kernel->candidates.size()
+            && kernel->CandidateLinked(kernel->tuning);
+    }
+    if (!autotuning)
+        return;
+
+    // Kernels whose passes are not running (e.g. AO switched off) are
+    // never timed; give up on them and keep their current size.
+    if (!finished && frame - autotuneStart < MaxAutotuneFrames)
+        return;
+
+    autotuning = false;
+    for (unsigned int k = 0; k < kernels.size(); k++) {
+        ComputeKernel* kernel = kernels[k];
+        if (kernel->candidates.size() < 2)
+            continue;
+        if (kernel->tuning >= 0)
+            printf("  %-24s not timed, kept %dx%d\n", kernel->name.c_str(),
+                   kernel->candidates[kernel->current].x, kernel->candidates[kernel->current].y);
+        else
+            printf("  %-24s %dx%d  %.3f ms\n", kernel->name.c_str(),
+                   kernel->candidates[kernel->current].x, kernel->candidates[kernel->current].y,
+                   kernel->Milliseconds(kernel->current));
+        kernel->tuning = -1;
+        kernel->timing = false;
+    }
+    SaveTuning();
+}
+
+// Each line of the tuning file is: renderer <tab> kernel <tab> x <tab> y
+void ComputeKernel::LoadTuning()
+{
+    std::ifstream in(tuningFile);
+    if (!in)
+        return;
+    std::string renderer = (const char*)glGetString(GL_RENDERER);
+
+    int loaded = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string lineRenderer, kernelName;
+        int x, y;
+        if (!std::getline(fields, lineRenderer, '\t') || lineRenderer != renderer)
+            continue;
+        if (!std::getline(fields, kernelName, '\t') || !(fields >> x >> y))
+            continue;
+
+        for (unsigned int k = 0; k < kernels.size(); k++) {
+            if (kernels[k]->name != kernelName)
+                continue;
+            // A size the shader no longer offers is ignored
+            for (unsigned int c = 0; c < kernels[k]->candidates.size(); c++)
+                if (kernels[k]->candidates[c] == glm::ivec2(x, y)) {
+                    kernels[k]->current = c;
+                    kernels[k]->tuned = true;
+                    loaded++;
+                }
+        }
+    }
+    if (loaded > 0)
+        printf("Loaded %d tuned work group sizes for %s\n", loaded, renderer.c_str());
+}
+
+// Rewrites this renderer's lines, keeping those of other renderers.
+// Kernels never timed keep their default size out of the file, so a
+// later run still tunes them.
+void ComputeKernel::SaveTuning()
+{
+    std::string renderer = (const char*)glGetString(GL_RENDERER);
+
+    std::vector<std::string> others;
+    std::ifstream in(tuningFile);
+    std::string line;
+    while (std::getline(in, line))
+        if (!line.empty() && line.compare(0, renderer.size() + 1, renderer + "\t") != 0)
+            others.push_back(line);
+    in.close();
+
+    std::ofstream out(tuningFile);
+    if (!out) {
+        printf("Could not write %s\n", tuningFile);
+        return;
+    }
+    for (unsigned int i = 0; i < others.size(); i++)
+        out << others[i] << "\n";
+    for (unsigned int k = 0; k < kernels.size(); k++) {
+        if (!kernels[k]->tuned)
+            continue;
+        glm::ivec2 size = kernels[k]->candidates[kernels[k]->current];
+        out << renderer << "\t" << kernels[k]->name << "\t" << size.x << "\t" << size.y << "\n";
+    }
+}
@@ -0,0 +1,81 @@
+///////////////////////////////////////////////////////////////////////
+// Compute kernels with a tunable work group size.
+//
+// A ComputeKernel is a compute shader built with its group size
+// injected as GROUP_SIZE_X and GROUP_SIZE_Y #defines, from a short
+// list of candidate sizes the shader can run with.  Dispatch covers a
+// WxH image with groups of the current size, so callers no longer
+// work out the group counts themselves.
+//
+// Autotuning runs each candidate for a number of frames, timing its
+// dispatches with GL_TIME_ELAPSED queries read back (without stalling)
+// on later frames, then keeps the fastest.  Every candidate's programs
+// are requested when it starts, and a candidate is only run and timed
+// once they have finished linking, so no frame waits on a compile.  The winners are saved to
+// compute_tuning.txt under the GL_RENDERER string, so each GPU (or
+// llvmpipe) keeps its own sizes and the tuning is done only once.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _COMPUTE_
+#define _COMPUTE_
+
+#include <vector>
+#include <string>
+#include <glm/glm.hpp>
+
+class ShaderProgram;
+class ShaderVariants;
+
+class ComputeKernel
+{
+public:
+    std::string name;
+    ShaderVariants* variants;
+    std::vector<glm::ivec2> candidates;
+    int current;                // Index of the size in use
+    int tuning;                 // Index of the size being timed, or -1
+    bool timing;                // This frame runs candidate tuning (its programs are linked)
+    bool tuned;                 // current was timed (now or in a saved tuning) as the fastest
+
+    // Autotune measurements, per candidate
+    std::vector<double> seconds;
+    std::vector<int> frames;
+
+    ComputeKernel(const char* _name, const char* fileName, const std::vector<glm::ivec2>& _candidates);
+
+    // The permutation with these #defines at the size in use (or
+    // being timed); the program passed to Dispatch
+    ShaderProgram* Select(const std::string& defines="");
+    glm::ivec2 GroupSize();
+    double Milliseconds(const int candidate);   // Mean per frame, or 0 if untimed
+
+    void Dispatch(const int w, const int h);    // Groups covering a WxH image
+    void DispatchGroups(const int x, const int y);
+
+    static std::vector<ComputeKernel*> kernels;
+    static bool autotuning;
+    static int frame;
+    static const int FramesPerCandidate = 30;
+    static const int MaxAutotuneFrames = 1200;
+
+    static void StartAutotune();
+    static void NextFrame();    // Call once per frame, before any Dispatch
+    static void LoadTuning();
+    static void SaveTuning();
+
+private:
+    struct Query { unsigned int id; int candidate; };
+    std::vector<Query> queries;         // Issued, result not read yet
+    std::vector<unsigned int> freeQueries;
+    int lastFrame;                      // Last frame a dispatch was timed
+    std::vector<std::string> defineSets;    // Each preamble Select was called with
+    static int autotuneStart;
+
+    ShaderProgram* Program(const int candidate, const std::string& defines);
+    void RequestCandidates(const std::string& defines);
+    bool CandidateLinked(const int candidate);
+    void CollectQueries();
+    bool AdvanceTuning();
+};
+
+#endif
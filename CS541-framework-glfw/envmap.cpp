@@ -0,0 +1,325 @@
+///////////////////////////////////////////////////////////////////////
+// Split-sum image based lighting: a GGX prefiltered copy of the
+// skydome and the BRDF integration lookup table.  See envmap.h.
+////////////////////////////////////////////////////////////////////////
+
+#include "math.h"
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+
+#include "shader.h"
+#include "texture.h"
+#include "compute.h"
+#include "envmap.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line envmap.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+static const float PI = 3.14159265f;
+
+// The CPU path works from a copy of the skydome no wider than this.
+static const int maxSourceWidth = 1024;
+
+// Equirectangular mapping used by all the shaders:
+//   uv = (-atan(-d.y, -d.x)/(2*PI), acos(-d.z)/PI)
+static glm::vec3 DirectionFromUV(const float u, const float v)
+{
+    const float theta = PI*v;
+    const float phi = 2.0f*PI*u;
+    return glm::vec3(-sin(theta)*cos(phi), sin(theta)*sin(phi), -cos(theta));
+}
+
+static void UVFromDirection(const glm::vec3& d, float& u, float& v)
+{
+    u = -atan2(-d.y, -d.x)/(2.0f*PI);
+    u -= floor(u);
+    v = acos(std::max(-1.0f, std::min(1.0f, -d.z)))/PI;
+}
+
+static glm::vec2 Hammersley(const unsigned int i, const unsigned int n)
+{
+    unsigned int bits = i;
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return glm::vec2(float(i)/float(n), float(bits)*2.3283064365386963e-10f);
+}
+
+// A linear color, box filtered mip pyramid of the skydome
+struct EnvPyramid {
+    std::vector<std::vector<glm::vec3> > level;
+    std::vector<int> w, h;
+
+    glm::vec3 Sample(const float u, const float v, float lod) const
+    {
+        lod = std::max(0.0f, std::min(lod, float(level.size() - 1)));
+        const int l = int(lod + 0.5f);
+        const int x0 = int(floor(u*w[l] - 0.5f));
+        const int y0 = int(floor(v*h[l] - 0.5f));
+        const float fx = u*w[l] - 0.5f - x0;
+        const float fy = v*h[l] - 0.5f - y0;
+        glm::vec3 c;
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++) {
+                const int x = ((x0 + i) % w[l] + w[l]) % w[l];        // Wraps around in u
+                const int y = std::max(0, std::min(h[l] - 1, y0 + j)); // Clamps at the poles
+                c += level[l][y*w[l] + x]*((i ? fx : 1.0f - fx)*(j ? fy : 1.0f - fy));
+            }
+        return c;
+    }
+};
+
+struct PrefilterJob {
+    const EnvPyramid* src;
+    float* dst;
+    int w, h;
+    float alpha;
+    int sampleCount;
+};
+
+// GGX prefilter of rows [first,last) of one output level, with the
+// N=V=R assumption of the split-sum approximation.
+static void PrefilterRows(const PrefilterJob* job, const int first, const int last)
+{
+    const EnvPyramid& src = *job->src;
+    const float a2 = job->alpha*job->alpha;
+    const float texelSolidAngle = 4.0f*PI/(src.w[0]*src.h[0]);
+    const float footprintLod = log2(float(src.w[0])/job->w);
+
+    for (int j = first; j < last; j++)
+        for (int i = 0; i < job->w; i++) {
+            const glm::vec3 N = DirectionFromUV((i + 0.5f)/job->w, (j + 0.5f)/job->h);
+            float* out = job->dst + 4*(j*job->w + i);
+            float u, v;
+
+            // A perfect mirror is just a filtered copy of the source.
+            if (job->alpha == 0.0f) {
+                UVFromDirection(N, u, v);
+                glm::vec3 c = src.Sample(u, v, footprintLod);
+                out[0] = c.x;  out[1] = c.y;  out[2] = c.z;  out[3] = 1.0f;
+                continue;
+            }
+
+            const glm::vec3 up = fabs(N.z) < 0.999f ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0);
+            const glm::vec3 T = glm::normalize(glm::cross(up, N));
+            const glm::vec3 B = glm::cross(N, T);
+
+            glm::vec3 sum;
+            float weight = 0.0f;
+            for (int k = 0; k < job->sampleCount; k++) {
+                const glm::vec2 xi = Hammersley(k, job->sampleCount);
+                const float phi = 2.0f*PI*xi.x;
+                const float cosTheta = sqrt((1.0f - xi.y)/(1.0f + (a2 - 1.0f)*xi.y));
+                const float sinTheta = sqrt(1.0f - cosTheta*cosTheta);
+                const glm::vec3 H = T*(sinTheta*cos(phi)) + B*(sinTheta*sin(phi)) + N*cosTheta;
+                const glm::vec3 L = H*(2.0f*glm::dot(N, H)) - N;
+                const float NL = glm::dot(N, L);
+                if (NL <= 0.0f)
+                    continue;
+
+                // Pick the source level whose texels match the solid angle of this sample
+                const float d = (cosTheta*cosTheta*(a2 - 1.0f) + 1.0f);
+                const float pdf = a2/(PI*d*d)/4.0f;
+                const float sampleSolidAngle = 1.0f/(job->sampleCount*pdf + 0.0001f);
+                const float lod = 0.5f*log2(sampleSolidAngle/texelSolidAngle) + 1.0f;
+
+                UVFromDirection(L, u, v);
+                sum += src.Sample(u, v, lod)*NL;
+                weight += NL;
+            }
+            if (weight > 0.0f)
+                sum /= weight;
+            out[0] = sum.x;  out[1] = sum.y;  out[2] = sum.z;  out[3] = 1.0f;
+        }
+}
+
+void PrefilteredEnvMap::Create(const int w, const int h, const int _levels, const int _lutSize)
+{
+    width = w;
+    height = h;
+    levels = _levels;
+    lutSize = _lutSize;
+
+    glGenTextures(1, &textureId);
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    int lw = width, lh = height;
+    for (int m = 0; m < levels; m++) {
+        glTexImage2D(GL_TEXTURE_2D, m, (int)GL_RGBA16F, lw, lh, 0, GL_RGBA, GL_FLOAT, NULL);
+        lw = std::max(1, lw/2);
+        lh = std::max(1, lh/2);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (int)GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (int)GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR_MIPMAP_LINEAR);
+
+    // Two channels: scale and bias applied to F0
+    glGenTextures(1, &brdfLutId);
+    glBindTexture(GL_TEXTURE_2D, brdfLutId);
+    glTexImage2D(GL_TEXTURE_2D, 0, (int)GL_RG16F, lutSize, lutSize, 0, GL_RG, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (int)GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (int)GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    CHECKERROR;
+}
+
+void PrefilteredEnvMap::PrefilterCPU(Texture* sky, const int sampleCount)
+{
+    // Read back the smallest mip of the skydome that still has enough
+    // detail, rather than keeping the full image around on the CPU.
+    glBindTexture(GL_TEXTURE_2D, sky->textureId);
+    int srcLevel = 0, sw = sky->width, sh = sky->height;
+    while (sw > maxSourceWidth && sh > 1) {
+        srcLevel++;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, srcLevel, GL_TEXTURE_WIDTH, &sw);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, srcLevel, GL_TEXTURE_HEIGHT, &sh);
+    }
+    std::vector<unsigned char> pixels(sw*sh*4);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, srcLevel, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    CHECKERROR;
+
+    // Linearize the same way the shaders do, then build a box filtered pyramid.
+    float toLinear[256];
+    for (int t = 0; t < 256; t++)
+        toLinear[t] = pow(t/255.0f, 2.2f);
+
+    EnvPyramid pyramid;
+    pyramid.w.push_back(sw);
+    pyramid.h.push_back(sh);
+    pyramid.level.push_back(std::vector<glm::vec3>(sw*sh));
+    for (int p = 0; p < sw*sh; p++)
+        pyramid.level[0][p] = glm::vec3(toLinear[pixels[4*p]], toLinear[pixels[4*p + 1]], toLinear[pixels[4*p + 2]]);
+    while (pyramid.w.back() > 1 && pyramid.h.back() > 1) {
+        const int pw = pyramid.w.back(), ph = pyramid.h.back();
+        const int nw = pw/2, nh = ph/2;
+        const std::vector<glm::vec3>& prev = pyramid.level.back();
+        std::vector<glm::vec3> next(nw*nh);
+        for (int j = 0; j < nh; j++)
+            for (int i = 0; i < nw; i++)
+                next[j*nw + i] = (prev[(2*j)*pw + 2*i] + prev[(2*j)*pw + 2*i + 1]
+                                  + prev[(2*j + 1)*pw + 2*i] + prev[(2*j + 1)*pw + 2*i + 1])*0.25f;
+        pyramid.level.push_back(next);
+        pyramid.w.push_back(nw);
+        pyramid.h.push_back(nh);
+    }
+
+    int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<float> result;
+
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    int lw = width, lh = height;
+    for (int m = 0; m < levels; m++) {
+        result.resize(lw*lh*4);
+        PrefilterJob job;
+        job.src = &pyramid;
+        job.dst = &result[0];
+        job.w = lw;
+        job.h = lh;
+        job.alpha = float(m)/(levels - 1);
+        job.sampleCount = sampleCount;
+
+        // Split the rows of this level between the worker threads
+        std::vector<std::thread> workers;
+        const int rowsPerThread = (lh + threadCount - 1)/threadCount;
+        for (int first = 0; first < lh; first += rowsPerThread)
+            workers.push_back(std::thread(PrefilterRows, &job, first, std::min(lh, first + rowsPerThread)));
+        for (unsigned int t = 0; t < workers.size(); t++)
+            workers[t].join();
+
+        glTexSubImage2D(GL_TEXTURE_2D, m, 0, 0, lw, lh, GL_RGBA, GL_FLOAT, &result[0]);
+        lw = std::max(1, lw/2);
+        lh = std::max(1, lh/2);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    CHECKERROR;
+}
+
+void PrefilteredEnvMap::PrefilterGPU(ComputeKernel* kernel, Texture* sky, const int sampleCount)
+{
+    ShaderProgram* program = kernel->Select();
+    program->Use();
+    int programId = program->programId;
+    sky->Bind(0, programId, "SkydomeTex");
+
+    int loc = glGetUniformLocation(programId, "sample_count");
+    glUniform1i(loc, sampleCount);
+    loc = glGetUniformLocation(programId, "skydome_width");
+    glUniform1i(loc, sky->width);
+    loc = glGetUniformLocation(programId, "skydome_height");
+    glUniform1i(loc, sky->height);
+
+    int lw = width, lh = height;
+    for (int m = 0; m < levels; m++) {
+        loc = glGetUniformLocation(programId, "roughness");
+        glUniform1f(loc, float(m)/(levels - 1));
+        loc = glGetUniformLocation(programId, "width");
+        glUniform1i(loc, lw);
+        loc = glGetUniformLocation(programId, "height");
+        glUniform1i(loc, lh);
+
+        loc = glGetUniformLocation(programId, "dst");
+        glBindImageTexture(0, textureId, m, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glUniform1i(loc, 0);
+
+        kernel->Dispatch(lw, lh);
+        lw = std::max(1, lw/2);
+        lh = std::max(1, lh/2);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    sky->Unbind();
+    program->Unuse();
+    CHECKERROR;
+}
+
+void PrefilteredEnvMap::ComputeBrdfLUT(ComputeKernel* kernel, const int sampleCount)
+{
+    ShaderProgram* program = kernel->Select();
+    program->Use();
+    int loc = glGetUniformLocation(program->programId, "sample_count");
+    glUniform1i(loc, sampleCount);
+    loc = glGetUniformLocation(program->programId, "size");
+    glUniform1i(loc, lutSize);
+
+    loc = glGetUniformLocation(program->programId, "dst");
+    glBindImageTexture(0, brdfLutId, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG16F);
+    glUniform1i(loc, 0);
+
+    kernel->Dispatch(lutSize, lutSize);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    program->Unuse();
+    CHECKERROR;
+}
+
+void PrefilteredEnvMap::Bind(const int unit, const int programId, const char* name)
+{
+    glActiveTexture((gl::GLenum)((int)GL_TEXTURE0 + unit));
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    int loc = glGetUniformLocation(programId, name);
+    glUniform1i(loc, unit);
+}
+
+void PrefilteredEnvMap::BindBrdfLUT(const int unit, const int programId, const char* name)
+{
+    glActiveTexture((gl::GLenum)((int)GL_TEXTURE0 + unit));
+    glBindTexture(GL_TEXTURE_2D, brdfLutId);
+    int loc = glGetUniformLocation(programId, name);
+    glUniform1i(loc, unit);
+}
@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////
+// Split-sum image based lighting.  A PrefilteredEnvMap holds a copy
+// of a skydome, convolved with the GGX lobe, where mip level m
+// corresponds to roughness m/(levels-1), and the 2D BRDF integration
+// lookup table indexed by (N.V, roughness).  With both, the specular
+// IBL term in the lighting pass costs two texture fetches instead of
+// a loop of importance samples.
+//
+// The prefiltering can be done either on the CPU (worker threads
+// reading a copy of the skydome's pixels) or with a compute shader.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _ENVMAP_
+#define _ENVMAP_
+
+class ComputeKernel;
+class Texture;
+
+class PrefilteredEnvMap
+{
+public:
+    unsigned int textureId = 0;
+    unsigned int brdfLutId = 0;
+    int width, height;      // Size of mip level 0
+    int levels;
+    int lutSize;
+
+    void Create(const int w, const int h, const int _levels, const int _lutSize=128);
+    void PrefilterCPU(Texture* sky, const int sampleCount);
+    void PrefilterGPU(ComputeKernel* kernel, Texture* sky, const int sampleCount);
+    void ComputeBrdfLUT(ComputeKernel* kernel, const int sampleCount);
+
+    void Bind(const int unit, const int programId, const char* name);
+    void BindBrdfLUT(const int unit, const int programId, const char* name);
+};
+
+#endif
@@ -11,34 +11,94 @@
 using namespace gl;
 
 #include "fbo.h"
+#include "trace.h"
 
+GLenum ExternalFormat(const GLenum internalFormat)
+{
+    switch (internalFormat) {
+    case GL_R8:
+    case GL_R16F:
+    case GL_R32F:
+        return GL_RED;
+    case GL_RG8:
+    case GL_RG16F:
+    case GL_RG32F:
+        return GL_RG;
+    case GL_R11F_G11F_B10F:
+        return GL_RGB;
+    default:
+        return GL_RGBA;
+    }
+}
 
+size_t BytesPerTexel(const GLenum internalFormat)
+{
+    switch (internalFormat) {
+    case GL_RGBA32F:
+        return 16;
+    case GL_RGBA16F:
+    case GL_RG32F:
+        return 8;
+    case GL_R8:
+        return 1;
+    case GL_R16F:
+    case GL_RG8:
+        return 2;
+    case GL_NONE:
+        return 0;
+    default:                    // RGBA8, SRGB8_ALPHA8, RG16F, R11F_G11F_B10F, R32F, depth
+        return 4;
+    }
+}
 
-void FBO::CreateFBO(const int w, const int h, const int _color_attachment_count)
+void FBO::CreateFBO(const int w, const int h, const int _color_attachment_count,
+                    const GLenum* _formats, const bool depthTexture)
 {
+    TRACE_SCOPE("FBO create");
     width = w;
     height = h;
     color_attachment_count = _color_attachment_count;
+    for (int i = 0; i < color_attachment_count; i++) {
+        formats[i] = _formats ? _formats[i] : GL_RGBA32F;
+        levels[i] = 1;
+    }
     glGenFramebuffersEXT(1, &fboID);
     glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fboID);
 
-    // Create a render buffer, and attach it to FBO's depth attachment
-    unsigned int depthBuffer;
-    glGenRenderbuffersEXT(1, &depthBuffer);
-    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depthBuffer);
-    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT,
-                             width, height);
-    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT,
-                                 GL_RENDERBUFFER_EXT, depthBuffer);
-
-    // Create a texture and attach FBO's color 0 attachment.  The
-    // GL_RGBA32F and GL_RGBA constants set this texture to be 32 bit
-    // floats for each of the 4 components.  Many other choices are
-    // possible.
+    if (depthTexture) {
+        // A depth texture, so later passes can rebuild positions from it
+        glGenTextures(1, &depthTextureID);
+        glBindTexture(GL_TEXTURE_2D, depthTextureID);
+        glTexImage2D(GL_TEXTURE_2D, 0, (int)GL_DEPTH_COMPONENT24, width, height, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_NEAREST);
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT,
+                                  GL_TEXTURE_2D, depthTextureID, 0);
+    }
+    else {
+        // Create a render buffer, and attach it to FBO's depth attachment
+        glGenRenderbuffersEXT(1, &depthBufferID);
+        glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depthBufferID);
+        glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT,
+                                 width, height);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT,
+                                     GL_RENDERBUFFER_EXT, depthBufferID);
+    }
+
+    // Create a texture and attach FBO's color 0 attachment.  By
+    // default GL_RGBA32F sets this texture to be 32 bit floats for
+    // each of the 4 components; the caller may pick a smaller format
+    // per attachment.
     for (int i = 0; i < color_attachment_count; i++) {
+        if (formats[i] == GL_NONE) {
+            textureID[i] = 0;
+            continue;
+        }
         glGenTextures(1, &textureID[i]);
         glBindTexture(GL_TEXTURE_2D, textureID[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, (int)GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexImage2D(GL_TEXTURE_2D, 0, (int)formats[i], width, height, 0, ExternalFormat(formats[i]), GL_FLOAT, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (int)GL_CLAMP_TO_EDGE);
@@ -74,24 +134,156 @@ void FBO::UnbindTexture(const int texture_unit) {
     glBindTexture(GL_TEXTURE_2D, 0); // Load texture into it
 }
 
+void FBO::BindDepthTexture(const int program_id, const int texture_unit, const char* var_name) {
+    glActiveTexture((gl::GLenum)(int)GL_TEXTURE0 + texture_unit);
+    glBindTexture(GL_TEXTURE_2D, depthTextureID);
+    int loc = glGetUniformLocation(program_id, var_name);
+    glUniform1i(loc, texture_unit);
+}
+
+void FBO::AllocateMips(const int color_attachment, const int mipLevels) {
+    levels[color_attachment] = mipLevels + 1;
+    glBindTexture(GL_TEXTURE_2D, textureID[color_attachment]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, mipLevels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR_MIPMAP_LINEAR);
+
+    int mip_width = width / 2;
+    int mip_height = height / 2;
+    GLenum format = formats[color_attachment];
+    for (int mip_level = 0; mip_level < mipLevels; ++mip_level) {
+        glTexImage2D(GL_TEXTURE_2D, mip_level + 1, (int)format,
+                     mip_width, mip_height, 0, ExternalFormat(format), GL_FLOAT, NULL);
+        mip_width /= 2;
+        mip_height /= 2;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+size_t FBO::Bytes() {
+    if (fboID == 0)
+        return 0;
+    size_t bytes = size_t(width)*height*4;     // Depth
+    for (int i = 0; i < color_attachment_count; i++) {
+        int w = width, h = height;
+        for (int m = 0; m < levels[i]; m++) {
+            bytes += size_t(w)*h*BytesPerTexel(formats[i]);
+            w /= 2;
+            h /= 2;
+        }
+    }
+    return bytes;
+}
+
 void FBO::DeleteFBO() {
     if (fboID == 0)
         return;
 
-    glDeleteTextures(color_attachment_count, textureID);
+    for (int i = 0; i < color_attachment_count; i++)
+        if (textureID[i] != 0)
+            glDeleteTextures(1, &textureID[i]);
+    if (depthTextureID != 0)
+        glDeleteTextures(1, &depthTextureID);
+    if (depthBufferID != 0)
+        glDeleteRenderbuffersEXT(1, &depthBufferID);
+    depthTextureID = depthBufferID = 0;
     glDeleteFramebuffers(1, &fboID);
+    fboID = 0;
 }
 
 void FBO::Resize(const int w, const int h) {
     glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fboID);
     for (int i = 0; i < color_attachment_count; i++) {
+        if (textureID[i] == 0)
+            continue;
         glBindTexture(GL_TEXTURE_2D, textureID[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, (int)GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexImage2D(GL_TEXTURE_2D, 0, (int)formats[i], w, h, 0, ExternalFormat(formats[i]), GL_FLOAT, NULL);
         glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, (gl::GLenum)((int)GL_COLOR_ATTACHMENT0_EXT + i),
             GL_TEXTURE_2D, textureID[i], 0);
     }
+    if (depthTextureID != 0) {
+        glBindTexture(GL_TEXTURE_2D, depthTextureID);
+        glTexImage2D(GL_TEXTURE_2D, 0, (int)GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    }
     int status = (int)glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
     if (status != int(GL_FRAMEBUFFER_COMPLETE_EXT))
         printf("FBO Error: %d\n", status);
     glBindTexture(GL_TEXTURE_2D, 0);
-}
\ No newline at end of file
+}
+
+void LayeredFBO::CreateFBO(const int w, const int h, const int _layers, const GLenum _format)
+{
+    TRACE_SCOPE("Layered FBO create");
+    width = w;
+    height = h;
+    layers = _layers;
+    format = _format;
+    glGenFramebuffersEXT(1, &fboID);
+
+    glGenTextures(1, &depthTextureID);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depthTextureID);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, (int)GL_DEPTH_COMPONENT24, width, height, layers, 0,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, (int)GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (int)GL_NEAREST);
+
+    glGenTextures(1, &textureID);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, (int)format, width, height, layers, 0,
+                 ExternalFormat(format), GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, (int)GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, (int)GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // Check for completeness with the first layer attached
+    BindLayer(0);
+    int status = (int)glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+    if (status != int(GL_FRAMEBUFFER_COMPLETE_EXT))
+        printf("FBO Error: %d\n", status);
+    Unbind();
+}
+
+// Binds the FBO with the given layer of each array attached.  The
+// attachments stay in place after Unbind, e.g. for a blit.
+void LayeredFBO::BindLayer(const int layer)
+{
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fboID);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureID, 0, layer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTextureID, 0, layer);
+}
+
+void LayeredFBO::BindLayered()
+{
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fboID);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureID, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTextureID, 0);
+}
+
+void LayeredFBO::Unbind() { glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0); }
+
+void LayeredFBO::BindTexture(const int program_id, const int texture_unit, const char* var_name) {
+    glActiveTexture((gl::GLenum)(int)GL_TEXTURE0 + texture_unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+    int loc = glGetUniformLocation(program_id, var_name);
+    glUniform1i(loc, texture_unit);
+}
+
+void LayeredFBO::DeleteFBO() {
+    if (fboID == 0)
+        return;
+    glDeleteTextures(1, &textureID);
+    glDeleteTextures(1, &depthTextureID);
+    textureID = depthTextureID = 0;
+    glDeleteFramebuffers(1, &fboID);
+    fboID = 0;
+}
+
+size_t LayeredFBO::Bytes() {
+    if (fboID == 0)
+        return 0;
+    return size_t(width)*height*layers*(4 + BytesPerTexel(format));
+}
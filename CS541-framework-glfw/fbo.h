@@ -6,17 +6,56 @@
 // texture.
 ////////////////////////////////////////////////////////////////////////
 
+#include <cstddef>
+
 class FBO {
 public:
+    static const int MaxAttachments = 5;
     unsigned int fboID=0;
-    unsigned int textureID[4] = {0, 0, 0, 0};
+    unsigned int textureID[MaxAttachments] = {0, 0, 0, 0, 0};
+    unsigned int depthTextureID = 0;    // Only with a depth texture, else a renderbuffer
+    unsigned int depthBufferID = 0;
+    GLenum formats[MaxAttachments];  // Internal format per color attachment, GL_NONE to leave it empty
+    int levels[MaxAttachments];      // Mip levels per color attachment
     int width, height;  // Size of the texture.
     unsigned int color_attachment_count;
-    void CreateFBO(const int w, const int h, const int _color_attachment_count=1);
+    // Attachments are GL_RGBA32F unless _formats is given.  With
+    // depthTexture the depth is kept in a sampleable texture.
+    void CreateFBO(const int w, const int h, const int _color_attachment_count=1,
+                   const GLenum* _formats=NULL, const bool depthTexture=false);
     void Bind();
     void Unbind();
     void BindTexture(const int program_id, const int texture_unit, const char* var_name, const int color_attachment=0);
     void UnbindTexture(const int texture_unit);
     void Resize(const int w, const int h);
     void DeleteFBO();
+    void BindDepthTexture(const int program_id, const int texture_unit, const char* var_name);
+    // Gives a color attachment mip levels 1..mipLevels below the base
+    void AllocateMips(const int color_attachment, const int mipLevels);
+    // Video memory held by the attachments, mips and depth buffer
+    size_t Bytes();
+};
+
+// A render target whose color and depth are 2D texture arrays.
+// BindLayer renders into one layer; the color array is sampled as a
+// sampler2DArray.
+class LayeredFBO {
+public:
+    unsigned int fboID=0;
+    unsigned int textureID = 0;
+    unsigned int depthTextureID = 0;
+    GLenum format;
+    int width, height, layers;
+    void CreateFBO(const int w, const int h, const int _layers, const GLenum _format=GL_RGBA32F);
+    void BindLayer(const int layer);
+    // Attaches every layer at once, for shaders writing gl_Layer
+    void BindLayered();
+    void Unbind();
+    void BindTexture(const int program_id, const int texture_unit, const char* var_name);
+    void DeleteFBO();
+    size_t Bytes();
 };
+
+// Matching pixel format for glTexImage2D with a NULL pointer
+GLenum ExternalFormat(const GLenum internalFormat);
+size_t BytesPerTexel(const GLenum internalFormat);
@@ -12,62 +12,85 @@ const int IBL_M = 3;
 
 out vec4 FragColor;
 
-uniform mat4 ShadowMatrix, WorldInverse;
+uniform mat4 WorldInverse;
 
 uniform vec3 lightPos;
 uniform vec3 light, ambient;
 
-uniform sampler2D upperReflectionMap;
-uniform sampler2D lowerReflectionMap;
-uniform sampler2D gBufferWorldPos;
-uniform sampler2D gBufferNormalVec;
-uniform sampler2D gBufferDiffuse;
-uniform sampler2D gBufferSpecular;
-uniform sampler2D shadowMap;
-uniform sampler2D SkydomeTex;
-uniform sampler2D IrrMapTex;
+uniform sampler2DArray reflectionMaps;    // Layer 0 the upper paraboloid, 1 the lower
+uniform sampler2D SpecularEnvTex;
+uniform sampler2D BrdfLUT;
 uniform sampler2D AOMap;
 uniform sampler2D AOMap_1;
 uniform sampler2D AOMap_2;
-uniform int skydome_width;
-uniform int skydome_height;
+uniform int specularEnvLevels;
+#ifdef REFLECTION_MODE
+const int reflectionMode = REFLECTION_MODE;
+#else
 uniform int reflectionMode;
+#endif
+#ifdef REFLECTION_SOURCE
+const int reflectionSource = REFLECTION_SOURCE;
+#else
+uniform int reflectionSource;
+#endif
 uniform int textureMode;
+#ifdef LIGHTING_MODE
+const int lightingMode = LIGHTING_MODE;
+#else
 uniform int lightingMode;
+#endif
+#ifdef DRAW_FBO
+const int drawFbo = DRAW_FBO;
+#else
 uniform int drawFbo;
+#endif
 uniform float shininess;
 uniform int width, height;
-uniform float min_depth, max_depth;
+#ifdef AO_ENABLED
+const int ao_enabled = AO_ENABLED;
+#else
 uniform int ao_enabled;
+#endif
 
 uniform float bloomThreshold;
 
-uniform HammersleyBlock {
-    float sampling_count;
-    float hammersley[2*100];
-};
+#include "irradiance_sh.glsl"
+#include "gbuffer.glsl"
+#include "shadow_cascades.glsl"
+#include "ssr.glsl"
+
+#ifdef COMPACT_GBUFFER
+uniform sampler2D SkydomeTex;
+#endif
 
 layout(location = 0) out vec4 RenderBuffer;
 layout(location = 1) out vec4 PostProcessBuffer;
 
+
 void main()
 {
     //Following lines of code all read in values from the gbuffer
     //=================================================================
     vec2 uv = gl_FragCoord.xy / vec2(width, height);
-    vec4 worldPos = texture2D(gBufferWorldPos, uv);
-    vec3 normalVec = texture2D(gBufferNormalVec, uv).xyz;
-    vec3 Kd = texture2D(gBufferDiffuse, uv).xyz;
-    vec3 ao_factor = texture(AOMap_2, uv).xyz;
-    vec3 Ks = texture2D(gBufferSpecular, uv).xyz;
-    float shininess = texture2D(gBufferSpecular, uv).w;
-    bool reflective = true;
-    if (texture2D(gBufferDiffuse, uv).w == 0)
-        reflective = false;
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 worldPos = GbufferPosition(pixel);
+    vec3 normalVec = GbufferNormal(pixel);
+    vec3 Kd = GbufferDiffuse(pixel);
+    vec3 ao_factor = texture(AOMap_2, uv).xxx;
+    vec3 Ks = GbufferSpecular(pixel);
+    float shininess = GbufferShininess(pixel);
+    bool reflective = GbufferReflective(pixel);
+    vec3 eyePos = (WorldInverse*vec4(0, 0, 0, 1)).xyz;
 
     bool isSkyDome = false;
-    if (texture2D(gBufferNormalVec, uv).w == 1){
+    if (GbufferIsSky(pixel)){
         isSkyDome = true;
+#ifdef COMPACT_GBUFFER
+        vec3 V = normalize(eyePos - worldPos.xyz);
+        vec2 skyUV = vec2(-atan(V.y, V.x)/(2*PI), acos(V.z)/PI);
+        Kd = pow(texture2D(SkydomeTex, skyUV).xyz, vec3(2.2));
+#endif
         FragColor.xyz = Kd;
         RenderBuffer = FragColor;
 
@@ -81,8 +104,7 @@ void main()
     }
         
 
-    vec4 shadowCoord = ShadowMatrix*vec4(worldPos.xyz, 1.0);
-    vec3 eyePos = (WorldInverse*vec4(0, 0, 0, 1)).xyz;
+    vec4 cascade = ShadowCascadeCoord(worldPos.xyz);
     //=================================================================
 
 
@@ -91,7 +113,7 @@ void main()
 
     if (drawFbo == 0){
         float light_depth;
-        light_depth = texture2D(shadowMap, uv).x;
+        light_depth = ShadowMoments(vec4(uv, 0, 0)).x;
         light_depth = light_depth;
         FragColor.x = light_depth;
         FragColor.y = FragColor.x;
@@ -101,7 +123,7 @@ void main()
     }
     if (drawFbo == 1){
         float light_depth;
-        light_depth = texture2D(shadowMap, uv).y;
+        light_depth = ShadowMoments(vec4(uv, 0, 0)).y;
         light_depth = light_depth;
         FragColor.x = light_depth;
         FragColor.y = FragColor.x;
@@ -111,7 +133,7 @@ void main()
     }
     if (drawFbo == 2){
         float light_depth;
-        light_depth = texture2D(shadowMap, uv).z;
+        light_depth = ShadowMoments(vec4(uv, 0, 0)).z;
         light_depth = light_depth;
         FragColor.x = light_depth;
         FragColor.y = FragColor.x;
@@ -121,7 +143,7 @@ void main()
     }
     if (drawFbo == 3){
         float light_depth;
-        light_depth = texture2D(shadowMap, uv).w;
+        light_depth = ShadowMoments(vec4(uv, 0, 0)).w;
         light_depth = light_depth;
         FragColor.x = light_depth;
         FragColor.y = FragColor.x;
@@ -130,47 +152,47 @@ void main()
         return;
     }
     if (drawFbo == 4){
-        FragColor.xyz = texture2D(upperReflectionMap, uv).xyz;
+        FragColor.xyz = texture(reflectionMaps, vec3(uv, 0)).xyz;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 5){
-        FragColor.xyz = texture2D(lowerReflectionMap, uv).xyz;
+        FragColor.xyz = texture(reflectionMaps, vec3(uv, 1)).xyz;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 6){
-        FragColor.xyz = texture2D(gBufferWorldPos, uv).xyz/100;
+        FragColor.xyz = worldPos.xyz/100;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 7){
-        FragColor.xyz = abs(texture2D(gBufferNormalVec, uv).xyz);
+        FragColor.xyz = abs(normalVec);
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 8){
-        FragColor.xyz = texture2D(gBufferDiffuse, uv).xyz;
+        FragColor.xyz = Kd;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 9){
-        FragColor.xyz = texture2D(gBufferSpecular, uv).xyz;
+        FragColor.xyz = Ks;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 10){
-        FragColor.xyz = texture2D(AOMap, uv).xyz;
+        FragColor.xyz = texture2D(AOMap, uv).xxx;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 11){
-        FragColor.xyz = texture2D(AOMap_1, uv).xyz;
+        FragColor.xyz = texture2D(AOMap_1, uv).xxx;
         RenderBuffer = FragColor;
         return;
     }
     if (drawFbo == 12){
-        FragColor.xyz = texture2D(AOMap_2, uv).xyz;
+        FragColor.xyz = texture2D(AOMap_2, uv).xxx;
         RenderBuffer = FragColor;
         return;
     }
@@ -182,23 +204,14 @@ void main()
 
     float alpha;
     float light_depth, pixel_depth;
-    vec2 shadowIndex;
-    vec4 shadow_b;
-    if (shadowCoord.w > 0){
-        shadowIndex = shadowCoord.xy/shadowCoord.w;
-    }
+    vec4 shadow_b = vec4(0);
     pixel_depth = 0;
     light_depth = 1000;
-    if (shadowIndex.x >= 0 && shadowIndex.x <= 1){
-        if (shadowIndex.y >= 0 && shadowIndex.y <= 1){
-            shadow_b = texture2D(shadowMap, shadowIndex);
-            light_depth = shadow_b.x;
-            pixel_depth = shadowCoord.w;
-        }
+    if (cascade.w >= 0){
+        shadow_b = ShadowMoments(cascade);
+        light_depth = shadow_b.x;
+        pixel_depth = cascade.z;
     }
-    
-    //Convert absolute pixel_depth into relative pixel_depth
-    pixel_depth = (pixel_depth - min_depth) / (max_depth - min_depth);
 
     //Blurred shadow algorithm
     alpha =  3.0f/100000.0f;
@@ -260,6 +273,8 @@ void main()
                         ((pixel_depth - z2)*(pixel_depth - z3)));
         }
     }
+    if (cascade.w < 0)          // Beyond the last cascade
+        G = 0.0f;
 
     //Convert colors into linear color space for calculations
     Kd = pow(Kd, vec3(2.2));
@@ -285,78 +300,17 @@ void main()
     }
     else if (lightingMode == IBL_M){
         //Diffuse portion
-        vec2 uv = vec2(-atan(-N.y, -N.x)/(2*PI), acos(-N.z)/PI);
-        
-        vec3 irr_map_color = texture2D(IrrMapTex, uv).xyz;
-        irr_map_color = pow(irr_map_color, vec3(2.2));
+        vec3 irr_map_color = max(IrradianceSH(N), vec3(0));
 
+        //Specular portion with the split-sum approximation: the skydome
+        //prefiltered for this roughness, times Ks scaled and biased by
+        //the integrated BRDF (see envmap.cpp)
         vec3 R = (2*dot(N, V)*N) - V;
-        float NV = normalize(dot(N, V));
-        vec3 newH = normalize(R+V);
-        float RH = max(dot(R, newH), 0);
-        float NR = max(dot(N, R), 0.0);
-        float newNH = max(dot(N, newH), 0);
-        float NL;
-
-        vec3 A = normalize(vec3(-R.y, R.x, 0));
-        vec3 B = normalize(cross(R, A));
-        vec3 L;
-        vec3 omega_k;
-        vec3 spec_light;
-        vec3 spec_calc;
-        float lod;
-
-        float distribution;
-        vec3 fresnel;
-        float visibility;
-        float alpha_squared;
-        float g1_L;
-        float g1_V;
-        float tan_v_L;
-        float tan_v_V;
-        vec3 avg_light = vec3(0);
-
-        for(int i=0; i < sampling_count; i++) {
-            uv.x = hammersley[i*2];
-            uv.y = hammersley[(i*2)+1];
-            uv.y = atan((shininess * sqrt(uv.y)) / sqrt(1 - uv.y));
-            uv.y = uv.y/PI;
-            L = vec3(
-                cos(2*PI*(0.5 - uv.x)) * sin(PI*uv.y),
-                sin(2*PI*(0.5 - uv.x)) * sin(PI*uv.y),
-                cos(PI*uv.y)
-            );
-            omega_k = normalize(L.x*A + L.y*B + L.z*R);
-            //Using uv as texture coords here not the uv direction
-            uv = vec2(-atan(-omega_k.y, -omega_k.x)/(2*PI), acos(-omega_k.z)/PI);
-
-            alpha_squared = pow(shininess, 2);
-            distribution = alpha_squared / (PI * pow(pow(NH, 2) * (alpha_squared - 1.0) + 1, 2));
-            lod = (0.5 * log2((skydome_width*skydome_height) / sampling_count)) - (0.5*(log2(distribution)/4));
-            spec_light = textureLod(SkydomeTex, uv, lod).xyz;
-            //Gamma correction
-            spec_light = pow(spec_light, vec3(2.2));
-
-            H = normalize(omega_k+V);
-            LH = max(dot(omega_k, H), 0);
-            NL = max(dot(N, omega_k), 0.0);
-            fresnel = Ks + ((vec3(1,1,1) - Ks)*pow((1-LH), 5));
-            tan_v_L = sqrt(1.0 - (NL*NL))/(NL);
-            tan_v_V = sqrt(1.0 - (NV*NV))/(NV);
-            if (tan_v_L == 0)
-                g1_L = 0;
-            else
-                g1_L = 2.0/(1.0 + sqrt(1.0+(alpha_squared+(tan_v_L*tan_v_L))));
-            if (tan_v_V == 0)
-                g1_V = 0;
-            else
-                g1_V = 2.0/(1.0 + sqrt(1.0+(alpha_squared+(tan_v_V*tan_v_V))));
-            visibility = 1/(LH*LH);
-
-            avg_light += ((visibility*fresnel*spec_light)/(4) * NL);
-        }
-
-        spec_calc = avg_light/sampling_count;
+        float NV = max(dot(N, V), 0.0);
+        vec2 uv = vec2(-atan(-R.y, -R.x)/(2*PI), acos(-R.z)/PI);
+        vec3 prefiltered = textureLod(SpecularEnvTex, uv, shininess*(specularEnvLevels - 1)).xyz;
+        vec2 env_brdf = texture(BrdfLUT, vec2(NV, shininess)).xy;
+        vec3 spec_calc = prefiltered*(Ks*env_brdf.x + env_brdf.y);
       
         vec3 ambient_val = (Kd/PI)*irr_map_color;
         outColor = ambient_val + spec_calc;
@@ -401,16 +355,23 @@ void main()
         vec3 V = normalize(eyePos - worldPos.xyz);
         vec3 R = (2*dot(N, V)*N) - V;
         vec3 abc = normalize(R);
-        vec2 uv;
-        if (abc.z > 0)
+        if (reflectionSource == 1)
+        {
+            // Screen space, falling back to the prefiltered sky on a miss
+            vec3 hitColor;
+            float hit = ScreenSpaceReflection(worldPos.xyz, abc, hitColor);
+            vec2 uv = vec2(-atan(-abc.y, -abc.x)/(2*PI), acos(-abc.z)/PI);
+            reflectionColor = mix(textureLod(SpecularEnvTex, uv, 0).xyz, hitColor, hit);
+        }
+        else if (abc.z > 0)
         {
-            uv = vec2(abc.x/(1+abc.z), abc.y/(1+abc.z))*0.5 + vec2(0.5, 0.5);
-            reflectionColor = texture2D(upperReflectionMap, uv).xyz;
+            vec2 uv = vec2(abc.x/(1+abc.z), abc.y/(1+abc.z))*0.5 + vec2(0.5, 0.5);
+            reflectionColor = texture(reflectionMaps, vec3(uv, 0)).xyz;
         }
         else
         {
-            uv = vec2(abc.x/(1-abc.z), abc.y/(1-abc.z))*0.5 + vec2(0.5, 0.5);
-            reflectionColor = texture2D(lowerReflectionMap, uv).xyz;
+            vec2 uv = vec2(abc.x/(1-abc.z), abc.y/(1-abc.z))*0.5 + vec2(0.5, 0.5);
+            reflectionColor = texture(reflectionMaps, vec3(uv, 1)).xyz;
         }
 
         if (reflectionMode == 0) //Mirror-like
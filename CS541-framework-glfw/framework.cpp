@@ -3,6 +3,8 @@
 // initialization and main loop.
 ////////////////////////////////////////////////////////////////////////
 
+#include <string.h>
+
 #include "framework.h"
 
 Scene scene;
@@ -18,10 +20,22 @@ void window_size_callback(GLFWwindow* window, int width, int height) {
 
 ////////////////////////////////////////////////////////////////////////
 // Do the OpenGL/GLFW setup and then enter the interactive loop.
+//   --profile-csv <file>   writes each frame's profiler timings to file
+//   --trace <file>         writes a Chrome trace of startup and the first frame
 int main(int argc, char** argv)
 {
     glfwSetErrorCallback(error_callback);
 
+    const char* profileCsv = NULL;
+    const char* traceFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--profile-csv") && i + 1 < argc)
+            profileCsv = argv[++i];
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            traceFile = argv[++i];
+        else
+            printf("Ignoring unknown argument %s\n", argv[i]); }
+
     // Initialize the OpenGL bindings
     glbinding::Binding::initialize(false);
 
@@ -55,13 +69,30 @@ int main(int argc, char** argv)
     scene.InitializeScene();
     
     glfwSetWindowSizeCallback(scene.window, window_size_callback);
+    if (profileCsv)
+        Profiler::OpenCSV(profileCsv);
+
     // Enter the event loop.
     while (!glfwWindowShouldClose(scene.window)) {
         glfwPollEvents();
 
-        scene.DrawScene();
-        scene.DrawMenu();
-        glfwSwapBuffers(scene.window); }
+        Profiler::BeginFrame();
+        {
+            ProfileScope scope("DrawScene");
+            scene.DrawScene();
+        }
+        {
+            ProfileScope scope("DrawMenu");
+            scene.DrawMenu();
+        }
+        Profiler::EndFrame();
+        glfwSwapBuffers(scene.window);
+
+        if (traceFile) {
+            Trace::Write(traceFile);
+            traceFile = NULL; } }
+
+    Profiler::CloseCSV();
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -40,6 +40,9 @@ in vec3 normalVec, lightVec, eyeVec;
 in vec2 texCoord;
 in vec3 tanVec;
 in vec4 worldPos;
+in vec4 clipPos, prevClipPos;
+
+#include "gbuffer.glsl"
 
 void main()
 {   
@@ -50,9 +53,18 @@ void main()
 	vec3 Kd = diffuse;
     vec3 Ks = specular;
 
+    // Screen motion since last frame, in uv; written first, since the
+    // sky returns early
+    gl_FragData[4].xy = 0.5*(clipPos.xy/clipPos.w - prevClipPos.xy/prevClipPos.w);
+
     if (textureMode != 0) {
 
         if (objectId == skyId){
+#ifdef COMPACT_GBUFFER
+            // The lighting pass looks the sky up itself
+            gl_FragData[2].w = 0.5;
+            return;
+#endif
             vec2 uv = vec2(-atan(V.y, V.x)/(2*PI), acos(V.z)/PI);
             Kd = texture2D(SkydomeTex, uv).xyz;
             gl_FragData[1].w = 1;
@@ -143,6 +155,17 @@ void main()
                 Kd *= 0.9; }
     }
 
+#ifdef COMPACT_GBUFFER
+    // Attachment 2 is sRGB, written linear with GL_FRAMEBUFFER_SRGB on
+	gl_FragData[1].xy = OctEncode(normalize(N));
+	gl_FragData[2].xyz = pow(clamp(Kd + brightness, 0, 1), vec3(2.2));
+	gl_FragData[3].xyz = Ks/2;
+	gl_FragData[3].w = shininess;
+	if (reflective)
+		gl_FragData[2].w = 1;
+	else
+		gl_FragData[2].w = 0;
+#else
 	gl_FragData[0] = worldPos;
 	gl_FragData[1].xyz = normalize(N);
     gl_FragData[1].w = 0;
@@ -153,4 +176,5 @@ void main()
 		gl_FragData[2].w = 1;
 	else
 		gl_FragData[2].w = 0;
+#endif
 }
@@ -0,0 +1,148 @@
+/////////////////////////////////////////////////////////////////////////
+// G-buffer layout, shared by the passes that write and read it.
+//
+// The full layout has four RGBA32F attachments:
+//   0: world position, w = view depth
+//   1: normal, w = 1 on the skydome
+//   2: diffuse, w = 1 if reflective
+//   3: specular, w = shininess
+// With COMPACT_GBUFFER (Scene::gbuffer_mode == 1) attachment 0 is
+// dropped and the others shrink to 12 bytes per pixel in total:
+//   depth: position is rebuilt with ViewProjInverse
+//   1: RG16F octahedral normal
+//   2: RGBA8 sRGB diffuse, w = material flags (0 plain, 0.5 sky, 1 reflective)
+//   3: RGBA8 specular at half scale (so Ks up to 2 fits), w = shininess
+// Both layouts add
+//   4: RG16F motion, the screen position (in uv) less last frame's,
+//      both without the TAA jitter
+// Diffuse values above 1 (the emissive light spheres) are clamped in
+// the compact layout, and the skydome's color is looked up again by
+// the lighting pass instead of being stored.
+//
+// Passes read the G-buffer with texelFetch at pixel coordinates
+// through the functions below; out of range pixels read as zero, as
+// imageLoad would.  With dynamic resolution only the lower left
+// gbufferSize pixels of the attachments are drawn, and the rest is out
+// of range.
+////////////////////////////////////////////////////////////////////////
+
+uniform sampler2D gBufferWorldPos;
+uniform sampler2D gBufferNormalVec;
+uniform sampler2D gBufferDiffuse;
+uniform sampler2D gBufferSpecular;
+uniform sampler2D gBufferVelocity;
+#ifdef COMPACT_GBUFFER
+uniform sampler2D gBufferDepth;
+uniform mat4 ViewProjInverse;
+#endif
+uniform ivec2 gbufferSize;
+
+// Octahedral normal encoding: fold the lower hemisphere of the
+// octahedron over the upper one, giving a point in [-1,1]^2
+vec2 OctWrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 OctEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    return n.z >= 0.0 ? n.xy : OctWrap(n.xy);
+}
+
+vec3 OctDecode(vec2 f)
+{
+    vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+bool GbufferInside(ivec2 p)
+{
+    return p.x >= 0 && p.y >= 0 && p.x < gbufferSize.x && p.y < gbufferSize.y;
+}
+
+// The G-buffer pixel under a pixel of a windowSize target, for the
+// passes drawn after the post processing pass scales the image up
+ivec2 GbufferPixel(vec2 fragCoord, vec2 windowSize)
+{
+    return ivec2(fragCoord * vec2(gbufferSize) / windowSize);
+}
+
+// World position, and in w the view depth
+vec4 GbufferPosition(ivec2 p)
+{
+    if (!GbufferInside(p))
+        return vec4(0);
+#ifdef COMPACT_GBUFFER
+    vec2 ndc = (vec2(p) + 0.5) / vec2(gbufferSize) * 2.0 - 1.0;
+    float z = texelFetch(gBufferDepth, p, 0).x * 2.0 - 1.0;
+    vec4 h = ViewProjInverse * vec4(ndc, z, 1.0);
+    // h is the world position divided by the clip w, i.e. the view depth
+    return vec4(h.xyz / h.w, 1.0 / h.w);
+#else
+    return texelFetch(gBufferWorldPos, p, 0);
+#endif
+}
+
+vec3 GbufferNormal(ivec2 p)
+{
+    if (!GbufferInside(p))
+        return vec3(0);
+#ifdef COMPACT_GBUFFER
+    return OctDecode(texelFetch(gBufferNormalVec, p, 0).xy);
+#else
+    return texelFetch(gBufferNormalVec, p, 0).xyz;
+#endif
+}
+
+// Diffuse color as the G-buffer pass computed it (before linearizing)
+vec3 GbufferDiffuse(ivec2 p)
+{
+#ifdef COMPACT_GBUFFER
+    // Stored as sRGB, so the fetch returns the linearized value
+    return pow(texelFetch(gBufferDiffuse, p, 0).xyz, vec3(1/2.2));
+#else
+    return texelFetch(gBufferDiffuse, p, 0).xyz;
+#endif
+}
+
+vec3 GbufferSpecular(ivec2 p)
+{
+#ifdef COMPACT_GBUFFER
+    return 2.0 * texelFetch(gBufferSpecular, p, 0).xyz;
+#else
+    return texelFetch(gBufferSpecular, p, 0).xyz;
+#endif
+}
+
+float GbufferShininess(ivec2 p)
+{
+    return texelFetch(gBufferSpecular, p, 0).w;
+}
+
+vec2 GbufferVelocity(ivec2 p)
+{
+    return texelFetch(gBufferVelocity, p, 0).xy;
+}
+
+bool GbufferIsSky(ivec2 p)
+{
+#ifdef COMPACT_GBUFFER
+    float flags = texelFetch(gBufferDiffuse, p, 0).w;
+    return flags > 0.25 && flags < 0.75;
+#else
+    return texelFetch(gBufferNormalVec, p, 0).w == 1;
+#endif
+}
+
+bool GbufferReflective(ivec2 p)
+{
+#ifdef COMPACT_GBUFFER
+    return texelFetch(gBufferDiffuse, p, 0).w >= 0.75;
+#else
+    return texelFetch(gBufferDiffuse, p, 0).w != 0;
+#endif
+}
@@ -8,6 +8,10 @@
 uniform mat4 WorldView, WorldProj, ModelTr, NormalTr, WorldInverse;
 uniform vec3 lightPos;
 
+// For the motion vectors: the view-projection without the TAA jitter,
+// and last frame's view-projection and model transformation
+uniform mat4 ViewProj, PrevViewProj, PrevModelTr;
+
 in vec4 vertex;
 in vec3 vertexNormal;
 in vec2 vertexTexture;
@@ -19,6 +23,7 @@ out vec2 texCoord;
 out vec3 tanVec;
 out vec4 shadowCoord;
 out vec3 eyeVec;
+out vec4 clipPos, prevClipPos;
 
 void main()
 {
@@ -34,4 +39,7 @@ void main()
 
     gl_Position = WorldProj*WorldView*worldPos;
     worldPos.w = gl_Position.w;
+
+    clipPos = ViewProj*ModelTr*vertex;
+    prevClipPos = PrevViewProj*PrevModelTr*vertex;
 }
@@ -0,0 +1,183 @@
+///////////////////////////////////////////////////////////////////////
+// Projection of an equirectangular environment map onto the first 9
+// (order 2) spherical harmonics.  See irradiance.h.
+//
+// The integral over the sphere is done as a solid angle weighted sum
+// over every texel.  Rows of the image are split between worker
+// threads, and within a row 4 texels at a time are processed with
+// SSE.  Since the polar angle (and hence the solid angle weight) is
+// constant along a row, the weight is applied once per row.
+////////////////////////////////////////////////////////////////////////
+
+#include "math.h"
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#define GLM_FORCE_RADIANS
+#define GLM_SWIZZLE
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define IRRADIANCE_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "irradiance.h"
+
+static const float PI = 3.14159265f;
+
+// Constant factors of the real spherical harmonics basis
+static const float K0 = 0.282095f;  // Y00
+static const float K1 = 0.488603f;  // Y1m
+static const float K2 = 1.092548f;  // Y2-2, Y2-1, Y21
+static const float K3 = 0.315392f;  // Y20
+static const float K4 = 0.546274f;  // Y22
+
+// Clamped cosine convolution factors for bands 0, 1, 2
+static const float A0 = PI;
+static const float A1 = 2.0f*PI/3.0f;
+static const float A2 = PI/4.0f;
+
+// Shared, read-only inputs for all worker threads
+struct ProjectionJob {
+    const unsigned char* image;
+    int width, height, depth;
+    float toLinear[256];         // 8 bit texel -> linear radiance
+    std::vector<float> cosPhi;   // Per column
+    std::vector<float> sinPhi;
+};
+
+// Accumulates the unweighted basis*color sums (without the K
+// factors) for the 9 basis functions over a single row.
+static void ProjectRow(const ProjectionJob& job, const int j, double rowSum[9][3])
+{
+    const float theta = PI*(j + 0.5f)/job.height;
+    const float s = sin(theta);
+    const float z = -cos(theta);
+    const unsigned char* row = job.image + j*job.width*job.depth;
+
+    float sum[9][3] = {};
+    int i = 0;
+
+#ifdef IRRADIANCE_SSE
+    __m128 acc[9][3];
+    for (int k = 0; k < 9; k++)
+        for (int c = 0; c < 3; c++)
+            acc[k][c] = _mm_setzero_ps();
+
+    const __m128 vs = _mm_set1_ps(s);
+    const __m128 vz = _mm_set1_ps(z);
+    const __m128 vzz = _mm_set1_ps(3.0f*z*z - 1.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    for (; i + 4 <= job.width; i += 4) {
+        const __m128 x = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(vs, _mm_loadu_ps(&job.cosPhi[i])));
+        const __m128 y = _mm_mul_ps(vs, _mm_loadu_ps(&job.sinPhi[i]));
+
+        __m128 Y[9];
+        Y[0] = one;
+        Y[1] = y;
+        Y[2] = vz;
+        Y[3] = x;
+        Y[4] = _mm_mul_ps(x, y);
+        Y[5] = _mm_mul_ps(y, vz);
+        Y[6] = vzz;
+        Y[7] = _mm_mul_ps(x, vz);
+        Y[8] = _mm_sub_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+
+        const unsigned char* p = row + i*job.depth;
+        const int d = job.depth;
+        __m128 col[3];
+        for (int c = 0; c < 3; c++)
+            col[c] = _mm_set_ps(job.toLinear[p[3*d + c]], job.toLinear[p[2*d + c]],
+                                job.toLinear[p[d + c]], job.toLinear[p[c]]);
+
+        for (int k = 0; k < 9; k++)
+            for (int c = 0; c < 3; c++)
+                acc[k][c] = _mm_add_ps(acc[k][c], _mm_mul_ps(Y[k], col[c]));
+    }
+
+    float lanes[4];
+    for (int k = 0; k < 9; k++)
+        for (int c = 0; c < 3; c++) {
+            _mm_storeu_ps(lanes, acc[k][c]);
+            sum[k][c] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+#endif
+
+    // Scalar path: the whole row without SSE, otherwise just the tail.
+    for (; i < job.width; i++) {
+        const float x = -s*job.cosPhi[i];
+        const float y = s*job.sinPhi[i];
+        const float Y[9] = { 1.0f, y, z, x, x*y, y*z, 3.0f*z*z - 1.0f, x*z, x*x - y*y };
+        const unsigned char* p = row + i*job.depth;
+        for (int k = 0; k < 9; k++)
+            for (int c = 0; c < 3; c++)
+                sum[k][c] += Y[k]*job.toLinear[p[c]];
+    }
+
+    // Solid angle of each texel in this row
+    const float dOmega = (2.0f*PI/job.width)*(PI/job.height)*s;
+    for (int k = 0; k < 9; k++)
+        for (int c = 0; c < 3; c++)
+            rowSum[k][c] += sum[k][c]*dOmega;
+}
+
+static void ProjectRows(const ProjectionJob* job, const int first, const int last, double (*result)[3])
+{
+    for (int j = first; j < last; j++)
+        ProjectRow(*job, j, result);
+}
+
+void ProjectIrradianceSH(const unsigned char* image, const int width, const int height,
+                         const int depth, glm::vec3 coeffs[IRRADIANCE_SH_COUNT])
+{
+    ProjectionJob job;
+    job.image = image;
+    job.width = width;
+    job.height = height;
+    job.depth = depth;
+    for (int t = 0; t < 256; t++)
+        job.toLinear[t] = pow(t/255.0f, 2.2f);
+    job.cosPhi.resize(width);
+    job.sinPhi.resize(width);
+    for (int i = 0; i < width; i++) {
+        const float phi = 2.0f*PI*(i + 0.5f)/width;
+        job.cosPhi[i] = cos(phi);
+        job.sinPhi[i] = sin(phi);
+    }
+
+    int threadCount = std::thread::hardware_concurrency();
+    if (threadCount < 1)
+        threadCount = 1;
+    if (threadCount > height)
+        threadCount = height;
+
+    // Each thread sums a contiguous band of rows into its own partial result.
+    std::vector<double> partial(threadCount*9*3, 0.0);
+    std::vector<std::thread> workers;
+    const int rowsPerThread = (height + threadCount - 1)/threadCount;
+    for (int t = 0; t < threadCount; t++) {
+        const int first = t*rowsPerThread;
+        const int last = std::min(height, first + rowsPerThread);
+        workers.push_back(std::thread(ProjectRows, &job, first, last,
+                                      (double (*)[3])&partial[t*9*3]));
+    }
+    for (unsigned int t = 0; t < workers.size(); t++)
+        workers[t].join();
+
+    double total[9][3] = {};
+    for (int t = 0; t < threadCount; t++)
+        for (int k = 0; k < 9; k++)
+            for (int c = 0; c < 3; c++)
+                total[k][c] += partial[(t*9 + k)*3 + c];
+
+    // Apply the basis constants once for the projection, and once
+    // more (together with the cosine lobe factor) for the evaluation
+    // in the shader, so the shader only needs the polynomial terms.
+    const float scale[9] = { K0*K0*A0, K1*K1*A1, K1*K1*A1, K1*K1*A1,
+                             K2*K2*A2, K2*K2*A2, K3*K3*A2, K2*K2*A2, K4*K4*A2 };
+    for (int k = 0; k < 9; k++)
+        coeffs[k] = glm::vec3(total[k][0], total[k][1], total[k][2])*scale[k];
+}
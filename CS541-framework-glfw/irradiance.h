@@ -0,0 +1,23 @@
+///////////////////////////////////////////////////////////////////////
+// Projection of an equirectangular environment map onto the first 9
+// (order 2) spherical harmonics.  The resulting coefficients are
+// already convolved with the clamped cosine lobe, so the diffuse
+// irradiance for a normal N is just the 9 term sum
+//      E(N) = sum_i coeffs[i] * Y_i(N)
+// which the lighting shaders evaluate directly.  This replaces the
+// pre-baked .irr.hdr irradiance textures.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _IRRADIANCE_
+#define _IRRADIANCE_
+
+const int IRRADIANCE_SH_COUNT = 9;
+
+// Image is the (vertically flipped, as loaded by Texture) RGBA8 sky
+// image of size width x height with depth bytes per pixel.  Texels
+// are treated the same way the shaders treat SkydomeTex, i.e. raised
+// to the power 2.2 to get linear radiance.
+void ProjectIrradianceSH(const unsigned char* image, const int width, const int height,
+                         const int depth, glm::vec3 coeffs[IRRADIANCE_SH_COUNT]);
+
+#endif
@@ -0,0 +1,21 @@
+/////////////////////////////////////////////////////////////////////////
+// Diffuse image based lighting from the skydome's irradiance,
+// projected onto 9 spherical harmonics (see irradiance.cpp)
+////////////////////////////////////////////////////////////////////////
+
+layout(std140) uniform IrradianceBlock {
+    vec4 irradianceSH[9];
+};
+
+vec3 IrradianceSH(vec3 N)
+{
+    return irradianceSH[0].xyz
+         + irradianceSH[1].xyz*N.y
+         + irradianceSH[2].xyz*N.z
+         + irradianceSH[3].xyz*N.x
+         + irradianceSH[4].xyz*(N.x*N.y)
+         + irradianceSH[5].xyz*(N.y*N.z)
+         + irradianceSH[6].xyz*(3*N.z*N.z - 1)
+         + irradianceSH[7].xyz*(N.x*N.z)
+         + irradianceSH[8].xyz*(N.x*N.x - N.y*N.y);
+}
@@ -27,7 +27,7 @@ const float exposure = 2;
 
 in vec3 normalVec, lightVec, eyeVec;
 in vec2 texCoord;
-in vec4 shadowCoord;
+in vec3 shadowWorldPos;
 in vec3 tanVec;
 
 uniform int objectId;
@@ -39,13 +39,14 @@ uniform vec3 light, ambient;
 uniform int width, height;
 uniform bool reflective;
 
-uniform sampler2D shadowMap;
 uniform sampler2D SkydomeTex;
-uniform sampler2D IrrMapTex;
 uniform sampler2D ObjectTexture;
 uniform sampler2D ObjectNMap;
 uniform int hasTexture, hasNMap;
 
+#include "irradiance_sh.glsl"
+#include "shadow_cascades.glsl"
+
 vec3 LightingPixel()
 {
     vec3 N = normalize(normalVec);
@@ -141,17 +142,12 @@ vec3 LightingPixel()
         
     float alpha;
     float light_depth, pixel_depth;
-    vec2 shadowIndex;
-    if (shadowCoord.w > 0){
-        shadowIndex = shadowCoord.xy/shadowCoord.w;
-    }
+    vec4 cascade = ShadowCascadeCoord(shadowWorldPos);
     pixel_depth = 0;
     light_depth = 1000;
-    if (shadowIndex.x >= 0 && shadowIndex.x <= 1){
-        if (shadowIndex.y >= 0 && shadowIndex.y <= 1){
-            light_depth = texture2D(shadowMap, shadowIndex).x;
-            pixel_depth = shadowCoord.w;
-        }
+    if (cascade.w >= 0){
+        light_depth = ShadowMoments(cascade).x;
+        pixel_depth = cascade.z;
     }
     // A checkerboard pattern to break up larte flat expanses.  Remove when using textures.
     if (textureMode == 0){
@@ -178,13 +174,11 @@ vec3 LightingPixel()
         //Ks value coming in is for BRDF so adjust for Phong by multiplying by 10
     }
     else if (lightingMode == IBL_M){
-        vec2 uv = vec2(-atan(-N.y, -N.x)/(2*PI), acos(-N.z)/PI);
-        vec3 irr_map_color = texture2D(IrrMapTex, uv).xyz;
-        irr_map_color = pow(irr_map_color, vec3(2.2));
+        vec3 irr_map_color = max(IrradianceSH(N), vec3(0));
 
         vec3 R = (2*dot(N, V)*N) - V;
         vec3 newH = normalize(R+V);
-        uv = vec2(-atan(-R.y, -R.x)/(2*PI), acos(-R.z)/PI);
+        vec2 uv = vec2(-atan(-R.y, -R.x)/(2*PI), acos(-R.z)/PI);
         vec3 reflection_map_color = texture2D(SkydomeTex, uv).xyz;
         reflection_map_color = pow(reflection_map_color, vec3(2.2));
 
@@ -5,7 +5,7 @@
 ////////////////////////////////////////////////////////////////////////
 #version 330
 
-uniform mat4 ModelTr, NormalTr, ShadowMatrix;
+uniform mat4 ModelTr, NormalTr;
 uniform vec3 lightPos;
 
 in vec4 vertex;
@@ -16,12 +16,12 @@ in vec3 vertexTangent;
 out vec3 normalVec, lightVec, eyeVec;
 out vec2 texCoord;
 out vec3 tanVec;
-out vec4 shadowCoord;
+out vec3 shadowWorldPos;
 
 void LightingVertex(vec3 Eye)
 {
-    shadowCoord = ShadowMatrix*ModelTr*vertex;
     vec3 worldPos = (ModelTr*vertex).xyz;
+    shadowWorldPos = worldPos;
 
     tanVec = mat3(ModelTr)*vertexTangent;
 
@@ -0,0 +1,143 @@
+///////////////////////////////////////////////////////////////////////
+// The animated local lights.  See lights.h.
+////////////////////////////////////////////////////////////////////////
+
+#include "math.h"
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#include <glm/glm.hpp>
+
+#include "lights.h"
+#include "trace.h"
+#include "workers.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line lights.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+int LightSystem::Add(const glm::vec3 position, const float _radius, const glm::vec3 color)
+{
+    x.push_back(position.x);
+    y.push_back(position.y);
+    z.push_back(position.z);
+    radius.push_back(_radius);
+    r.push_back(color.x);
+    g.push_back(color.y);
+    b.push_back(color.z);
+
+    baseX.push_back(position.x);
+    baseY.push_back(position.y);
+    baseZ.push_back(position.z);
+    baseRadius.push_back(_radius);
+    orbitRadius.push_back(0.0f);
+    orbitRate.push_back(0.0f);
+    flickerDepth.push_back(0.0f);
+    flickerRate.push_back(0.0f);
+    phase.push_back(0.0f);
+    return count++;
+}
+
+void LightSystem::SetOrbit(const int i, const float _radius, const float rate)
+{
+    orbitRadius[i] = _radius;
+    orbitRate[i] = rate;
+}
+
+void LightSystem::SetFlicker(const int i, const float depth, const float rate)
+{
+    flickerDepth[i] = depth;
+    flickerRate[i] = rate;
+}
+
+void LightSystem::Allocate()
+{
+    GLint alignment;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    sectionSize = 2*2*std::max(count, 1)*sizeof(glm::vec4);
+    sectionSize = (sectionSize + alignment - 1)/alignment*alignment;
+
+    // Persistent and coherent: written in place every frame, with no
+    // flushes and no remapping
+    glGenBuffers(1, &bufferId);
+    glBindBuffer(GL_ARRAY_BUFFER, bufferId);
+    glBufferStorage(GL_ARRAY_BUFFER, Sections*sectionSize, NULL,
+                    GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    mapped = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, Sections*sectionSize,
+                                              GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    CHECKERROR;
+
+    for (int s = 0; s < Sections; s++)
+        fences[s] = 0;
+}
+
+// The loops run over flat float arrays, free for the compiler to
+// vectorize
+void LightSystem::Animate(const int first, const int last, const float time, glm::vec4* out)
+{
+    TRACE_SCOPE("Light animate");
+    for (int i = first; i < last; i++) {
+        const float a = orbitRate[i]*time + phase[i];
+        x[i] = baseX[i] + orbitRadius[i]*cos(a);
+        y[i] = baseY[i] + orbitRadius[i]*sin(a);
+        z[i] = baseZ[i];
+    }
+    // Two incommensurate waves, so the flicker does not look periodic
+    for (int i = first; i < last; i++) {
+        const float f = flickerRate[i]*time + phase[i];
+        const float wave = 0.5f + 0.25f*sin(f) + 0.25f*sin(2.7f*f);
+        radius[i] = baseRadius[i]*(1.0f - flickerDepth[i]*wave);
+    }
+    for (int i = first; i < last; i++) {
+        out[2*i] = glm::vec4(x[i], y[i], z[i], radius[i]);
+        out[2*i + 1] = glm::vec4(r[i], g[i], b[i], 1.0f);
+    }
+}
+
+void LightSystem::Update(const double time)
+{
+    if (!mapped)
+        return;
+
+    // Wait for the GPU to finish the frame that last read this section
+    section = (section + 1) % Sections;
+    if (fences[section]) {
+        GLsync fence = (GLsync)fences[section];
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        fences[section] = 0;
+    }
+
+    glm::vec4* out = (glm::vec4*)(mapped + section*sectionSize);
+    Workers::ParallelFor(count, [&](int, int first, int last) { Animate(first, last, time, out); });
+    written = true;
+}
+
+void LightSystem::EndFrame()
+{
+    if (!written)
+        return;
+    fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, GL_NONE_BIT);
+    written = false;
+}
+
+void LightSystem::Bind(const int binding)
+{
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, bufferId,
+                      section*sectionSize, 2*std::max(count, 1)*sizeof(glm::vec4));
+}
+
+glm::vec4* LightSystem::Instances()
+{
+    return (glm::vec4*)(mapped + InstanceOffset());
+}
+
+size_t LightSystem::InstanceOffset()
+{
+    return section*sectionSize + 2*count*sizeof(glm::vec4);
+}
@@ -0,0 +1,77 @@
+///////////////////////////////////////////////////////////////////////
+// The animated local lights.
+//
+// Lights are stored as structure-of-arrays: one float array per
+// component of the current state, and per animation parameter.  Update
+// animates them on worker threads (orbits about a base position, and a
+// flickering radius), each thread writing its lights straight into the
+// GPU's copy.
+//
+// That copy is one persistently mapped buffer cut into Sections
+// sections, used round robin, so the CPU writes one frame's lights
+// while the GPU still reads the previous frames'.  A fence placed by
+// EndFrame guards each section until the GPU is done with it.  A
+// section holds every light as a (position, radius) and a color vec4,
+// followed by room for as many instances again, which the light volume
+// pass fills with the lights it keeps.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _LIGHTS_
+#define _LIGHTS_
+
+#include <vector>
+#include <glm/glm.hpp>
+
+class LightSystem
+{
+public:
+    static const int Sections = 3;
+
+    int count;
+
+    // Current state, written by Update
+    std::vector<float> x, y, z, radius;
+    std::vector<float> r, g, b;
+
+    // Animation parameters
+    std::vector<float> baseX, baseY, baseZ, baseRadius;
+    std::vector<float> orbitRadius, orbitRate;
+    std::vector<float> flickerDepth, flickerRate;
+    std::vector<float> phase;
+
+    unsigned int bufferId;
+
+    LightSystem() : count(0), bufferId(0), mapped(0), section(0), written(false) {}
+
+    int Add(const glm::vec3 position, const float _radius, const glm::vec3 color);
+    void SetOrbit(const int i, const float _radius, const float rate);
+    void SetFlicker(const int i, const float depth, const float rate);
+
+    // Creates the mapped buffer for the lights added so far
+    void Allocate();
+
+    // Waits for the next section, then animates the lights to the given
+    // time and writes them into it
+    void Update(const double time);
+    // Fences the section written by Update once the frame's commands
+    // using it are issued
+    void EndFrame();
+
+    // Binds the current section's lights as a shader storage block
+    void Bind(const int binding);
+
+    // The current section's instance space, and its offset in the buffer
+    glm::vec4* Instances();
+    size_t InstanceOffset();
+
+private:
+    unsigned char* mapped;
+    size_t sectionSize;
+    int section;
+    bool written;
+    void* fences[Sections];     // GLsync
+
+    void Animate(const int first, const int last, const float time, glm::vec4* out);
+};
+
+#endif
@@ -0,0 +1,72 @@
+/////////////////////////////////////////////////////////////////////////
+// Shading of a G-buffer pixel by one local light, shared by the light
+// volume pass (local_lights.frag) and the clustered pass
+// (clustered_lights.frag).
+////////////////////////////////////////////////////////////////////////
+
+const float PI = 3.14159f;
+
+const int Phong_M = 0;
+const int BRDF_M = 1;
+const int GGX_M = 2;
+const int IBL_M = 3;
+
+uniform vec3 ambient;
+
+#ifdef LIGHTING_MODE
+const int lightingMode = LIGHTING_MODE;
+#else
+uniform int lightingMode;
+#endif
+
+// Light reaching the eye from surface point P, lit by a light of color
+// light at localLightPos; zero outside the light's radius
+vec3 LocalLight(vec3 localLightPos, float localLightRadius, vec3 light,
+                vec3 P, vec3 normalVec, vec3 eyePos, vec3 Kd, vec3 Ks, float shininess)
+{
+    vec3 outColor = vec3(0);
+    float alpha;
+    //Check if the world position corresponding to this pixel
+    // is in range of this particular local light
+    vec3 local_light_vec = localLightPos - P;
+    float light_distance_squared = dot(local_light_vec, local_light_vec);
+    float local_radius_squared = pow(localLightRadius, 2);
+    if (light_distance_squared < local_radius_squared) {
+        //Inside of local light influence. Do additive local light caclulation
+
+        vec3 N = normalize(normalVec);
+        vec3 L = normalize(local_light_vec);
+        vec3 V = normalize(eyePos - P);
+        vec3 H = normalize(L+V);
+
+        float LN = max(dot(L, N), 0.0);
+        float NH = max(dot(N, H), 0.0);
+        float LH = max(dot(L, H), 0.0);
+
+        if (lightingMode == Phong_M){
+            alpha = -2 + (2/(shininess*shininess));
+            outColor = ambient*Kd + light*(Kd/PI)*LN + light*(Ks*10)*pow(NH, alpha);
+            //Ks value coming in is for BRDF so adjust for Phong by multiplying by 10
+        }
+        else {
+            vec3 brdf;
+            float distribution;
+
+            vec3 fresnel = Ks + ((vec3(1,1,1) - Ks)*pow((1-LH), 5));
+            float visibility = 1/(LH*LH);
+
+            if (lightingMode == BRDF_M){
+                alpha = -2 + (2/(shininess*shininess));
+                distribution = ((alpha+2)/(2*PI))*pow(NH, alpha);
+            }
+            else if (lightingMode == GGX_M){
+                alpha = pow(shininess, 2);
+                distribution = alpha / (PI * pow(pow(NH, 2) * (alpha - 1) + 1, 2));
+            }
+
+            brdf = (Kd/PI) + ((fresnel*visibility*distribution)/4);
+            outColor = light*LN*brdf * max((1/light_distance_squared) - (1/local_radius_squared), 0);
+        }
+    }
+    return outColor;
+}
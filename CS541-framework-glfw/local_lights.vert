@@ -5,11 +5,20 @@
 ////////////////////////////////////////////////////////////////////////
 #version 330
 
-uniform mat4 ModelTr, WorldView, WorldProj;
+uniform mat4 WorldView, WorldProj;
 
 in vec4 vertex;
 
+// Per instance: the light's world position and radius, and its color
+in vec4 lightPosRadius;
+in vec3 lightColor;
+
+flat out vec4 localLight;
+flat out vec3 diffuse;
+
 void main()
 {
-    gl_Position = WorldProj * WorldView * ModelTr * vertex;
+    localLight = lightPosRadius;
+    diffuse = lightColor;
+    gl_Position = WorldProj * WorldView * vec4(lightPosRadius.xyz + lightPosRadius.w*vertex.xyz, 1.0);
 }
@@ -12,6 +12,7 @@
 #include "math.h"
 #include <fstream>
 #include <stdlib.h>
+#include <algorithm>
 
 #include <glbinding/gl/gl.h>
 #include <glbinding/Binding.h>
@@ -34,13 +35,13 @@ Object::Object(Shape* _shape, const int _objectId,
 			   const bool _reflective, const int _texId, const int _texUnit, const int _nmapId, const int _nmapUnit,
                glm::vec3& _brightness)
     : diffuseColor(_diffuseColor), specularColor(_specularColor), shininess(_shininess),
-      shape(_shape), objectId(_objectId), drawMe(true), reflective(_reflective), textureId(_texId),
+      shape(_shape), objectId(_objectId), drawMe(true), dynamic(false), reflective(_reflective), textureId(_texId),
       textureUnit(_texUnit), nmapId(_nmapId), nmapUnit(_nmapUnit), brightness(_brightness)
      
 {}
 
 
-void Object::Draw(ShaderProgram* program, glm::mat4& objectTr)
+void Object::Draw(ShaderProgram* program, glm::mat4& objectTr, glm::mat4& prevObjectTr)
 {
     // @@ The object specific parameters (uniform variables) used by
     // the shader are set here.  Scene specific parameters are set in
@@ -53,6 +54,26 @@ void Object::Draw(ShaderProgram* program, glm::mat4& objectTr)
 	if (program->isReflectionShader && reflective)
 		return;
 
+    // Static/dynamic split used by the shadow cache.  Everything under
+    // a dynamic object moves with it, so is dynamic too.
+    if (program->drawFilter == ShaderProgram::DrawStatic && dynamic)
+        return;
+    if (program->drawFilter == ShaderProgram::DrawDynamic) {
+        if (dynamic) {
+            program->drawFilter = ShaderProgram::DrawAll;
+            Draw(program, objectTr, prevObjectTr);
+            program->drawFilter = ShaderProgram::DrawDynamic;
+        }
+        else if (drawMe) {
+            // Only looking for dynamic objects further down
+            for (int i=0;  i<instances.size();  i++) {
+                glm::mat4 itr = objectTr*instances[i].second*animTr;
+                glm::mat4 prevItr = prevObjectTr*instances[i].second*prevAnimTr;
+                instances[i].first->Draw(program, itr, prevItr); }
+        }
+        return;
+    }
+
     // Inform the shader of the surface values Kd, Ks, and alpha.
     int loc = glGetUniformLocation(program->programId, "diffuse");
     glUniform3fv(loc, 1, &diffuseColor[0]);
@@ -73,6 +94,8 @@ void Object::Draw(ShaderProgram* program, glm::mat4& objectTr)
     // normals, is calculated and passed to the shader here.
     loc = glGetUniformLocation(program->programId, "ModelTr");
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(objectTr));
+    loc = glGetUniformLocation(program->programId, "PrevModelTr");
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(prevObjectTr));
     
     glm::mat4 inv = glm::inverse(objectTr);
     loc = glGetUniformLocation(program->programId, "NormalTr");
@@ -112,7 +135,27 @@ void Object::Draw(ShaderProgram* program, glm::mat4& objectTr)
 
     // Draw this object
     CHECKERROR;
-    if (shape)
+    if (shape && drawMe && program->layers > 1) {
+        // Once per layer the shape's bounding sphere reaches
+        unsigned int mask = (1u << program->layers) - 1;
+        if (program->layerMask) {
+            glm::vec3 center = glm::vec3(objectTr*glm::vec4(shape->center, 1.0f));
+            float scale = std::max(glm::length(glm::vec3(objectTr[0])),
+                                   std::max(glm::length(glm::vec3(objectTr[1])), glm::length(glm::vec3(objectTr[2]))));
+            mask = program->layerMask(center, scale*shape->size*sqrt(3.0f));
+        }
+        int first = 0, last = program->layers - 1;
+        while (first <= last && !(mask & (1u << first)))
+            first++;
+        while (last >= first && !(mask & (1u << last)))
+            last--;
+        if (first <= last) {
+            loc = glGetUniformLocation(program->programId, "firstLayer");
+            glUniform1i(loc, first);
+            shape->DrawVAO(last - first + 1);
+        }
+    }
+    else if (shape)
         if (drawMe) 
             shape->DrawVAO();
     CHECKERROR;
@@ -123,7 +166,41 @@ void Object::Draw(ShaderProgram* program, glm::mat4& objectTr)
     if (drawMe)
         for (int i=0;  i<instances.size();  i++) {
             glm::mat4 itr = objectTr*instances[i].second*animTr;
-            instances[i].first->Draw(program, itr); }
+            glm::mat4 prevItr = prevObjectTr*instances[i].second*prevAnimTr;
+            instances[i].first->Draw(program, itr, prevItr); }
     
     CHECKERROR;
 }
+
+void Object::Bounds(const glm::mat4& objectTr, const int skipId, glm::vec3& minP, glm::vec3& maxP)
+{
+    if (!drawMe || objectId == skipId)
+        return;
+
+    if (shape)
+        for (int c=0;  c<8;  c++) {
+            glm::vec3 corner((c&1) ? shape->maxP.x : shape->minP.x,
+                             (c&2) ? shape->maxP.y : shape->minP.y,
+                             (c&4) ? shape->maxP.z : shape->minP.z);
+            glm::vec3 P = (objectTr*glm::vec4(corner, 1.0f)).xyz();
+            minP = glm::min(minP, P);
+            maxP = glm::max(maxP, P); }
+
+    for (int i=0;  i<instances.size();  i++) {
+        glm::mat4 itr = objectTr*instances[i].second*animTr;
+        instances[i].first->Bounds(itr, skipId, minP, maxP); }
+}
+
+void Object::DynamicBounds(const glm::mat4& objectTr, glm::vec3& minP, glm::vec3& maxP)
+{
+    if (!drawMe)
+        return;
+
+    if (dynamic) {
+        Bounds(objectTr, -1, minP, maxP);
+        return; }
+
+    for (int i=0;  i<instances.size();  i++) {
+        glm::mat4 itr = objectTr*instances[i].second*animTr;
+        instances[i].first->DynamicBounds(itr, minP, maxP); }
+}
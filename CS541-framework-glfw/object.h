@@ -27,8 +27,10 @@ class Object
  public:
     Shape* shape;               // Polygons 
     glm::mat4 animTr;                // This model's animation transformation
+    glm::mat4 prevAnimTr;            // And last frame's, for motion vectors
     int objectId;               // Object id to be sent to the shader
     bool drawMe;                // Toggle specifies if this object (and children) are drawn.
+    bool dynamic;               // Moves from frame to frame, along with its children.
 
     glm::vec3 diffuseColor;          // Diffuse color of object
     glm::vec3 specularColor;         // Specular color of object
@@ -55,7 +57,17 @@ class Object
     // texture id should be set in Scene::InitializeScene and used in
     // Object::Draw.
     
-    void Draw(ShaderProgram* program, glm::mat4& objectTr);
+    // Draws this object and its children.  The program's drawFilter
+    // can restrict this to the static, or to the dynamic, objects.
+    // prevObjectTr is where objectTr was last frame, sent as PrevModelTr.
+    void Draw(ShaderProgram* program, glm::mat4& objectTr, glm::mat4& prevObjectTr);
+    void Draw(ShaderProgram* program, glm::mat4& objectTr) { Draw(program, objectTr, objectTr); }
+
+    // Grows minP/maxP to the world space box around the drawn shapes
+    // of this object and its children, leaving out skipId's subtree.
+    void Bounds(const glm::mat4& objectTr, const int skipId, glm::vec3& minP, glm::vec3& maxP);
+    // The same, for only the drawn dynamic objects (and their children).
+    void DynamicBounds(const glm::mat4& objectTr, glm::vec3& minP, glm::vec3& maxP);
 
     void add(Object* m, glm::mat4 tr=glm::mat4()) { instances.push_back(std::make_pair(m,tr)); }
 };
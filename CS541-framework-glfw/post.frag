@@ -6,24 +6,52 @@ uniform sampler2D renderBuffer;
 uniform sampler2D bloomBuffer;
 uniform sampler2D upsampleBuffer;
 
+#ifdef DRAW_FBO
+const int drawFbo = DRAW_FBO;
+#else
 uniform int drawFbo;
+#endif
 
 uniform int width, height;
+// The rendered parts of the bloom buffers, and of renderBuffer (all of
+// it once TAA has resolved it to the window's size), which the screen
+// is scaled up from
+uniform vec2 renderScale;
+uniform vec2 colorScale;
 uniform float exposure;
+#ifdef TONE_MAPPING_MODE
+const float tone_mapping_mode = TONE_MAPPING_MODE;
+#else
 uniform float tone_mapping_mode;
+#endif
 uniform float gamma;
 
+#ifdef BLOOM_ENABLED
+const int bloomEnabled = BLOOM_ENABLED;
+#else
 uniform int bloomEnabled;
+#endif
+#ifdef BLOOM_MODE
+const int bloomMode = BLOOM_MODE;
+#else
 uniform int bloomMode;
+#endif
 uniform float bloomFactor;
 
 uniform float bloom_mip_level;
 
 layout(location = 0) out vec4 out_color;
 
+// Where uv lands in a buffer drawn over its lower left scale part,
+// clamped half a texel inside so the filtering stays off the rest
+vec2 RenderedUv(vec2 uv, vec2 scale)
+{
+	return min(uv * scale, scale - 0.5 / vec2(width, height));
+}
+
 void main() {
-	vec2 uv = gl_FragCoord.xy / vec2(width, height);
-	vec4 fragColor = texture(renderBuffer, uv);
+	vec2 uv = RenderedUv(gl_FragCoord.xy / vec2(width, height), renderScale);
+	vec4 fragColor = texture(renderBuffer, RenderedUv(gl_FragCoord.xy / vec2(width, height), colorScale));
 	vec4 bloomColor;
 	if (bloomMode == 0)
 		bloomColor = texture(upsampleBuffer, uv);
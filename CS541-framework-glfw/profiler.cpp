@@ -0,0 +1,246 @@
+///////////////////////////////////////////////////////////////////////
+// Per-pass GPU and CPU timing.  See profiler.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#include "imgui.h"
+#include "profiler.h"
+#include "trace.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line profiler.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+std::vector<Profiler::Scope> Profiler::scopes;
+Profiler::Frame Profiler::frames[Profiler::Latency];
+int Profiler::frameNumber = 0;
+int Profiler::resolvedFrame = -1;
+bool Profiler::inFrame = false;
+std::vector<int> Profiler::open;
+std::vector<unsigned int> Profiler::freeQueries;
+FILE* Profiler::csv = NULL;
+
+// On the trace's clock, so each scope also goes into the trace
+static double NowMs()
+{
+    return 1e-3*Trace::Now();
+}
+
+int Profiler::FindScope(const int parent, const char* name)
+{
+    const std::vector<int>* siblings = NULL;
+    std::vector<int> roots;
+    if (parent >= 0)
+        siblings = &scopes[parent].children;
+    else {
+        for (unsigned int s = 0; s < scopes.size(); s++)
+            if (scopes[s].parent < 0)
+                roots.push_back(s);
+        siblings = &roots;
+    }
+    for (unsigned int i = 0; i < siblings->size(); i++)
+        if (scopes[(*siblings)[i]].name == name)
+            return (*siblings)[i];
+
+    Scope scope;
+    scope.name = name;
+    scope.parent = parent;
+    scope.depth = parent >= 0 ? scopes[parent].depth + 1 : 0;
+    scope.path = parent >= 0 ? scopes[parent].path + "/" + name : std::string(name);
+    scope.gpuMs.assign(HistoryFrames, 0.0f);
+    scope.cpuMs.assign(HistoryFrames, 0.0f);
+    scopes.push_back(scope);
+    const int s = (int)scopes.size() - 1;
+    if (parent >= 0)
+        scopes[parent].children.push_back(s);
+    return s;
+}
+
+unsigned int Profiler::Query()
+{
+    unsigned int id;
+    if (freeQueries.empty())
+        glGenQueries(1, &id);
+    else {
+        id = freeQueries.back();
+        freeQueries.pop_back();
+    }
+    return id;
+}
+
+void Profiler::BeginFrame()
+{
+    // The frame Latency frames back is done by now; its queries are
+    // read and then reused
+    Frame& frame = frames[frameNumber % Latency];
+    Resolve(frame);
+    frame.number = frameNumber;
+    open.clear();
+    inFrame = true;
+    Begin("Frame");
+}
+
+void Profiler::EndFrame()
+{
+    while (!open.empty())
+        End();
+    inFrame = false;
+    frameNumber++;
+}
+
+void Profiler::Begin(const char* name)
+{
+    if (!inFrame)
+        return;
+    Frame& frame = frames[frameNumber % Latency];
+    Record record;
+    record.scope = FindScope(open.empty() ? -1 : frame.records[open.back()].scope, name);
+    record.begin = Query();
+    record.end = Query();
+    glQueryCounter(record.begin, GL_TIMESTAMP);
+    record.cpuBegin = NowMs();
+    record.cpuEnd = record.cpuBegin;
+    frame.records.push_back(record);
+    open.push_back((int)frame.records.size() - 1);
+}
+
+void Profiler::End()
+{
+    if (open.empty())
+        return;
+    Record& record = frames[frameNumber % Latency].records[open.back()];
+    open.pop_back();
+    record.cpuEnd = NowMs();
+    glQueryCounter(record.end, GL_TIMESTAMP);
+    Trace::Add(scopes[record.scope].name.c_str(), NULL, 1e3*record.cpuBegin, 1e3*record.cpuEnd);
+}
+
+void Profiler::Resolve(Frame& frame)
+{
+    if (frame.records.empty())
+        return;
+
+    // The root's end was the frame's last timestamp
+    GLint available = 0;
+    glGetQueryObjectiv(frame.records[0].end, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+        std::vector<double> gpu(scopes.size(), 0.0), cpu(scopes.size(), 0.0);
+        std::vector<bool> ran(scopes.size(), false);
+        for (unsigned int r = 0; r < frame.records.size(); r++) {
+            const Record& record = frame.records[r];
+            GLuint64 begin, end;
+            glGetQueryObjectui64v(record.begin, GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(record.end, GL_QUERY_RESULT, &end);
+            gpu[record.scope] += (end - begin)*1e-6;
+            cpu[record.scope] += record.cpuEnd - record.cpuBegin;
+            ran[record.scope] = true;
+        }
+
+        for (unsigned int s = 0; s < scopes.size(); s++) {
+            if (!ran[s])
+                continue;
+            Scope& scope = scopes[s];
+            scope.lastGpuMs = gpu[s];
+            scope.lastCpuMs = cpu[s];
+            scope.lastFrame = frame.number;
+            scope.gpuMs[scope.next] = float(gpu[s]);
+            scope.cpuMs[scope.next] = float(cpu[s]);
+            scope.next = (scope.next + 1) % HistoryFrames;
+            scope.count = std::min(scope.count + 1, HistoryFrames);
+            if (csv)
+                fprintf(csv, "%d,%s,%d,%.4f,%.4f\n", frame.number, scope.path.c_str(),
+                        scope.depth, gpu[s], cpu[s]);
+        }
+        resolvedFrame = frame.number;
+    }
+
+    for (unsigned int r = 0; r < frame.records.size(); r++) {
+        freeQueries.push_back(frame.records[r].begin);
+        freeQueries.push_back(frame.records[r].end);
+    }
+    frame.records.clear();
+    CHECKERROR;
+}
+
+double Profiler::GpuMs(const char* name)
+{
+    for (unsigned int s = 0; s < scopes.size(); s++)
+        if (scopes[s].name == name)
+            return scopes[s].lastGpuMs;
+    return 0.0;
+}
+
+bool Profiler::OpenCSV(const char* fileName)
+{
+    CloseCSV();
+    csv = fopen(fileName, "w");
+    if (!csv) {
+        printf("Could not open profile file %s\n", fileName);
+        return false;
+    }
+    fprintf(csv, "frame,scope,depth,gpu_ms,cpu_ms\n");
+    return true;
+}
+
+void Profiler::CloseCSV()
+{
+    if (csv)
+        fclose(csv);
+    csv = NULL;
+}
+
+// Minimum, mean and 99th percentile of a scope's history
+static void Stats(const std::vector<float>& ring, const int count, float& mn, float& mean, float& p99)
+{
+    std::vector<float> values(ring.begin(), ring.begin() + count);
+    std::sort(values.begin(), values.end());
+    mn = values[0];
+    mean = 0.0f;
+    for (int i = 0; i < count; i++)
+        mean += values[i];
+    mean /= count;
+    p99 = values[std::min(count - 1, int(0.99f*count))];
+}
+
+void Profiler::DrawScope(const int s)
+{
+    const Scope& scope = scopes[s];
+    if (scope.lastFrame != resolvedFrame || scope.count == 0)
+        return;
+
+    // The rings fill from slot 0, and once full start at the oldest
+    const int offset = scope.count < HistoryFrames ? 0 : scope.next;
+    float mn, mean, p99;
+    ImGui::PushID(s);
+    ImGui::Text("%s", scope.name.c_str());
+    Stats(scope.gpuMs, scope.count, mn, mean, p99);
+    ImGui::Text("GPU %6.3f ms  min %6.3f  avg %6.3f  p99 %6.3f", scope.lastGpuMs, mn, mean, p99);
+    ImGui::PlotLines("##gpu", &scope.gpuMs[0], scope.count, offset, NULL, 0.0f, p99*1.25f, ImVec2(0, 30));
+    Stats(scope.cpuMs, scope.count, mn, mean, p99);
+    ImGui::Text("CPU %6.3f ms  min %6.3f  avg %6.3f  p99 %6.3f", scope.lastCpuMs, mn, mean, p99);
+    ImGui::PlotLines("##cpu", &scope.cpuMs[0], scope.count, offset, NULL, 0.0f, p99*1.25f, ImVec2(0, 30));
+
+    ImGui::Indent();
+    for (unsigned int c = 0; c < scope.children.size(); c++)
+        DrawScope(scope.children[c]);
+    ImGui::Unindent();
+    ImGui::PopID();
+}
+
+void Profiler::DrawWindow(bool* show)
+{
+    if (ImGui::Begin("Profiler", show)) {
+        ImGui::Text("Frame %d, read back %d frames late", resolvedFrame, Latency);
+        ImGui::Separator();
+        for (unsigned int s = 0; s < scopes.size(); s++)
+            if (scopes[s].parent < 0)
+                DrawScope(s);
+    }
+    ImGui::End();
+}
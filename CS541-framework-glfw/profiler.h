@@ -0,0 +1,89 @@
+///////////////////////////////////////////////////////////////////////
+// Per-pass GPU and CPU timing.
+//
+// Timed scopes are opened with Begin and closed with End (or by a
+// ProfileScope on the stack), and may nest.  Each records a GL_TIMESTAMP
+// query at both ends, and steady_clock times.  (Timestamps rather than
+// GL_TIME_ELAPSED queries, since elapsed queries cannot nest, and the
+// ComputeKernel timers use them inside the passes.)  A frame's queries
+// are read back Latency frames later, when the GPU is long done with
+// them, so reading never stalls; a frame whose queries are still not
+// ready is dropped.
+//
+// A scope is identified by its name and its parent's, and keeps its
+// last HistoryFrames times (summed when it runs several times in a
+// frame) for the window drawn by DrawWindow.  With a CSV file open,
+// each frame adds one row per scope that ran.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _PROFILER_
+#define _PROFILER_
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+
+class Profiler
+{
+public:
+    static const int Latency = 3;
+    static const int HistoryFrames = 240;
+
+    struct Scope {
+        std::string name, path;     // path is "Frame/DrawScene/...", for the CSV
+        int parent, depth;
+        std::vector<int> children;
+        std::vector<float> gpuMs, cpuMs;    // Rings of HistoryFrames
+        int next = 0, count = 0;            // Next slot, and slots filled
+        double lastGpuMs = 0, lastCpuMs = 0;
+        int lastFrame = -1;                 // Frame of the last times
+    };
+    static std::vector<Scope> scopes;
+
+    // Around each frame; the frame itself is the root scope "Frame".
+    // Scopes outside a frame are not timed.
+    static void BeginFrame();
+    static void EndFrame();
+
+    static void Begin(const char* name);
+    static void End();
+
+    // Latest GPU time of the first scope with this name, 0 until known
+    static double GpuMs(const char* name);
+
+    static bool OpenCSV(const char* fileName);
+    static void CloseCSV();
+
+    static void DrawWindow(bool* show);
+
+private:
+    struct Record {
+        int scope;
+        unsigned int begin, end;    // Timestamp queries
+        double cpuBegin, cpuEnd;    // ms
+    };
+    struct Frame {
+        std::vector<Record> records;
+        int number;
+    };
+    static Frame frames[Latency];
+    static int frameNumber, resolvedFrame;
+    static bool inFrame;
+    static std::vector<int> open;   // Records of the open scopes, in the current frame
+    static std::vector<unsigned int> freeQueries;
+    static FILE* csv;
+
+    static int FindScope(const int parent, const char* name);
+    static unsigned int Query();
+    static void Resolve(Frame& frame);
+    static void DrawScope(const int s);
+};
+
+// Times the enclosing block
+struct ProfileScope
+{
+    ProfileScope(const char* name) { Profiler::Begin(name); }
+    ~ProfileScope() { Profiler::End(); }
+};
+
+#endif
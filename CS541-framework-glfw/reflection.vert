@@ -5,6 +5,15 @@
 ////////////////////////////////////////////////////////////////////////
 #version 330
 
+// With LAYERED both paraboloids are drawn in one pass: instance i of
+// each draw goes to layer firstLayer + i, layer 0 being the upper
+// hemisphere and layer 1 the lower.  Object::Draw skips the layers a
+// shape cannot reach.
+#ifdef LAYERED
+#extension GL_ARB_shader_viewport_layer_array : require
+uniform int firstLayer;
+#endif
+
 uniform mat4 ModelTr;
 uniform vec3 ReflectionEye;
 uniform int HemisphereSign;
@@ -17,6 +26,11 @@ in vec3 vertexTangent;
 void LightingVertex(vec3 Eye);
 void main()
 {   
+#ifdef LAYERED
+	int layer = firstLayer + gl_InstanceID;
+	gl_Layer = layer;
+	int HemisphereSign = layer == 0 ? 1 : -1;
+#endif
 	vec4 P = ModelTr*vertex;
 	vec3 R = P.xyz - ReflectionEye;
 	vec3 abc = normalize(R);
@@ -0,0 +1,267 @@
+///////////////////////////////////////////////////////////////////////
+// A small frame graph for the multi-pass pipeline.  See rendergraph.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <algorithm>
+
+#include <glbinding/gl/gl.h>
+#include <glbinding/Binding.h>
+using namespace gl;
+
+#include "fbo.h"
+#include "rendergraph.h"
+#include "profiler.h"
+
+#include <glu.h>                // For gluErrorString
+#define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line rendergraph.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
+
+// Barrier bit that makes image stores visible to each kind of access
+static unsigned int BarrierFor(const RenderGraph::Access access)
+{
+    switch (access) {
+    case RenderGraph::Sampled:
+        return (unsigned int)GL_TEXTURE_FETCH_BARRIER_BIT;
+    case RenderGraph::Image:
+        return (unsigned int)GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+    default:
+        return (unsigned int)GL_FRAMEBUFFER_BARRIER_BIT;
+    }
+}
+
+static size_t TextureBytes(const int w, const int h, const int levels, const GLenum format)
+{
+    size_t bytes = 0;
+    for (int m = 0; m < levels; m++)
+        bytes += size_t(std::max(1, w >> m))*std::max(1, h >> m)*BytesPerTexel(format);
+    return bytes;
+}
+
+void RenderGraph::Begin()
+{
+    resources.clear();
+    passes.clear();
+    lastWriter.clear();
+    outputs.clear();
+}
+
+int RenderGraph::Import(const char* name, const unsigned int textureId)
+{
+    Resource r;
+    r.name = name;
+    r.imported = true;
+    r.textureId = textureId;
+    r.width = r.height = r.levels = 0;
+    r.format = GL_RGBA32F;
+    resources.push_back(r);
+    lastWriter.push_back(-1);
+    return resources.size() - 1;
+}
+
+int RenderGraph::Create(const char* name, const int w, const int h, const GLenum format, const int levels)
+{
+    Resource r;
+    r.name = name;
+    r.imported = false;
+    r.textureId = 0;
+    r.width = w;
+    r.height = h;
+    r.levels = levels;
+    r.format = format;
+    resources.push_back(r);
+    lastWriter.push_back(-1);
+    return resources.size() - 1;
+}
+
+int RenderGraph::AddPass(const char* name, std::function<void()> execute)
+{
+    Pass p;
+    p.name = name;
+    p.execute = execute;
+    p.needed = false;
+    p.barrier = 0u;
+    passes.push_back(p);
+    return passes.size() - 1;
+}
+
+void RenderGraph::Read(const int pass, const int resource, const Access access)
+{
+    Use u = { resource, access, false };
+    passes[pass].uses.push_back(u);
+    if (lastWriter[resource] >= 0)
+        passes[pass].dependsOn.push_back(lastWriter[resource]);
+}
+
+void RenderGraph::Write(const int pass, const int resource, const Access access)
+{
+    Use u = { resource, access, true };
+    passes[pass].uses.push_back(u);
+    lastWriter[resource] = pass;
+}
+
+void RenderGraph::Output(const int resource)
+{
+    outputs.push_back(resource);
+}
+
+void RenderGraph::Compile()
+{
+    // Cull: a pass runs if it writes an output, or if a pass that runs
+    // reads something it wrote.  Dependencies always point backwards.
+    for (unsigned int p = 0; p < passes.size(); p++)
+        for (unsigned int u = 0; u < passes[p].uses.size(); u++)
+            if (passes[p].uses[u].write
+                && std::find(outputs.begin(), outputs.end(), passes[p].uses[u].resource) != outputs.end())
+                passes[p].needed = true;
+
+    culledPasses = 0;
+    for (int p = passes.size() - 1; p >= 0; p--) {
+        if (!passes[p].needed) {
+            culledPasses++;
+            continue;
+        }
+        for (unsigned int d = 0; d < passes[p].dependsOn.size(); d++)
+            passes[passes[p].dependsOn[d]].needed = true;
+    }
+
+    AssignTransients();
+    PlaceBarriers();
+}
+
+// Gives each transient resource used by a surviving pass a texture
+// from the pool, reusing one whose previous user is already done.
+void RenderGraph::AssignTransients()
+{
+    for (unsigned int r = 0; r < resources.size(); r++)
+        resources[r].firstPass = resources[r].lastPass = -1;
+    for (unsigned int p = 0; p < passes.size(); p++) {
+        if (!passes[p].needed)
+            continue;
+        for (unsigned int u = 0; u < passes[p].uses.size(); u++) {
+            Resource& r = resources[passes[p].uses[u].resource];
+            if (r.firstPass < 0)
+                r.firstPass = p;
+            r.lastPass = p;
+        }
+    }
+
+    std::vector<int> order;
+    for (unsigned int r = 0; r < resources.size(); r++)
+        if (!resources[r].imported && resources[r].firstPass >= 0)
+            order.push_back(r);
+    std::sort(order.begin(), order.end(),
+              [this](int a, int b) { return resources[a].firstPass < resources[b].firstPass; });
+
+    for (unsigned int t = 0; t < pool.size(); t++)
+        pool[t].busyUntil = -1;
+
+    unaliasedBytes = 0;
+    for (unsigned int i = 0; i < order.size(); i++) {
+        Resource& r = resources[order[i]];
+        unaliasedBytes += TextureBytes(r.width, r.height, r.levels, r.format);
+
+        int found = -1;
+        for (unsigned int t = 0; t < pool.size() && found < 0; t++)
+            if (pool[t].width == r.width && pool[t].height == r.height && pool[t].levels == r.levels
+                && pool[t].format == r.format && pool[t].busyUntil < r.firstPass)
+                found = t;
+
+        if (found < 0) {
+            PooledTexture t;
+            t.width = r.width;
+            t.height = r.height;
+            t.levels = r.levels;
+            t.format = r.format;
+            glGenTextures(1, &t.textureId);
+            glBindTexture(GL_TEXTURE_2D, t.textureId);
+            for (int m = 0; m < r.levels; m++)
+                glTexImage2D(GL_TEXTURE_2D, m, (int)r.format, std::max(1, r.width >> m), std::max(1, r.height >> m),
+                             0, ExternalFormat(r.format), GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, r.levels - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, (int)GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (int)GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                            r.levels > 1 ? (int)GL_LINEAR_MIPMAP_LINEAR : (int)GL_LINEAR);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            CHECKERROR;
+            pool.push_back(t);
+            found = pool.size() - 1;
+        }
+        pool[found].busyUntil = r.lastPass;
+        r.textureId = pool[found].textureId;
+    }
+
+    // Release textures nothing used this frame (e.g. after a resize or
+    // a mode change that culled their passes)
+    pooledBytes = 0;
+    for (unsigned int t = 0; t < pool.size(); ) {
+        if (pool[t].busyUntil < 0) {
+            pendingBarriers.erase(pool[t].textureId);
+            glDeleteTextures(1, &pool[t].textureId);
+            pool.erase(pool.begin() + t);
+        }
+        else {
+            pooledBytes += TextureBytes(pool[t].width, pool[t].height, pool[t].levels, pool[t].format);
+            t++;
+        }
+    }
+}
+
+// Walks the surviving passes in order, tracking which textures hold
+// image stores not yet covered by a barrier, so each pass issues only
+// the barrier bits its own accesses need.
+void RenderGraph::PlaceBarriers()
+{
+    const unsigned int allBits = BarrierFor(Sampled) | BarrierFor(Image) | BarrierFor(Attachment);
+    for (unsigned int p = 0; p < passes.size(); p++) {
+        if (!passes[p].needed)
+            continue;
+        Pass& pass = passes[p];
+
+        unsigned int mask = 0u;
+        for (unsigned int u = 0; u < pass.uses.size(); u++) {
+            std::map<unsigned int, unsigned int>::iterator pending
+                = pendingBarriers.find(resources[pass.uses[u].resource].textureId);
+            if (pending != pendingBarriers.end())
+                mask |= pending->second & BarrierFor(pass.uses[u].access);
+        }
+        pass.barrier = mask;
+
+        // A barrier covers every earlier store for the access types it names
+        if (mask != 0u)
+            for (std::map<unsigned int, unsigned int>::iterator i = pendingBarriers.begin(); i != pendingBarriers.end(); i++)
+                i->second &= ~mask;
+
+        for (unsigned int u = 0; u < pass.uses.size(); u++)
+            if (pass.uses[u].write && pass.uses[u].access == Image)
+                pendingBarriers[resources[pass.uses[u].resource].textureId] = allBits;
+    }
+}
+
+void RenderGraph::Execute()
+{
+    ProfileScope graphScope("Frame graph");
+    for (unsigned int p = 0; p < passes.size(); p++) {
+        if (!passes[p].needed)
+            continue;
+        ProfileScope passScope(passes[p].name.c_str());
+        if (passes[p].barrier != 0u)
+            glMemoryBarrier((MemoryBarrierMask)passes[p].barrier);
+        passes[p].execute();
+        CHECKERROR;
+    }
+}
+
+unsigned int RenderGraph::TextureId(const int resource)
+{
+    return resources[resource].textureId;
+}
+
+void RenderGraph::BindTexture(const int resource, const int programId, const int unit, const char* name)
+{
+    glActiveTexture((gl::GLenum)((int)GL_TEXTURE0 + unit));
+    glBindTexture(GL_TEXTURE_2D, resources[resource].textureId);
+    int loc = glGetUniformLocation(programId, name);
+    glUniform1i(loc, unit);
+}
@@ -0,0 +1,98 @@
+///////////////////////////////////////////////////////////////////////
+// A small frame graph for the multi-pass pipeline in DrawScene.
+//
+// Each frame the passes are declared in execution order, together
+// with the textures each one reads and writes (and how: sampled,
+// image load/store, or as a framebuffer attachment).  Compile then:
+//   * culls passes that nothing marked as an Output depends on,
+//   * places one glMemoryBarrier before each pass, with only the bits
+//     needed for the image stores it consumes,
+//   * assigns the transient textures to a pool of GL textures, letting
+//     textures with the same size and format and non-overlapping
+//     lifetimes share one texture object.
+// Execute runs the surviving passes, each in a Profiler scope.
+//
+// Long lived targets (e.g. the G-buffer FBO) are Imported; transient
+// intermediates are Created and only valid inside the passes that
+// declared them.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _RENDERGRAPH_
+#define _RENDERGRAPH_
+
+#include <vector>
+#include <string>
+#include <map>
+#include <functional>
+
+class RenderGraph
+{
+public:
+    enum Access { Sampled, Image, Attachment };
+
+    // Starts declaring a new frame
+    void Begin();
+
+    int Import(const char* name, const unsigned int textureId);
+    int Create(const char* name, const int w, const int h, const GLenum format, const int levels=1);
+    int AddPass(const char* name, std::function<void()> execute);
+    void Read(const int pass, const int resource, const Access access);
+    void Write(const int pass, const int resource, const Access access);
+    void Output(const int resource);
+
+    void Compile();
+    void Execute();
+
+    // Valid during Execute (and for imported resources, always)
+    unsigned int TextureId(const int resource);
+    void BindTexture(const int resource, const int programId, const int unit, const char* name);
+
+    // Size of the transient texture pool in bytes, and what the same
+    // textures would need without aliasing
+    size_t pooledBytes = 0, unaliasedBytes = 0;
+    int culledPasses = 0;
+
+private:
+    struct Resource {
+        std::string name;
+        bool imported;
+        unsigned int textureId;     // Imported, or assigned by Compile
+        int width, height, levels;
+        GLenum format;
+        int firstPass, lastPass;    // Lifetime among the passes that run
+    };
+    struct Use {
+        int resource;
+        Access access;
+        bool write;
+    };
+    struct Pass {
+        std::string name;
+        std::function<void()> execute;
+        std::vector<Use> uses;
+        std::vector<int> dependsOn;  // Passes that wrote what this one reads
+        bool needed;
+        unsigned int barrier;       // MemoryBarrierMask bits
+    };
+    struct PooledTexture {
+        unsigned int textureId;
+        int width, height, levels;
+        GLenum format;
+        int busyUntil;              // Last pass using it this frame, -1 if unused
+    };
+
+    std::vector<Resource> resources;
+    std::vector<Pass> passes;
+    std::vector<int> lastWriter;    // Per resource, while declaring
+    std::vector<int> outputs;
+    std::vector<PooledTexture> pool;
+
+    // Image store bits not yet made visible, per GL texture.  Kept
+    // across frames since the imported textures persist.
+    std::map<unsigned int, unsigned int> pendingBarriers;
+
+    void AssignTransients();
+    void PlaceBarriers();
+};
+
+#endif
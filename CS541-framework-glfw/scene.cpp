@@ -17,6 +17,8 @@ const bool fullPolyCount = true; // Use false when emulating the graphics pipeli
 #include "math.h"
 #include <iostream>
 #include <stdlib.h>
+#include <float.h>
+#include <algorithm>
 
 #include <glbinding/gl/gl.h>
 #include <glbinding/Binding.h>
@@ -127,6 +129,7 @@ Object* FramedPicture(const glm::mat4& modelTr, const int objectId,
 // number of other parameters.
 void Scene::InitializeScene()
 {
+    TRACE_SCOPE("InitializeScene");
     debug_mode = 0;
 
     glEnable(GL_DEPTH_TEST);
@@ -157,17 +160,22 @@ void Scene::InitializeScene()
     // Enable OpenGL depth-testing
     glEnable(GL_DEPTH_TEST);
 
-    // Create the lighting shader program from source code files.
+    // The programs requested from here to IssueBatch read their files in
+    // parallel, then compile while the meshes and textures are built
+    ShaderProgram::BeginBatch();
+
+    // Create the lighting shader program from source code files.  The
+    // mode flags are compiled in, one permutation per menu selection,
+    // see SelectShaderVariants.
     // @@ Initialize additional shaders if necessary
-    lightingProgram = new ShaderProgram();
-    lightingProgram->AddShader("final.vert", GL_VERTEX_SHADER);
-	lightingProgram->AddShader("final.frag", GL_FRAGMENT_SHADER);
+    lightingVariants = new ShaderVariants();
+    lightingVariants->AddShader("final.vert", GL_VERTEX_SHADER);
+	lightingVariants->AddShader("final.frag", GL_FRAGMENT_SHADER);
 
-    glBindAttribLocation(lightingProgram->programId, 0, "vertex");
-    glBindAttribLocation(lightingProgram->programId, 1, "vertexNormal");
-    glBindAttribLocation(lightingProgram->programId, 2, "vertexTexture");
-    glBindAttribLocation(lightingProgram->programId, 3, "vertexTangent");
-    lightingProgram->LinkProgram();
+    lightingVariants->BindAttribLocation(0, "vertex");
+    lightingVariants->BindAttribLocation(1, "vertexNormal");
+    lightingVariants->BindAttribLocation(2, "vertexTexture");
+    lightingVariants->BindAttribLocation(3, "vertexTangent");
 
     // Create the shadow shader program from source code files.
     shadowProgram = new ShaderProgram();
@@ -183,7 +191,11 @@ void Scene::InitializeScene()
     //Create the FBO as the render target for the shadow pass
     fbo_width = 1024;
     fbo_height = 1024;
-    shadowPassRenderTarget.CreateFBO(fbo_width, fbo_height);
+    // Stays RGBA32F: the moment shadow map keeps four moments, and
+    // they lose too much precision in 16 bit floats.  One layer per
+    // cascade.
+    shadowPassRenderTarget.CreateFBO(fbo_width, fbo_height, MaxCascades);
+    shadowStaticTarget.CreateFBO(fbo_width, fbo_height, MaxCascades);
 
 	// Create the reflection shader program 
 	reflectionProgram = new ShaderProgram();
@@ -199,29 +211,90 @@ void Scene::InitializeScene()
 	reflectionProgram->LinkProgram();
 	reflectionProgram->isReflectionShader = true;
 
-	//Create the two FBOs require for reflection, one for each parabaloid
-	upperReflectionRenderTarget.CreateFBO(fbo_width, fbo_height);
-	lowerReflectionRenderTarget.CreateFBO(fbo_width, fbo_height);
-
-    // Create the shader program for deferred shading pass
-    gbufferProgram = new ShaderProgram();
-    gbufferProgram->AddShader("gbuffer.vert", GL_VERTEX_SHADER);
-    gbufferProgram->AddShader("gbuffer.frag", GL_FRAGMENT_SHADER);
-
-    glBindAttribLocation(gbufferProgram->programId, 0, "vertex");
-    glBindAttribLocation(gbufferProgram->programId, 1, "vertexNormal");
-    glBindAttribLocation(gbufferProgram->programId, 2, "vertexTexture");
-    glBindAttribLocation(gbufferProgram->programId, 3, "vertexTangent");
-    gbufferProgram->LinkProgram();
-
-    // Create the compute shader program for shadow map blur
-    shadowBlur_H_Program = new ShaderProgram();
-    shadowBlur_H_Program->AddShader("shadow_horizontal.comp", GL_COMPUTE_SHADER);
-    shadowBlur_H_Program->LinkProgram();
-
-    shadowBlur_V_Program = new ShaderProgram();
-    shadowBlur_V_Program->AddShader("shadow_vertical.comp", GL_COMPUTE_SHADER);
-    shadowBlur_V_Program->LinkProgram();
+    // The same shaders drawing both paraboloids at once, when the vertex
+    // shader can choose the layer
+    reflectionLayeredProgram = NULL;
+    int extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (int i = 0; i < extensionCount; i++)
+        if (std::string((const char*)glGetStringi(GL_EXTENSIONS, i)) == "GL_ARB_shader_viewport_layer_array") {
+            reflectionLayeredProgram = new ShaderProgram();
+            reflectionLayeredProgram->AddShader("reflection.vert", GL_VERTEX_SHADER);
+            reflectionLayeredProgram->AddShader("reflection.frag", GL_FRAGMENT_SHADER);
+            reflectionLayeredProgram->AddShader("lighting.vert", GL_VERTEX_SHADER);
+            reflectionLayeredProgram->AddShader("lighting.frag", GL_FRAGMENT_SHADER);
+            glBindAttribLocation(reflectionLayeredProgram->programId, 0, "vertex");
+            glBindAttribLocation(reflectionLayeredProgram->programId, 1, "vertexNormal");
+            glBindAttribLocation(reflectionLayeredProgram->programId, 2, "vertexTexture");
+            glBindAttribLocation(reflectionLayeredProgram->programId, 3, "vertexTangent");
+            reflectionLayeredProgram->defines = ShaderDefine("LAYERED", 1);
+            reflectionLayeredProgram->LinkProgram();
+            reflectionLayeredProgram->isReflectionShader = true;
+            reflectionLayeredProgram->layers = 2;
+            // A shape reaches the upper paraboloid if any of it is above
+            // the reflection eye, the lower if any is below
+            reflectionLayeredProgram->layerMask = [this](const glm::vec3& center, const float radius) {
+                return (center.z - reflectionEye.z > -radius ? 1u : 0u)
+                    | (center.z - reflectionEye.z < radius ? 2u : 0u); };
+        }
+    if (!reflectionLayeredProgram)
+        reflection_layered_mode = 0;
+
+	//One two layer target for the reflection, a layer for each parabaloid
+	reflectionRenderTarget.CreateFBO(fbo_width, fbo_height, 2);
+
+    // Create the shader program for deferred shading pass.  It, and
+    // every pass reading the G-buffer, has a permutation per layout.
+    gbufferVariants = new ShaderVariants();
+    gbufferVariants->AddShader("gbuffer.vert", GL_VERTEX_SHADER);
+    gbufferVariants->AddShader("gbuffer.frag", GL_FRAGMENT_SHADER);
+
+    gbufferVariants->BindAttribLocation(0, "vertex");
+    gbufferVariants->BindAttribLocation(1, "vertexNormal");
+    gbufferVariants->BindAttribLocation(2, "vertexTexture");
+    gbufferVariants->BindAttribLocation(3, "vertexTangent");
+
+    // The compute kernels, each with the work group sizes the autotuner
+    // may choose from; the first is the default.  The blurs stage a
+    // group plus a 101 pixel apron, so their groups span at least 101.
+    std::vector<glm::ivec2> rowSizes = { glm::ivec2(128, 1), glm::ivec2(256, 1) };
+    std::vector<glm::ivec2> columnSizes = { glm::ivec2(1, 128), glm::ivec2(1, 256) };
+    std::vector<glm::ivec2> tileSizes = { glm::ivec2(8, 8), glm::ivec2(16, 16), glm::ivec2(32, 8), glm::ivec2(64, 4) };
+
+    shadowBlurHKernel = new ComputeKernel("shadow blur H", "shadow_horizontal.comp", rowSizes);
+    shadowBlurVKernel = new ComputeKernel("shadow blur V", "shadow_vertical.comp", columnSizes);
+
+    // The same blur on the bloom buffer, whose images are R11G11B10F
+    bloomBlurHKernel = new ComputeKernel("bloom blur H", "shadow_horizontal.comp", rowSizes);
+    bloomBlurVKernel = new ComputeKernel("bloom blur V", "shadow_vertical.comp", columnSizes);
+
+    // Row and column scans building a summed-area table of the shadow
+    // moments, for the constant cost box filter in shadow_cascades.glsl.
+    // One group scans a whole line, in chunks of twice the group size.
+    std::vector<glm::ivec2> scanSizes = { glm::ivec2(512, 1), glm::ivec2(256, 1), glm::ivec2(128, 1) };
+    satRowsKernel = new ComputeKernel("SAT rows", "parallel_sum.comp", scanSizes);
+    satColumnsKernel = new ComputeKernel("SAT columns", "parallel_sum.comp", scanSizes);
+
+    // AO tiles stage their positions plus an 8 pixel apron
+    AOKernel = new ComputeKernel("AO", "ao.comp",
+                                 { glm::ivec2(16, 16), glm::ivec2(8, 8), glm::ivec2(32, 8), glm::ivec2(16, 8) });
+    AOBlurHKernel = new ComputeKernel("AO blur H", "bilinear_filter_horizontal.comp", rowSizes);
+    AOBlurVKernel = new ComputeKernel("AO blur V", "bilinear_filter_vertical.comp", columnSizes);
+    AOUpsampleKernel = new ComputeKernel("AO upsample", "ao_upsample.comp", tileSizes);
+    AOTemporalKernel = new ComputeKernel("AO temporal", "ao_temporal.comp", tileSizes);
+    hizKernel = new ComputeKernel("Hi-Z", "hiz.comp", tileSizes);
+    taaKernel = new ComputeKernel("TAA", "taa.comp", tileSizes);
+
+    // The bloom mip chain.  The single pass downsample's group size
+    // is fixed by its 64x64 tiles.
+    downsampleKernel = new ComputeKernel("bloom downsample", "downsample.comp", { glm::ivec2(16, 16) });
+    upsampleKernel = new ComputeKernel("bloom upsample", "upsample.comp", tileSizes);
+
+    // Only run when the skydome changes, so not worth tuning
+    prefilterEnvKernel = new ComputeKernel("prefilter env", "prefilter_env.comp", { glm::ivec2(8, 8) });
+    brdfLutKernel = new ComputeKernel("BRDF LUT", "brdf_lut.comp", { glm::ivec2(8, 8) });
+
+    ComputeKernel::LoadTuning();
 
     glGenBuffers(1, &blur_kernel_block_id); // Generates block 
     int bindpoint = 0; // Start at zero, increment for other blocks
@@ -231,56 +304,30 @@ void Scene::InitializeScene()
     glBufferData(GL_UNIFORM_BUFFER, sizeof(float) * 101, NULL, GL_DYNAMIC_DRAW);
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-    GLuint loc = glGetUniformBlockIndex(shadowBlur_H_Program->programId, "blurKernel");
-    glUniformBlockBinding(shadowBlur_H_Program->programId, loc, bindpoint);
-
-    loc = glGetUniformBlockIndex(shadowBlur_V_Program->programId, "blurKernel");
-    glUniformBlockBinding(shadowBlur_V_Program->programId, loc, bindpoint);
-
-    //Create the FBO as the output texture for the shadow blue
-    shadowBlurOutput.CreateFBO(fbo_width, fbo_height);
+    shadowBlurHKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
+    shadowBlurVKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
+    bloomBlurHKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
+    bloomBlurVKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
 
     //Create the FBO for the gbuffer used in deferred shading
-    gbufferRenderTarget.CreateFBO(750, 750, 4);
+    CreateGbuffer(750, 750);
 
-    //Create a uniform block for the hammersly block
-    glGenBuffers(1, &h_block_id);
-    glBindBuffer(GL_UNIFORM_BUFFER, h_block_id);
+    //Create a uniform block for the skydome's irradiance SH coefficients
+    glGenBuffers(1, &irr_sh_block_id);
+    glBindBuffer(GL_UNIFORM_BUFFER, irr_sh_block_id);
     bindpoint += 1;
-    glBindBufferBase(GL_UNIFORM_BUFFER, bindpoint, h_block_id);
-    size_t h_block_size = sizeof(h_block);
-    glBufferData(GL_UNIFORM_BUFFER, h_block_size, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, bindpoint, irr_sh_block_id);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(glm::vec4) * IRRADIANCE_SH_COUNT, NULL, GL_DYNAMIC_DRAW);
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-    loc = glGetUniformBlockIndex(lightingProgram->programId, "HammersleyBlock");
-    glUniformBlockBinding(lightingProgram->programId, loc, bindpoint);
-
-    sampling_count = 20;
-    h_block.N = 20;
-    RecalculateHBlock();
+    lightingVariants->UniformBlockBinding("IrradianceBlock", bindpoint);
+    reflectionProgram->UniformBlockBinding("IrradianceBlock", bindpoint);
+    if (reflectionLayeredProgram)
+        reflectionLayeredProgram->UniformBlockBinding("IrradianceBlock", bindpoint);
 
-    glBindBuffer(GL_UNIFORM_BUFFER, h_block_id);
-    h_block_size = sizeof(h_block);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, h_block_size, &h_block);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
     CHECKERROR;
 
-    //Create a compute shader for AO pass
-    AOProgram = new ShaderProgram();
-    AOProgram->AddShader("ao.comp", GL_COMPUTE_SHADER);
-    AOProgram->LinkProgram();
-
-    AORenderTarget.CreateFBO(750, 750);
-
-    // Create the compute shader program for bilinear filter
-    bilinear_H_Program = new ShaderProgram();
-    bilinear_H_Program->AddShader("bilinear_filter_horizontal.comp", GL_COMPUTE_SHADER);
-    bilinear_H_Program->LinkProgram();
-
-    bilinear_V_Program = new ShaderProgram();
-    bilinear_V_Program->AddShader("bilinear_filter_vertical.comp", GL_COMPUTE_SHADER);
-    bilinear_V_Program->LinkProgram();
-
+    // The uniform block for the AO's bilinear filter
     glGenBuffers(1, &bilinear_kernel_block_id); // Generates block 
     bindpoint++; // Start at zero, increment for other blocks
 
@@ -289,35 +336,38 @@ void Scene::InitializeScene()
     glBufferData(GL_UNIFORM_BUFFER, sizeof(float) * 101, NULL, GL_DYNAMIC_DRAW);
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-    loc = glGetUniformBlockIndex(bilinear_H_Program->programId, "blurKernel");
-    glUniformBlockBinding(bilinear_H_Program->programId, loc, bindpoint);
+    AOBlurHKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
+    AOBlurVKernel->variants->UniformBlockBinding("blurKernel", bindpoint);
 
-    loc = glGetUniformBlockIndex(bilinear_V_Program->programId, "blurKernel");
-    glUniformBlockBinding(bilinear_V_Program->programId, loc, bindpoint);
+    // Create the shader program for Local lights pass
+    localLightsVariants = new ShaderVariants();
+    localLightsVariants->AddShader("local_lights.vert", GL_VERTEX_SHADER);
+    localLightsVariants->AddShader("local_lights.frag", GL_FRAGMENT_SHADER);
 
-    //Create the FBO as the output texture for the shadow blue
-    bilinearFilterOutput.CreateFBO(750, 750);
-    bilinearFilterOutput_2.CreateFBO(750, 750);
+    localLightsVariants->BindAttribLocation(0, "vertex");
+    localLightsVariants->BindAttribLocation(1, "vertexNormal");
+    localLightsVariants->BindAttribLocation(2, "vertexTexture");
+    localLightsVariants->BindAttribLocation(3, "vertexTangent");
+    localLightsVariants->BindAttribLocation(4, "lightPosRadius");
+    localLightsVariants->BindAttribLocation(5, "lightColor");
 
-    // Create the shader program for Local lights pass
-    localLightsProgram = new ShaderProgram();
-    localLightsProgram->AddShader("local_lights.vert", GL_VERTEX_SHADER);
-    localLightsProgram->AddShader("local_lights.frag", GL_FRAGMENT_SHADER);
+    // The clustered alternative: one full screen pass over per-cluster light lists
+    clusteredLightsVariants = new ShaderVariants();
+    clusteredLightsVariants->AddShader("post.vert", GL_VERTEX_SHADER);
+    clusteredLightsVariants->AddShader("clustered_lights.frag", GL_FRAGMENT_SHADER);
 
-    glBindAttribLocation(localLightsProgram->programId, 0, "vertex");
-    glBindAttribLocation(localLightsProgram->programId, 1, "vertexNormal");
-    glBindAttribLocation(localLightsProgram->programId, 2, "vertexTexture");
-    glBindAttribLocation(localLightsProgram->programId, 3, "vertexTangent");
-    localLightsProgram->LinkProgram();
+    clusteredLightsVariants->BindAttribLocation(0, "vertex");
+    lightClusters.Create();
 
     //Create shader programs for post processing
-    postProcessing_Program = new ShaderProgram();
-    postProcessing_Program->AddShader("post.vert", GL_VERTEX_SHADER);
-    postProcessing_Program->AddShader("post.frag", GL_FRAGMENT_SHADER);
+    postProcessingVariants = new ShaderVariants();
+    postProcessingVariants->AddShader("post.vert", GL_VERTEX_SHADER);
+    postProcessingVariants->AddShader("post.frag", GL_FRAGMENT_SHADER);
 
-    glBindAttribLocation(postProcessing_Program->programId, 0, "vertex");
-    postProcessing_Program->LinkProgram();
-    glBindFragDataLocation(postProcessing_Program->programId, 0, "out_color");
+    postProcessingVariants->BindAttribLocation(0, "vertex");
+
+    //Build the permutations for the startup menu settings now
+    SelectShaderVariants();
 
 
     //Create a compute shader for post processing
@@ -326,41 +376,19 @@ void Scene::InitializeScene()
     postProcessing_Compute->LinkProgram();
 
     //Create a ping pong buffer for post processing
-    postProcessingBuffer.CreateFBO(750, 750, 3);
-    glBindFragDataLocation(localLightsProgram->programId, 0, "RenderBuffer");
-    glBindFragDataLocation(localLightsProgram->programId, 1, "PostProcessBuffer");
-
-    int downsampling_width;
-    int downsampling_height;
-    for (unsigned int i = 1; i <= 2; ++i) {
-        glBindTexture(GL_TEXTURE_2D, postProcessingBuffer.textureID[i]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, downsampling_passes);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR_MIPMAP_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        downsampling_width = 750 / 2;
-        downsampling_height = 750 / 2;
-        glBindTexture(GL_TEXTURE_2D, postProcessingBuffer.textureID[i]);
-        for (unsigned int mip_level = 0; mip_level < downsampling_passes; ++mip_level) {
-            glTexImage2D(GL_TEXTURE_2D, mip_level + 1, (int)GL_RGBA32F,
-                downsampling_width, downsampling_height, 0, GL_RGBA, GL_FLOAT, NULL);
-            CHECKERROR;
-            downsampling_width /= 2;
-            downsampling_height /= 2;
-        }
-        glBindTexture(GL_TEXTURE_2D, 0);
-    }
+    CreatePostProcessingBuffer(750, 750);
+
+    // The downsample's count of finished groups, starting at zero
+    GLuint zero = 0;
+    glGenBuffers(1, &downsample_counter_id);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, downsample_counter_id);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &zero, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    //Create a compute shader for the downsampling pass 
-    downsampling_Compute = new ShaderProgram();
-    downsampling_Compute->AddShader("downsample.comp", GL_COMPUTE_SHADER);
-    downsampling_Compute->LinkProgram();
+    //Level m of the prefiltered skydome holds roughness m/(levels-1).
+    specular_env.Create(512, 256, 6);
 
-    //Create a compute shader for the upsampling + blending pass 
-    upsampling_Compute = new ShaderProgram();
-    upsampling_Compute->AddShader("upsample.comp", GL_COMPUTE_SHADER);
-    upsampling_Compute->LinkProgram();
+    ShaderProgram::IssueBatch();
 
     // Create all the Polygon shapes
     proceduralground = new ProceduralGround(grndSize, 400,
@@ -473,6 +501,7 @@ void Scene::InitializeScene()
 
     // Central model has a rudimentary animation (constant rotation on Z)
     animated.push_back(anim);
+    anim->dynamic = true;
 
     // Central contains a teapot on a podium and an external sphere of spheres
     central->add(podium, Translate(0.0, 0,0));
@@ -497,16 +526,23 @@ void Scene::InitializeScene()
     // Options menu stuff
     show_demo_window = false;
 
-    p_sky_dome_cage = new Texture(".\\textures\\cages.jpg");
+    //The skydomes have their diffuse irradiance projected onto SH at load time
+    p_sky_dome_cage = new Texture(".\\textures\\cages.jpg", false, true);
     //Skydome texture from https://vwartclub.com/?section=xfree3d&category=hdri&article=xfree3d-hdri-shop-s84-low-cloudy-1836
-    p_sky_dome = new Texture(".\\textures\\Sky.jpg");
-    p_barca_sky = new Texture(".\\textures\\Barce_Rooftop_C_3k.hdr", true);
-    p_barca_irr_map = new Texture(".\\textures\\Barce_Rooftop_C_3k.irr.hdr", true);
-    p_mon_valley_sky = new Texture(".\\textures\\MonValley_A_LookoutPoint_2k.hdr");
-    p_mon_valley_irr_map = new Texture(".\\textures\\MonValley_A_LookoutPoint_2k.irr.hdr");
+    p_sky_dome = new Texture(".\\textures\\Sky.jpg", false, true);
+    p_barca_sky = new Texture(".\\textures\\Barce_Rooftop_C_3k.hdr", true, true);
+    p_mon_valley_sky = new Texture(".\\textures\\MonValley_A_LookoutPoint_2k.hdr", false, true);
     //Create a full screen quad to render for the deferred shading pass.
     CreateFullScreenQuad();
-    CreateLocalLights(SpherePolygons);
+    CreateLocalLights();
+
+    //The shader programs issued above have been compiling while the
+    //meshes and textures were generated; collect the results now.
+    ShaderProgram::FinishPending();
+    ShaderProgram::PrintBuildTimes();
+
+    //The BRDF lookup table does not depend on the skydome, so it is built once.
+    specular_env.ComputeBrdfLUT(brdfLutKernel, 256);
 }
 
 void Scene::DrawMenu()
@@ -519,9 +555,9 @@ void Scene::DrawMenu()
         // This menu demonstrates how to provide the user a list of toggleable settings.
         if (ImGui::BeginMenu("Objects")) {
             if (ImGui::MenuItem("Draw spheres", "", spheres->drawMe))  {spheres->drawMe ^= true; }
-            if (ImGui::MenuItem("Draw walls", "", room->drawMe))       {room->drawMe ^= true; }
-            if (ImGui::MenuItem("Draw ground", "", ground->drawMe)){ground->drawMe ^= true;}
-            if (ImGui::MenuItem("Draw sea", "", sea->drawMe)) { sea->drawMe ^= true; }
+            if (ImGui::MenuItem("Draw walls", "", room->drawMe))       {room->drawMe ^= true; shadowCacheValid = false; }
+            if (ImGui::MenuItem("Draw ground", "", ground->drawMe)){ground->drawMe ^= true; shadowCacheValid = false; }
+            if (ImGui::MenuItem("Draw sea", "", sea->drawMe)) { sea->drawMe ^= true; shadowCacheValid = false; }
             ImGui::EndMenu(); }
         
         if (ImGui::BeginMenu("Lighting ")) {
@@ -532,9 +568,22 @@ void Scene::DrawMenu()
             ImGui::EndMenu();
         }
 
+        if (ImGui::BeginMenu("G-buffer ")) {
+            if (ImGui::MenuItem("Full (4x RGBA32F)", "", gbuffer_mode == 0)) { gbuffer_mode = 0; }
+            if (ImGui::MenuItem("Compact (depth, RG16F, 2x RGBA8)", "", gbuffer_mode == 1)) { gbuffer_mode = 1; }
+            ImGui::EndMenu();
+        }
+
         if (ImGui::BeginMenu("Local Lights ")) {
             if (ImGui::MenuItem("On", "", local_lights_on == 1)) { local_lights_on = 1; }
             if (ImGui::MenuItem("Off", "", local_lights_on == 0)) { local_lights_on = 0; }
+            if (ImGui::MenuItem("Light volumes", "", local_lights_mode == 0)) { local_lights_mode = 0; }
+            if (ImGui::MenuItem("Clustered", "", local_lights_mode == 1)) { local_lights_mode = 1; }
+            ImGui::MenuItem("Animate", "", &local_lights_animate);
+            if (local_lights_mode == 1)
+                ImGui::Text("%d lights, %d cluster entries", lightClusters.lightCount, lightClusters.indexCount);
+            else
+                ImGui::Text("%d of %d light volumes drawn", visible_local_lights, lightSystem.count);
             ImGui::EndMenu();
         }
 
@@ -543,6 +592,26 @@ void Scene::DrawMenu()
 			if (ImGui::MenuItem("Mixed Color BRDF", "", reflectionMode == 1)) { reflectionMode = 1; }
             if (ImGui::MenuItem("Mixed Color Simple", "", reflectionMode == 2)) { reflectionMode = 2; }
 			if (ImGui::MenuItem("Off", "", reflectionMode == 3)) { reflectionMode = 3; }
+            ImGui::Separator();
+            if (ImGui::MenuItem("Paraboloid maps", "", reflection_source == 0)) { reflection_source = 0; }
+            if (reflection_source == 0 && reflectionLayeredProgram) {
+                if (ImGui::MenuItem("  Both in one pass", "", reflection_layered_mode == 1)) { reflection_layered_mode = 1; }
+                if (ImGui::MenuItem("  A pass per paraboloid", "", reflection_layered_mode == 0)) { reflection_layered_mode = 0; }
+            }
+            if (reflection_source == 0) {
+                if (ImGui::MenuItem("  Update every frame", "", reflection_update_mode == 0)) { reflection_update_mode = 0; }
+                if (ImGui::MenuItem("  Update a paraboloid per frame", "", reflection_update_mode == 1)) { reflection_update_mode = 1; }
+                if (ImGui::MenuItem("  Update on change", "", reflection_update_mode == 2)) { reflection_update_mode = 2; }
+                if (reflection_update_mode == 2)
+                    ImGui::SliderFloat("Update range", &reflection_range, 1.0f, 200.0f);
+                ImGui::Text("%d paraboloids drawn this frame", reflections_drawn);
+            }
+            if (ImGui::MenuItem("Screen space", "", reflection_source == 1)) { reflection_source = 1; }
+            if (reflection_source == 1) {
+                ImGui::SliderInt("SSR steps", &ssr_max_steps, 16, 256);
+                ImGui::SliderFloat("SSR thickness", &ssr_thickness, 0.05f, 5.0f);
+                ImGui::SliderFloat("SSR distance", &ssr_max_distance, 5.0f, 200.0f);
+            }
 			ImGui::EndMenu();
 		}
 
@@ -567,7 +636,12 @@ void Scene::DrawMenu()
         if (ImGui::BeginMenu("AO ")) {
             if (ImGui::MenuItem("Enabled", "", ao_enabled == 1)) { ao_enabled = 1; }
             if (ImGui::MenuItem("Disabled", "", ao_enabled == 0)) { ao_enabled = 0; }
-            ImGui::SliderInt("AO sample count", &ao_sample_count, 10, 20);
+            if (ImGui::MenuItem("Full resolution", "", ao_resolution_mode == 0)) { ao_resolution_mode = 0; }
+            if (ImGui::MenuItem("Half resolution", "", ao_resolution_mode == 1)) { ao_resolution_mode = 1; }
+            if (ImGui::MenuItem("Quarter resolution", "", ao_resolution_mode == 2)) { ao_resolution_mode = 2; }
+            if (ImGui::MenuItem("Temporal accumulation", "", ao_temporal_mode == 1)) { ao_temporal_mode = 1 - ao_temporal_mode; }
+            ImGui::SliderInt("AO sample count", &ao_sample_count, 4, 20);
+            ImGui::SliderFloat("AO history weight", &ao_temporal_blend, 0, 0.98f);
             ImGui::SliderFloat("AO range", &ao_range, 0, 3, "%.5f");
             ImGui::SliderFloat("AO scale", &ao_scale, 0, 10);
             ImGui::SliderFloat("AO contrast", &ao_contrast, 0, 10);
@@ -575,6 +649,25 @@ void Scene::DrawMenu()
             ImGui::EndMenu();
         }
 
+        if (ImGui::BeginMenu("Resolution ")) {
+            if (ImGui::MenuItem("Fixed scale", "", dynamic_resolution_mode == 0)) { dynamic_resolution_mode = 0; }
+            if (ImGui::MenuItem("Dynamic", "", dynamic_resolution_mode == 1)) { dynamic_resolution_mode = 1; }
+            if (dynamic_resolution_mode == 0)
+                ImGui::SliderFloat("Scale", &resolution_scale, 0.25f, 1.0f);
+            else {
+                ImGui::SliderFloat("Target ms", &target_frame_ms, 4.0f, 50.0f);
+                ImGui::SliderFloat("Minimum scale", &min_resolution_scale, 0.25f, 1.0f);
+            }
+            ImGui::Text("%dx%d of %dx%d, GPU %.2f ms", render_width, render_height,
+                        width, height, Profiler::GpuMs("Frame graph"));
+            ImGui::Separator();
+            if (ImGui::MenuItem("Bilinear upscale", "", taa_mode == 0)) { taa_mode = 0; }
+            if (ImGui::MenuItem("Temporal anti-aliasing", "", taa_mode == 1)) { taa_mode = 1; }
+            if (taa_mode == 1)
+                ImGui::SliderFloat("History weight", &taa_blend, 0.5f, 0.98f);
+            ImGui::EndMenu();
+        }
+
         if (ImGui::BeginMenu("Post Processing ")) {
             if (ImGui::MenuItem("Tone Map 0", "", tone_map_mode == 0)) { tone_map_mode = 0; }
             if (ImGui::MenuItem("Tone Map 1", "", tone_map_mode == 1)) { tone_map_mode = 1; }
@@ -596,6 +689,22 @@ void Scene::DrawMenu()
             ImGui::EndMenu();
         }
 
+        if (ImGui::BeginMenu("VRAM ")) {
+            DrawVramReport();
+            ImGui::EndMenu();
+        }
+
+        if (ImGui::BeginMenu("Compute ")) {
+            DrawComputeReport();
+            ImGui::EndMenu();
+        }
+
+        if (ImGui::BeginMenu("Profiler ")) {
+            if (ImGui::MenuItem("Show window", "", show_profiler)) { show_profiler = !show_profiler; }
+            if (ImGui::MenuItem("Write trace.json")) { Trace::Write("trace.json"); }
+            ImGui::EndMenu();
+        }
+
         if (ImGui::BeginMenu("Draw FBOs")) {
             if (ImGui::MenuItem("Draw Shadow Map", "", draw_fbo == 0)) { draw_fbo = 0; }
             if (ImGui::MenuItem("Draw Shadow Map squared", "", draw_fbo == 1)) { draw_fbo = 1; }
@@ -621,14 +730,32 @@ void Scene::DrawMenu()
     if (lightingMode != 3) {
         ImGui::Begin("Shadow Kernel Control");
         ImGui::SliderInt("Shadow Blur Kernel", &kernel_width, 2, 50);
+        ImGui::RadioButton("Separable Gaussian blur", &shadow_filter_mode, 0);
+        ImGui::RadioButton("Summed-area table box filter", &shadow_filter_mode, 1);
+        if (ImGui::RadioButton("Redraw all casters", &shadow_cache_mode, 0)
+            || ImGui::RadioButton("Cache static casters", &shadow_cache_mode, 1))
+            shadowCacheValid = false;
+        ImGui::SliderInt("Cascades", &cascade_count, 1, MaxCascades);
+        ImGui::SliderFloat("Log/uniform split", &cascade_split_lambda, 0.0f, 1.0f);
+        for (int i = 0; i < cascade_count; i++)
+            ImGui::Text("Cascade %d : %.1f - %.1f", i, cascadeSplits[i], cascadeSplits[i + 1]);
         ImGui::Text("LightDist : %f", lightDist);
         ImGui::End();
     }
     else {
         ImGui::Begin("IBL");
-        ImGui::SliderInt("Sampling count", &sampling_count, 20, 40);
+        // Each change prefilters the whole skydome, so not while dragging
+        ImGui::SliderInt("Prefilter samples", &sampling_count_slider, 16, 256);
+        if (ImGui::IsItemDeactivatedAfterEdit())
+            sampling_count = sampling_count_slider;
+        ImGui::RadioButton("Prefilter on GPU", &env_prefilter_mode, 0);
+        ImGui::RadioButton("Prefilter on CPU", &env_prefilter_mode, 1);
+        ImGui::Text("Last prefilter: %.1f ms", env_prefilter_ms);
         ImGui::End();
     }
+
+    if (show_profiler)
+        Profiler::DrawWindow(&show_profiler);
     
     if (gamelike_mode == true) {
         const float step = speed * (glfwGetTime() - time_at_prev_frame);
@@ -692,83 +819,284 @@ void Scene::DrawFullScreenQuad() {
     glBindVertexArray(0);
 }
 
-void Scene::CreateLocalLights(Shape* SpherePolygons) {
+// A grid of small lights orbiting their grid points and flickering,
+// plus a few large steady ones near the center
+void Scene::CreateLocalLights() {
     for (int i = -200; i <= 200; i+=5) {
         for (int j = -200; j <= 200; j+=5) {
-            Object* new_light = new Object(SpherePolygons, spheresId, glm::vec3(10.0, 10.0, 10.0), glm::vec3(1.0, 1.0, 1.0), 0.128); //phong alpha = 120
-            LocalLights.push_back(new_light);
-            local_light_positions.push_back(glm::vec3(i, j, 2));
-            local_light_radii.push_back(4.0);
+            int l = lightSystem.Add(glm::vec3(i, j, 2), 4.0, glm::vec3(10.0, 10.0, 10.0));
+            lightSystem.phase[l] = 2*PI*glm::fract(sin(l*12.9898f)*43758.5453f);
+            lightSystem.SetOrbit(l, 1.5, 0.5 + glm::fract(l*0.618034f));
+            lightSystem.SetFlicker(l, 0.3, 6.0);
         }
     }
 
     for (int i = -12; i <= 12; i+=6) {
         for (int j = -12; j <= 12; j+=6) {
-            Object* new_light = new Object(SpherePolygons, spheresId, glm::vec3(10.0, 10.0, 10.0), glm::vec3(1.0, 1.0, 1.0), 0.128); //phong alpha = 120
-            LocalLights.push_back(new_light);
-            local_light_positions.push_back(glm::vec3(i, j, 3));
-            local_light_radii.push_back(10.0);
+            lightSystem.Add(glm::vec3(i, j, 3), 10.0, glm::vec3(10.0, 10.0, 10.0));
         }
     }
+    lightSystem.Allocate();
+    local_light_time = 0.0;
+    local_light_clock = glfwGetTime();
+
+    // The light volume proxy; its per light instance attributes 4 and 5
+    // point into the light system's buffer, see DrawLocalLights
+    lightVolume = new Icosphere(1);
+    visible_local_lights = 0;
+    glBindVertexArray(lightVolume->vaoID);
+    glEnableVertexAttribArray(4);
+    glVertexAttribDivisor(4, 1);
+    glEnableVertexAttribArray(5);
+    glVertexAttribDivisor(5, 1);
+    glBindVertexArray(0);
+    CHECKERROR;
 }
 
+// Draws every light volume left after frustum rejection in a single
+// instanced call of the icosphere proxy
 void Scene::DrawLocalLights(ShaderProgram* program) {
-    int loc;
-    glm::vec3 local_light_pos;
-    float local_light_radius;
-    for (int i = 0; i < LocalLights.size(); i++) {
-        local_light_pos = local_light_positions[i];
-        local_light_radius = local_light_radii[i];
-        CHECKERROR;
-        loc = glGetUniformLocation(program->programId, "localLightPos");
-        CHECKERROR;
-        glUniform3fv(loc, 1, &(local_light_pos[0]));
-        CHECKERROR;
-        loc = glGetUniformLocation(program->programId, "localLightRadius");
-        CHECKERROR;
-        glUniform1f(loc, local_light_radius);
-        CHECKERROR;
-        LocalLights[i]->Draw(program, Translate(local_light_pos.x, local_light_pos.y, local_light_pos.z) * 
-                                        Scale(local_light_radius, local_light_radius, local_light_radius));
-        CHECKERROR;
+    // The frustum's planes from the rows of the combined matrix, each
+    // normalized so a sphere's distance to it can be compared to its radius
+    glm::mat4 M = WorldProj*WorldView;
+    glm::vec4 planes[6];
+    glm::vec4 w(M[0][3], M[1][3], M[2][3], M[3][3]);
+    for (int i = 0; i < 3; i++) {
+        glm::vec4 row(M[0][i], M[1][i], M[2][i], M[3][i]);
+        planes[2*i] = w + row;
+        planes[2*i + 1] = w - row;
     }
+    for (int p = 0; p < 6; p++)
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+
+    // The kept lights go straight into this frame's section of the
+    // light system's mapped buffer
+    glm::vec4* instances = lightSystem.Instances();
+    visible_local_lights = 0;
+    for (int i = 0; i < lightSystem.count; i++) {
+        glm::vec4 center(lightSystem.x[i], lightSystem.y[i], lightSystem.z[i], 1.0f);
+        bool visible = true;
+        for (int p = 0; p < 6 && visible; p++)
+            visible = glm::dot(planes[p], center) >= -lightSystem.radius[i];
+        if (visible) {
+            instances[2*visible_local_lights] = glm::vec4(glm::vec3(center), lightSystem.radius[i]);
+            instances[2*visible_local_lights + 1] = glm::vec4(lightSystem.r[i], lightSystem.g[i], lightSystem.b[i], 1.0f);
+            visible_local_lights++;
+        }
+    }
+    if (visible_local_lights == 0)
+        return;
+
+    const size_t offset = lightSystem.InstanceOffset();
+    glBindVertexArray(lightVolume->vaoID);
+    glBindBuffer(GL_ARRAY_BUFFER, lightSystem.bufferId);
+    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, 2*sizeof(glm::vec4), (void*)offset);
+    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, 2*sizeof(glm::vec4), (void*)(offset + sizeof(glm::vec4)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDrawElementsInstanced(GL_TRIANGLES, 3*lightVolume->count, GL_UNSIGNED_INT, 0, visible_local_lights);
+    glBindVertexArray(0);
+    CHECKERROR;
+}
+
+// The full layout keeps four RGBA32F attachments (64 bytes a pixel);
+// the compact one a depth texture plus 12 bytes, see gbuffer.glsl.
+void Scene::CreateGbuffer(int w, int h){
+    if (gbuffer_mode == 1) {
+        GLenum formats[5] = { GL_NONE, GL_RG16F, GL_SRGB8_ALPHA8, GL_RGBA8, GL_RG16F };
+        gbufferRenderTarget.CreateFBO(w, h, 5, formats, true);
+    }
+    else {
+        GLenum formats[5] = { GL_RGBA32F, GL_RGBA32F, GL_RGBA32F, GL_RGBA32F, GL_RG16F };
+        gbufferRenderTarget.CreateFBO(w, h, 5, formats);
+    }
+    gbuffer_built_mode = gbuffer_mode;
+}
+
+// Binds the G-buffer for the accessors in gbuffer.glsl
+void Scene::BindGbuffer(const int programId){
+    gbufferRenderTarget.BindTexture(programId, 18, "gBufferWorldPos", 0);
+    gbufferRenderTarget.BindTexture(programId, 19, "gBufferNormalVec", 1);
+    gbufferRenderTarget.BindTexture(programId, 20, "gBufferDiffuse", 2);
+    gbufferRenderTarget.BindTexture(programId, 21, "gBufferSpecular", 3);
+    gbufferRenderTarget.BindTexture(programId, 30, "gBufferVelocity", 4);
+    int loc = glGetUniformLocation(programId, "gbufferSize");
+    glUniform2i(loc, render_width, render_height);
+    if (gbuffer_mode == 1) {
+        gbufferRenderTarget.BindDepthTexture(programId, 27, "gBufferDepth");
+        glm::mat4 viewProjInverse = glm::inverse(WorldProj*WorldView);
+        loc = glGetUniformLocation(programId, "ViewProjInverse");
+        glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(viewProjInverse));
+    }
+    CHECKERROR;
+}
+
+// Splits the view frustum by distance into cascade_count slices and
+// fits an orthographic light projection around each.  The splits blend
+// logarithmic and uniform spacing by cascade_split_lambda, and stop at
+// the far side of the scene rather than at the back plane.  Each
+// projection covers its slice's corners, cropped in x and y to the
+// scene's bounds and snapped to coarse steps; casters in front of a
+// slice are depth clamped onto its near plane as they are drawn.
+void Scene::FitShadowCascades()
+{
+    // World bounds of what is drawn, less the skydome
+    glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+    objectRoot->Bounds(Identity, skyId, sceneMin, sceneMax);
+
+    glm::vec3 lightMin(FLT_MAX), lightMax(-FLT_MAX);
+    float farthest = front;
+    for (int c = 0; c < 8; c++) {
+        glm::vec4 P((c&1) ? sceneMax.x : sceneMin.x,
+                    (c&2) ? sceneMax.y : sceneMin.y,
+                    (c&4) ? sceneMax.z : sceneMin.z, 1.0f);
+        glm::vec3 L = (LightView*P).xyz();
+        lightMin = glm::min(lightMin, L);
+        lightMax = glm::max(lightMax, L);
+        farthest = std::max(farthest, -(WorldView*P).z);
+    }
+    const float farSplit = std::min(back, farthest);
+
+    for (int i = 0; i <= cascade_count; i++) {
+        float t = i / float(cascade_count);
+        float logSplit = front*pow(farSplit/front, t);
+        float uniformSplit = front + (farSplit - front)*t;
+        cascadeSplits[i] = cascade_split_lambda*logSplit + (1 - cascade_split_lambda)*uniformSplit;
+    }
+
+    const float rx = ry * width / height;
+    glm::mat4 viewToLight = LightView*WorldInverse;
+    for (int i = 0; i < cascade_count; i++) {
+        glm::vec3 minP(FLT_MAX), maxP(-FLT_MAX);
+        for (int c = 0; c < 8; c++) {
+            float d = cascadeSplits[i + (c >> 2)];
+            glm::vec4 V(((c&1) ? rx : -rx)*d, ((c&2) ? ry : -ry)*d, -d, 1.0f);
+            glm::vec3 L = (viewToLight*V).xyz();
+            minP = glm::min(minP, L);
+            maxP = glm::max(maxP, L);
+        }
+
+        for (int c = 0; c < 2; c++) {
+            minP[c] = std::max(minP[c], lightMin[c]);
+            maxP[c] = std::max(std::min(maxP[c], lightMax[c]), minP[c] + 0.01f);
+        }
+
+        // A square whose size is rounded up to a quarter octave, with its
+        // corner snapped to a sixteenth of that size (whole texels, as
+        // fbo_width is a multiple of 16).  The margin lets the slice drift
+        // a step within it, so the projection only changes in those steps
+        // as the camera moves: the shadow edges don't crawl, and the
+        // static casters' cache outlives most frames.
+        const float extent = std::max(maxP.x - minP.x, maxP.y - minP.y)*(9.0f/8.0f);
+        const float size = pow(2.0f, std::ceil(4.0f*std::log2(extent))/4.0f);
+        const float step = size/16.0f;
+        for (int c = 0; c < 2; c++) {
+            minP[c] = std::floor(minP[c]/step)*step;
+            maxP[c] = minP[c] + size;
+        }
+        minP.z = std::floor(minP.z/step)*step;
+        maxP.z = std::ceil(maxP.z/step)*step;
+
+        // The light looks down -z, so the slice's near side is at maxP.z
+        CascadeProj[i] = Orthographic(minP.x, maxP.x, minP.y, maxP.y, -maxP.z, -minP.z);
+        ShadowMatrices[i] = BMatrix*CascadeProj[i]*LightView;
+    }
+}
+
+// Binds the cascades for the lookup in shadow_cascades.glsl
+void Scene::BindShadowCascades(const int programId, const int unit)
+{
+    shadowPassRenderTarget.BindTexture(programId, unit, "shadowMap");
+    int loc = glGetUniformLocation(programId, "ShadowMatrices");
+    glUniformMatrix4fv(loc, cascade_count, GL_FALSE, Pntr(ShadowMatrices[0]));
+    loc = glGetUniformLocation(programId, "cascadeCount");
+    glUniform1i(loc, cascade_count);
+    loc = glGetUniformLocation(programId, "shadowFilterMode");
+    glUniform1i(loc, shadow_filter_mode);
+    loc = glGetUniformLocation(programId, "shadowFilterWidth");
+    glUniform1i(loc, kernel_width);
+    CHECKERROR;
+}
+
+// HDR color, bloom threshold and bloom upsample targets, the last two
+// with a mip chain for the bloom down/upsampling
+void Scene::CreatePostProcessingBuffer(int w, int h){
+    GLenum formats[3] = { GL_R11F_G11F_B10F, GL_R11F_G11F_B10F, GL_R11F_G11F_B10F };
+    postProcessingBuffer.CreateFBO(w, h, 3, formats);
+    for (unsigned int i = 1; i <= 2; ++i)
+        postProcessingBuffer.AllocateMips(i, downsampling_passes);
+    CHECKERROR;
 }
 
 void Scene::RebuildGbuffer(int w, int h){
     gbufferRenderTarget.DeleteFBO();
-    gbufferRenderTarget.CreateFBO(w, h, 4);
-    AORenderTarget.DeleteFBO();
-    AORenderTarget.CreateFBO(w, h);
-    bilinearFilterOutput.DeleteFBO();
-    bilinearFilterOutput.CreateFBO(w, h);
-    bilinearFilterOutput_2.DeleteFBO();
-    bilinearFilterOutput_2.CreateFBO(w, h);
+    CreateGbuffer(w, h);
 
     postProcessingBuffer.DeleteFBO();
-    postProcessingBuffer.CreateFBO(w, h, 3);
-    for (unsigned int i = 1; i <= 2; ++i) {
-        glBindTexture(GL_TEXTURE_2D, postProcessingBuffer.textureID[i]);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, downsampling_passes);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (int)GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (int)GL_LINEAR_MIPMAP_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        int downsampling_width = w / 2;
-        int downsampling_height = h / 2;
-        glBindTexture(GL_TEXTURE_2D, postProcessingBuffer.textureID[i]);
-        for (unsigned int mip_level = 0; mip_level < downsampling_passes; ++mip_level) {
-            glTexImage2D(GL_TEXTURE_2D, mip_level + 1, (int)GL_RGBA32F,
-                downsampling_width, downsampling_height, 0, GL_RGBA, GL_FLOAT, NULL);
-            CHECKERROR;
-            downsampling_width /= 2;
-            downsampling_height /= 2;
+    CreatePostProcessingBuffer(w, h);
+    ssrHistoryValid = false;    // The new HDR target has no lit image yet
+}
+
+// The work group size of each compute kernel, and while or after
+// autotuning the time per frame measured for each candidate
+void Scene::DrawComputeReport()
+{
+    if (ImGui::MenuItem("Autotune group sizes", "", ComputeKernel::autotuning, !ComputeKernel::autotuning))
+        ComputeKernel::StartAutotune();
+    ImGui::Separator();
+    for (unsigned int k = 0; k < ComputeKernel::kernels.size(); k++) {
+        ComputeKernel* kernel = ComputeKernel::kernels[k];
+        glm::ivec2 size = kernel->GroupSize();
+        ImGui::Text("%-18s %3dx%-3d", kernel->name.c_str(), size.x, size.y);
+        for (unsigned int c = 0; c < kernel->candidates.size(); c++) {
+            if (kernel->frames[c] == 0)
+                continue;
+            ImGui::SameLine();
+            ImGui::Text(" %dx%d:%.3fms", kernel->candidates[c].x, kernel->candidates[c].y, kernel->Milliseconds(c));
         }
-        glBindTexture(GL_TEXTURE_2D, 0);
     }
 }
 
+// Lists the video memory held by each render target
+void Scene::DrawVramReport()
+{
+    struct { const char* name; FBO* fbo; } targets[] = {
+        { "G-buffer", &gbufferRenderTarget },
+        { "HDR + bloom chain", &postProcessingBuffer },
+        { "AO history", &aoHistory },
+        { "SSR history", &ssrHistory },
+        { "TAA history", &taaHistory },
+    };
+    const float MB = 1024.0f*1024.0f;
+    size_t total = 0;
+    for (unsigned int i = 0; i < sizeof(targets)/sizeof(targets[0]); i++) {
+        if (targets[i].fbo->fboID == 0)
+            continue;
+        size_t bytes = targets[i].fbo->Bytes();
+        ImGui::Text("%-20s %4dx%-4d %8.2f MB", targets[i].name,
+                    targets[i].fbo->width, targets[i].fbo->height, bytes/MB);
+        total += bytes;
+    }
+    struct { const char* name; LayeredFBO* fbo; } layered[] = {
+        { "Shadow cascades", &shadowPassRenderTarget },
+        { "Static shadow cache", &shadowStaticTarget },
+        { "Reflection maps", &reflectionRenderTarget },
+    };
+    for (unsigned int i = 0; i < sizeof(layered)/sizeof(layered[0]); i++) {
+        size_t bytes = layered[i].fbo->Bytes();
+        ImGui::Text("%-20s %4dx%-4d %8.2f MB (%d layers)", layered[i].name,
+                    layered[i].fbo->width, layered[i].fbo->height, bytes/MB, layered[i].fbo->layers);
+        total += bytes;
+    }
+    ImGui::Text("%-20s %9s %8.2f MB (%.2f MB unpooled)", "Transient pool", "",
+                frameGraph.pooledBytes/MB, frameGraph.unaliasedBytes/MB);
+    total += frameGraph.pooledBytes;
+    ImGui::Separator();
+    ImGui::Text("%-20s %9s %8.2f MB", "Total", "", total/MB);
+}
+
 void Scene::BuildTransforms()
 {
+    TRACE_SCOPE("BuildTransforms");
     
 
     // @@ When you are ready to try interactive viewing, replace the
@@ -777,12 +1105,9 @@ void Scene::BuildTransforms()
     // tilt, tr, ry, front, and back.
     const float rx = ry * width / height;
     WorldProj = Perspective(rx, ry, front, back);
-    LightProj = Perspective(40 / lightDist, 40 / lightDist, front, back);
 
     WorldView = Translate(tx, ty, zoom) * Rotate(0, tilt - 90) * Rotate(2, spin) * Translate(-1*eye.x, -1*eye.y, -1*eye.z);
     LightView = LookAt(lightPos, glm::vec3(0, 0, 0), glm::vec3(0, 0, 1));
-
-    ShadowMatrix = BMatrix * LightProj * LightView;
     /*
     WorldProj[0][0]=  2.368;
     WorldProj[1][0]= -0.800;
@@ -814,6 +1139,21 @@ void Scene::BuildTransforms()
 }
 
 ////////////////////////////////////////////////////////////////////////
+// Length of the TAA jitter sequence
+static const int TAASamples = 16;
+
+// Element i of the Halton sequence in the given base, in [0, 1)
+static float Halton(int i, const int base)
+{
+    float f = 1.0f, r = 0.0f;
+    while (i > 0) {
+        f /= base;
+        r += f*(i % base);
+        i /= base;
+    }
+    return r;
+}
+
 // Procedure DrawScene is called whenever the scene needs to be
 // drawn. (Which is often: 30 to 60 times per second are the common
 // goals.)
@@ -831,24 +1171,73 @@ void Scene::DrawScene()
 
     // Update position of any continuously animating objects
     double atime = 360.0*glfwGetTime()/36;
-    for (std::vector<Object*>::iterator m=animated.begin();  m<animated.end();  m++)
-        (*m)->animTr = Rotate(2, atime);
+    for (std::vector<Object*>::iterator m=animated.begin();  m<animated.end();  m++) {
+        (*m)->prevAnimTr = (*m)->animTr;
+        (*m)->animTr = Rotate(2, atime); }
+
+    // The local lights' clock only runs while they animate
+    double now = glfwGetTime();
+    if (local_lights_animate)
+        local_light_time += now - local_light_clock;
+    local_light_clock = now;
+    if (local_lights_on == 1) {
+        ProfileScope scope("Light update");
+        lightSystem.Update(local_light_time);
+    }
 
     BuildTransforms();
 
     // The lighting algorithm needs the inverse of the WorldView matrix
     WorldInverse = glm::inverse(WorldView);
-    
 
-    if (sampling_count != h_block.N) {
-        h_block.N = sampling_count;
-        RecalculateHBlock();
+    FitShadowCascades();
 
-        glBindBuffer(GL_UNIFORM_BUFFER, h_block_id);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(h_block), &h_block);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
-        CHECKERROR;
+    if (sky_dome_mode != irr_sh_sky_mode)
+        UploadIrradianceSH();
+
+    if (gbuffer_mode != gbuffer_built_mode)
+        RebuildGbuffer(gbufferRenderTarget.width, gbufferRenderTarget.height);
+
+    // Reads back last frames' kernel timings, and while autotuning may
+    // move kernels to their next candidate group size
+    ComputeKernel::NextFrame();
+    SelectShaderVariants();
+
+    if (sky_dome_mode != env_sky_mode || sampling_count != env_sampling_count
+        || env_prefilter_mode != env_prefiltered_mode)
+        PrefilterSpecularEnv();
+
+    // The static casters' cache lasts until the light moves or a
+    // cascade steps to a new snapped placement (see FitShadowCascades);
+    // the shadow map itself only needs redrawing if something in it moves
+    bool cascadesMoved = cascade_count != shadowCacheCascades;
+    for (int i = 0; i < cascade_count; i++)
+        if (ShadowMatrices[i] != shadowCacheMatrices[i]) {
+            shadowCacheMatrices[i] = ShadowMatrices[i];
+            cascadesMoved = true;
+        }
+    if (cascadesMoved) {
+        shadowCacheCascades = cascade_count;
+        shadowCacheValid = false;
     }
+    // The table is filtered as it is read, so only the Gaussian blur
+    // bakes the kernel width into the map
+    redrawShadowMap = shadow_cache_mode == 0 || !shadowCacheValid || DynamicCastersVisible()
+        || shadow_filter_mode != shadowMapFilterMode
+        || (shadow_filter_mode == 0 && kernel_width != shadowMapKernelWidth);
+
+    // Paraboloids drawn before a change are stale; a round robin
+    // redraws them in turn regardless, except to fill them the first time
+    if (ReflectionsChanged())
+        reflectionLayersValid = 0;
+    if (reflection_update_mode == 0 || reflectionSkyMode == -1)
+        redrawReflections = 3;
+    else if (reflection_update_mode == 1) {
+        redrawReflections = 1 << reflection_next_layer;
+        reflection_next_layer ^= 1; }
+    else
+        redrawReflections = 3 & ~reflectionLayersValid;
+    reflections_drawn = 0;
 
     ////////////////////////////////////////////////////////////////////////////////
     // Anatomy of a pass:
@@ -863,8 +1252,323 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
 
     CHECKERROR;
-    int loc, programId;
 
+    UpdateResolutionScale();
+
+    // The motion vectors and reprojections go without the jitter, which
+    // moves the render samples by under a render pixel
+    ViewProj = WorldProj*WorldView;
+    if (taa_mode == 1) {
+        taa_frame = (taa_frame + 1) % TAASamples;
+        taaJitter = glm::vec2(Halton(taa_frame + 1, 2) - 0.5f, Halton(taa_frame + 1, 3) - 0.5f);
+        WorldProj = Translate(2.0f*taaJitter.x/render_width, 2.0f*taaJitter.y/render_height, 0.0f)*WorldProj;
+    }
+
+    {
+        ProfileScope scope("Build frame graph");
+        BuildFrameGraph();
+        frameGraph.Compile();
+    }
+    frameGraph.Execute();
+    lightSystem.EndFrame();
+    ssrHistoryValid = reflection_source == 1;
+
+    // For reprojecting this frame's results next frame
+    prevViewProj = ViewProj;
+}
+
+// Gains of the resolution controller, the error band inside which it
+// leaves the scale alone, and the step the scale moves in
+static const float ResolutionKp = 0.2f;
+static const float ResolutionKi = 0.05f;
+static const float ResolutionDeadBand = 0.05f;
+static const float ResolutionStep = 0.05f;
+
+// Picks this frame's render size.  The controller's error is the
+// fraction of target_frame_ms left over (negative when over budget);
+// the integral term settles on the scale that meets the target, and
+// the proportional term answers sudden changes.  For hysteresis,
+// errors within the dead band are ignored, the scale moves in whole
+// steps, and after a move it waits until the timings (read back
+// Profiler::Latency frames late) reflect it.
+void Scene::UpdateResolutionScale()
+{
+    const double frameMs = Profiler::GpuMs("Frame graph");
+    if (dynamic_resolution_mode == 1 && frameMs > 0.0) {
+        if (resolution_hold > 0)
+            resolution_hold--;
+        else {
+            const float error = float((target_frame_ms - frameMs)/target_frame_ms);
+            if (fabs(error) > ResolutionDeadBand) {
+                resolution_integral = glm::clamp(resolution_integral + ResolutionKi*error,
+                                                 min_resolution_scale, 1.0f);
+                float scale = glm::clamp(resolution_integral + ResolutionKp*error,
+                                         min_resolution_scale, 1.0f);
+                scale = glm::clamp(ResolutionStep*int(scale/ResolutionStep + 0.5f),
+                                   min_resolution_scale, 1.0f);
+                if (scale != resolution_scale) {
+                    resolution_scale = scale;
+                    resolution_hold = Profiler::Latency + 1;
+                }
+            }
+        }
+    }
+    else
+        resolution_integral = resolution_scale;
+
+    const int w = std::max(1, int(width*resolution_scale + 0.5f));
+    const int h = std::max(1, int(height*resolution_scale + 0.5f));
+    if (w != render_width || h != render_height) {
+        // The histories were drawn at the old size
+        aoHistoryValid = false;
+        ssrHistoryValid = false;
+        render_width = w;
+        render_height = h;
+    }
+}
+
+// Declares this frame's passes, in execution order, with the textures
+// each reads and writes.  Which reads are declared depends on the menu
+// selections, so passes whose results would not be shown are culled.
+void Scene::BuildFrameGraph()
+{
+    frameGraph.Begin();
+
+    int gbuffer = frameGraph.Import("G-buffer", gbufferRenderTarget.textureID[1]);
+    int shadowMap = frameGraph.Import("Shadow map", shadowPassRenderTarget.textureID);
+    int shadowStatic = frameGraph.Import("Static shadow casters", shadowStaticTarget.textureID);
+    int reflections = frameGraph.Import("Reflection maps", reflectionRenderTarget.textureID);
+    int hdr = frameGraph.Import("HDR color", postProcessingBuffer.textureID[0]);
+    int bloom = frameGraph.Import("Bloom", postProcessingBuffer.textureID[1]);
+    int bloomUpsample = frameGraph.Import("Bloom upsample", postProcessingBuffer.textureID[2]);
+    int backBuffer = frameGraph.Import("Back buffer", 0);
+
+    rg_shadowBlur = frameGraph.Create("Shadow blur", fbo_width, fbo_height, GL_RGBA32F);
+    // AO and its blur run at full, half or quarter resolution; the
+    // reduced ones are upsampled into rg_aoBlurV
+    // Like the other targets they are allocated at the window's size,
+    // and drawn only as far as the rendered size
+    const int aoStep = 1 << ao_resolution_mode;
+    const int aoFullWidth = (width + aoStep - 1) / aoStep;
+    const int aoFullHeight = (height + aoStep - 1) / aoStep;
+    ao_width = (render_width + aoStep - 1) / aoStep;
+    ao_height = (render_height + aoStep - 1) / aoStep;
+    rg_ao = frameGraph.Create("AO", aoFullWidth, aoFullHeight, GL_R8);
+    rg_aoBlurH = frameGraph.Create("AO blur H", aoFullWidth, aoFullHeight, GL_R16F);
+    rg_aoBlurV = frameGraph.Create("AO blur V", width, height, GL_R16F);
+    rg_aoLow = ao_resolution_mode == 0 ? rg_aoBlurV
+        : frameGraph.Create("AO blur V, reduced", aoFullWidth, aoFullHeight, GL_R16F);
+
+    // The AO history lives across frames, so it is not a transient;
+    // a new size (or turning it on) starts it over
+    if (ao_temporal_mode == 1
+        && (aoHistory.fboID == 0 || aoHistory.width != aoFullWidth || aoHistory.height != aoFullHeight)) {
+        GLenum formats[2] = { GL_RGBA16F, GL_RGBA16F };
+        aoHistory.DeleteFBO();
+        aoHistory.CreateFBO(aoFullWidth, aoFullHeight, 2, formats);
+        aoHistoryValid = false;
+    }
+    if (ao_temporal_mode == 0)
+        aoHistoryValid = false;
+
+    int pass = frameGraph.AddPass("G-buffer", [this]() { GbufferPass(); });
+    frameGraph.Write(pass, gbuffer, RenderGraph::Attachment);
+
+    // Without a redraw the shadow map keeps last frame's blurred moments
+    if (redrawShadowMap) {
+        if (shadow_cache_mode == 1 && !shadowCacheValid) {
+            pass = frameGraph.AddPass("Static shadow casters", [this]() { StaticShadowPass(); });
+            frameGraph.Write(pass, shadowStatic, RenderGraph::Attachment);
+        }
+
+        pass = frameGraph.AddPass("Shadow", [this]() { ShadowPass(); });
+        if (shadow_cache_mode == 1)
+            frameGraph.Read(pass, shadowStatic, RenderGraph::Attachment);
+        frameGraph.Write(pass, shadowMap, RenderGraph::Attachment);
+
+        // The cascades take turns with the one intermediate
+        for (int i = 0; i < cascade_count; i++) {
+            if (shadow_filter_mode == 1) {
+                pass = frameGraph.AddPass("Shadow SAT rows", [this, i]() { ShadowSATRowsPass(i); });
+                frameGraph.Read(pass, shadowMap, RenderGraph::Image);
+                frameGraph.Write(pass, rg_shadowBlur, RenderGraph::Image);
+
+                pass = frameGraph.AddPass("Shadow SAT columns", [this, i]() { ShadowSATColumnsPass(i); });
+                frameGraph.Read(pass, rg_shadowBlur, RenderGraph::Image);
+                frameGraph.Write(pass, shadowMap, RenderGraph::Image);
+                continue;
+            }
+
+            pass = frameGraph.AddPass("Shadow blur H", [this, i]() { ShadowBlurHPass(i); });
+            frameGraph.Read(pass, shadowMap, RenderGraph::Image);
+            frameGraph.Write(pass, rg_shadowBlur, RenderGraph::Image);
+
+            pass = frameGraph.AddPass("Shadow blur V", [this, i]() { ShadowBlurVPass(i); });
+            frameGraph.Read(pass, rg_shadowBlur, RenderGraph::Image);
+            frameGraph.Write(pass, shadowMap, RenderGraph::Image);
+        }
+    }
+
+    pass = frameGraph.AddPass("AO", [this]() { AOPass(); });
+    frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+    frameGraph.Write(pass, rg_ao, RenderGraph::Image);
+
+    if (ao_temporal_mode == 1) {
+        ao_history_index = 1 - ao_history_index;
+        int history = frameGraph.Import("AO history", aoHistory.textureID[ao_history_index]);
+        int lastHistory = frameGraph.Import("AO history, last frame", aoHistory.textureID[1 - ao_history_index]);
+        pass = frameGraph.AddPass("AO temporal", [this]() { AOTemporalPass(); });
+        frameGraph.Read(pass, rg_ao, RenderGraph::Image);
+        frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+        frameGraph.Read(pass, lastHistory, RenderGraph::Sampled);
+        frameGraph.Write(pass, rg_ao, RenderGraph::Image);
+        frameGraph.Write(pass, history, RenderGraph::Image);
+    }
+
+    pass = frameGraph.AddPass("AO blur H", [this]() { AOBlurHPass(); });
+    frameGraph.Read(pass, rg_ao, RenderGraph::Image);
+    frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+    frameGraph.Write(pass, rg_aoBlurH, RenderGraph::Image);
+
+    pass = frameGraph.AddPass("AO blur V", [this]() { AOBlurVPass(); });
+    frameGraph.Read(pass, rg_aoBlurH, RenderGraph::Image);
+    frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+    frameGraph.Write(pass, rg_aoLow, RenderGraph::Image);
+
+    if (ao_resolution_mode != 0) {
+        pass = frameGraph.AddPass("AO upsample", [this]() { AOUpsamplePass(); });
+        frameGraph.Read(pass, rg_aoLow, RenderGraph::Image);
+        frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+        frameGraph.Write(pass, rg_aoBlurV, RenderGraph::Image);
+    }
+
+    // Screen space reflections march the depth pyramid, and take their
+    // color from last frame's lit image, still in the HDR target until
+    // the lighting pass overwrites it
+    int hiz = -1, reflectionHistory = -1;
+    if (reflection_source == 1) {
+        hiz_levels = 1;
+        while (hiz_levels < 7 && (std::max(width, height) >> hiz_levels) > 0)
+            hiz_levels++;
+        rg_hiz = hiz = frameGraph.Create("Hi-Z", width, height, GL_R32F, hiz_levels);
+        pass = frameGraph.AddPass("Hi-Z", [this]() { HiZPass(); });
+        frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+        frameGraph.Write(pass, hiz, RenderGraph::Image);
+
+        if (ssrHistory.fboID == 0 || ssrHistory.width != width || ssrHistory.height != height) {
+            GLenum formats[1] = { GL_R11F_G11F_B10F };
+            ssrHistory.DeleteFBO();
+            ssrHistory.CreateFBO(width, height, 1, formats);
+            ssrHistoryValid = false;
+        }
+        reflectionHistory = frameGraph.Import("SSR history", ssrHistory.textureID[0]);
+        pass = frameGraph.AddPass("Reflection history", [this]() { ReflectionHistoryPass(); });
+        frameGraph.Read(pass, hdr, RenderGraph::Attachment);
+        frameGraph.Write(pass, reflectionHistory, RenderGraph::Attachment);
+    }
+
+    // Only the paraboloids due this frame are drawn; the others keep
+    // their last contents
+    if (redrawReflections == 3 && reflection_layered_mode == 1) {
+        pass = frameGraph.AddPass("Reflections", [this]() { ReflectionPass(0); });
+        frameGraph.Read(pass, shadowMap, RenderGraph::Sampled);
+        frameGraph.Write(pass, reflections, RenderGraph::Attachment);
+    }
+    else {
+        // Each keeps the other layer, so an earlier pass is still needed
+        if (redrawReflections & 1) {
+            pass = frameGraph.AddPass("Upper reflection", [this]() { ReflectionPass(1); });
+            frameGraph.Read(pass, shadowMap, RenderGraph::Sampled);
+            frameGraph.Read(pass, reflections, RenderGraph::Attachment);
+            frameGraph.Write(pass, reflections, RenderGraph::Attachment);
+        }
+        if (redrawReflections & 2) {
+            pass = frameGraph.AddPass("Lower reflection", [this]() { ReflectionPass(-1); });
+            frameGraph.Read(pass, shadowMap, RenderGraph::Sampled);
+            frameGraph.Read(pass, reflections, RenderGraph::Attachment);
+            frameGraph.Write(pass, reflections, RenderGraph::Attachment);
+        }
+    }
+
+    pass = frameGraph.AddPass("Lighting", [this]() { LightingPass(); });
+    frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+    if (lightingMode != 3 || draw_fbo <= 3)
+        frameGraph.Read(pass, shadowMap, RenderGraph::Sampled);
+    if ((reflectionMode != 3 && reflection_source == 0) || draw_fbo == 4 || draw_fbo == 5) {
+        frameGraph.Read(pass, reflections, RenderGraph::Sampled);
+    }
+    if (reflection_source == 1) {
+        frameGraph.Read(pass, hiz, RenderGraph::Sampled);
+        frameGraph.Read(pass, reflectionHistory, RenderGraph::Sampled);
+    }
+    if (draw_fbo == 10)
+        frameGraph.Read(pass, rg_ao, RenderGraph::Sampled);
+    if (draw_fbo == 11)
+        frameGraph.Read(pass, rg_aoBlurH, RenderGraph::Sampled);
+    if (ao_enabled == 1 || draw_fbo == 12)
+        frameGraph.Read(pass, rg_aoBlurV, RenderGraph::Sampled);
+    frameGraph.Write(pass, hdr, RenderGraph::Attachment);
+    frameGraph.Write(pass, bloom, RenderGraph::Attachment);
+
+    // TAA's output and history live across frames at the window's size
+    int taaOutput = -1;
+    if (taa_mode == 1) {
+        if (taaHistory.fboID == 0 || taaHistory.width != width || taaHistory.height != height) {
+            GLenum formats[2] = { GL_RGBA16F, GL_RGBA16F };
+            taaHistory.DeleteFBO();
+            taaHistory.CreateFBO(width, height, 2, formats);
+            taaHistoryValid = false;
+        }
+        taa_history_index = 1 - taa_history_index;
+        taaOutput = frameGraph.Import("TAA output", taaHistory.textureID[taa_history_index]);
+        int lastOutput = frameGraph.Import("TAA output, last frame", taaHistory.textureID[1 - taa_history_index]);
+        pass = frameGraph.AddPass("TAA", [this]() { TAAPass(); });
+        frameGraph.Read(pass, hdr, RenderGraph::Sampled);
+        frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+        frameGraph.Read(pass, lastOutput, RenderGraph::Sampled);
+        frameGraph.Write(pass, taaOutput, RenderGraph::Image);
+    }
+    else
+        taaHistoryValid = false;
+
+    if (bloom_mode == 1) {
+        pass = frameGraph.AddPass("Bloom blur", [this]() { BloomBlurPass(); });
+        frameGraph.Read(pass, bloom, RenderGraph::Image);
+        frameGraph.Write(pass, bloomUpsample, RenderGraph::Image);
+        frameGraph.Write(pass, bloom, RenderGraph::Image);
+    }
+    else {
+        pass = frameGraph.AddPass("Bloom down/upsample", [this]() { BloomMipChainPass(); });
+        frameGraph.Read(pass, bloom, RenderGraph::Sampled);
+        frameGraph.Write(pass, bloom, RenderGraph::Image);
+        frameGraph.Write(pass, bloomUpsample, RenderGraph::Image);
+    }
+
+    pass = frameGraph.AddPass("Post processing", [this]() { PostProcessingPass(); });
+    frameGraph.Read(pass, taa_mode == 1 ? taaOutput : hdr, RenderGraph::Sampled);
+    if ((bloom_enabled == 1 && draw_fbo == 15) || draw_fbo == 13 || draw_fbo == 14) {
+        frameGraph.Read(pass, bloom, RenderGraph::Sampled);
+        frameGraph.Read(pass, bloomUpsample, RenderGraph::Sampled);
+    }
+    frameGraph.Write(pass, backBuffer, RenderGraph::Attachment);
+
+    if (local_lights_on == 1) {
+        if (local_lights_mode == 1)
+            pass = frameGraph.AddPass("Clustered lights", [this]() { ClusteredLightsPass(); });
+        else
+            pass = frameGraph.AddPass("Local lights", [this]() { LocalLightsPass(); });
+        frameGraph.Read(pass, gbuffer, RenderGraph::Sampled);
+        frameGraph.Read(pass, backBuffer, RenderGraph::Attachment);
+        frameGraph.Write(pass, backBuffer, RenderGraph::Attachment);
+    }
+
+    frameGraph.Output(backBuffer);
+}
+
+
+void Scene::GbufferPass()
+{
+    int loc, programId;
     ////////////////////////////////////////////////////////////////////////////////
     // Deferred Shading pass
     ////////////////////////////////////////////////////////////////////////////////
@@ -874,14 +1578,19 @@ void Scene::DrawScene()
     programId = gbufferProgram->programId;
 
     // Set the viewport, and clear the screen
-    glViewport(0, 0, width, height);
+    glViewport(0, 0, render_width, render_height);
     gbufferRenderTarget.Bind();
     glClearColor(0.5, 0.5, 0.5, 1.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     CHECKERROR;
 
-    GLenum bufs[4] = { GL_COLOR_ATTACHMENT0_EXT , GL_COLOR_ATTACHMENT1_EXT , GL_COLOR_ATTACHMENT2_EXT , GL_COLOR_ATTACHMENT3_EXT };
-    glDrawBuffers(4, bufs);
+    GLenum bufs[5] = { GL_COLOR_ATTACHMENT0_EXT , GL_COLOR_ATTACHMENT1_EXT , GL_COLOR_ATTACHMENT2_EXT , GL_COLOR_ATTACHMENT3_EXT,
+                       GL_COLOR_ATTACHMENT4_EXT };
+    if (gbuffer_mode == 1) {
+        bufs[0] = GL_NONE;                  // No position attachment
+        glEnable(GL_FRAMEBUFFER_SRGB);      // Encodes the diffuse attachment
+    }
+    glDrawBuffers(5, bufs);
 
     //Bind the skydome texture
     switch (sky_dome_mode)
@@ -919,6 +1628,10 @@ void Scene::DrawScene()
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(WorldView));
     loc = glGetUniformLocation(programId, "WorldInverse");
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(WorldInverse));
+    loc = glGetUniformLocation(programId, "ViewProj");
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(ViewProj));
+    loc = glGetUniformLocation(programId, "PrevViewProj");
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(prevViewProj));
     loc = glGetUniformLocation(programId, "lightPos");
     glUniform3fv(loc, 1, &(lightPos[0]));
     loc = glGetUniformLocation(programId, "textureMode");
@@ -926,8 +1639,12 @@ void Scene::DrawScene()
     CHECKERROR;
 
     // Draw all objects (This recursively traverses the object hierarchy.)
-    objectRoot->Draw(gbufferProgram, Identity);
+    {
+        TRACE_SCOPE("G-buffer traversal");
+        objectRoot->Draw(gbufferProgram, Identity);
+    }
     CHECKERROR;
+    glDisable(GL_FRAMEBUFFER_SRGB);
     gbufferRenderTarget.Unbind();
     CHECKERROR;
     // Turn off the shader
@@ -935,12 +1652,19 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
     // End of G buffer pass
     ////////////////////////////////////////////////////////////////////////////////
+}
 
+// Draws the shadow casters selected by filter into one cascade's layer
+// of a moment map
+void Scene::DrawShadowCasters(LayeredFBO& target, int cascade, ShaderProgram::DrawFilter filter, bool clear)
+{
+    int loc, programId;
     ////////////////////////////////////////////////////////////////////////////////
     // Shadow pass
     ////////////////////////////////////////////////////////////////////////////////
     glEnable(GL_CULL_FACE);
     glCullFace(GL_FRONT);
+    glEnable(GL_DEPTH_CLAMP);
 
     // Choose the shadow shader
     shadowProgram->Use();
@@ -948,9 +1672,11 @@ void Scene::DrawScene()
 
     // Set the viewport, and clear the screen
     glViewport(0, 0, fbo_width, fbo_height);
-    shadowPassRenderTarget.Bind();
-    glClearColor(0.5, 0.5, 0.5, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    target.BindLayer(cascade);
+    if (clear) {
+        glClearColor(0.5, 0.5, 0.5, 1.0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
     CHECKERROR;
 
     // @@ The scene specific parameters (uniform variables) used by
@@ -958,32 +1684,92 @@ void Scene::DrawScene()
     // the Draw procedure in object.cpp
 
     loc = glGetUniformLocation(programId, "WorldProj");
-    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(LightProj));
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(CascadeProj[cascade]));
     loc = glGetUniformLocation(programId, "LightView");
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(LightView));
     loc = glGetUniformLocation(programId, "debugMode");
     glUniform1i(loc, debug_mode);
-
-    float min_depth = lightDist - 25;
-    float max_depth = lightDist + 25;
-    loc = glGetUniformLocation(programId, "min_depth");
-    glUniform1f(loc, min_depth);
-    loc = glGetUniformLocation(programId, "max_depth");
-    glUniform1f(loc, max_depth);
     CHECKERROR;
 
     // Draw all objects (This recursively traverses the object hierarchy.)
-    objectRoot->Draw(shadowProgram, Identity);
+    shadowProgram->drawFilter = filter;
+    {
+        TRACE_SCOPE("Shadow traversal");
+        objectRoot->Draw(shadowProgram, Identity);
+    }
+    shadowProgram->drawFilter = ShaderProgram::DrawAll;
     CHECKERROR;
-    shadowPassRenderTarget.Unbind();
+    target.Unbind();
     CHECKERROR;
     // Turn off the shader
     shadowProgram->Unuse();
+    glDisable(GL_DEPTH_CLAMP);
     glDisable(GL_CULL_FACE);
     ////////////////////////////////////////////////////////////////////////////////
     // End of Shadow pass
     ////////////////////////////////////////////////////////////////////////////////
+}
+
+// Draws the static casters into the cache
+void Scene::StaticShadowPass()
+{
+    for (int i = 0; i < cascade_count; i++)
+        DrawShadowCasters(shadowStaticTarget, i, ShaderProgram::DrawStatic, true);
+    shadowCacheValid = true;
+}
 
+void Scene::ShadowPass()
+{
+    for (int i = 0; i < cascade_count; i++) {
+        if (shadow_cache_mode == 1) {
+            // Start from the cached static casters, both moments and
+            // depth, and draw the dynamic ones over them
+            shadowStaticTarget.BindLayer(i);
+            shadowPassRenderTarget.BindLayer(i);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, shadowStaticTarget.fboID);
+            glBlitFramebuffer(0, 0, fbo_width, fbo_height, 0, 0, fbo_width, fbo_height,
+                              GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            CHECKERROR;
+            DrawShadowCasters(shadowPassRenderTarget, i, ShaderProgram::DrawDynamic, false);
+        }
+        else
+            DrawShadowCasters(shadowPassRenderTarget, i, ShaderProgram::DrawAll, true);
+    }
+    shadowMapKernelWidth = kernel_width;
+    shadowMapFilterMode = shadow_filter_mode;
+}
+
+// True if any continuously animating object is being drawn
+bool Scene::DynamicCastersVisible()
+{
+    for (std::vector<Object*>::iterator m=animated.begin();  m<animated.end();  m++)
+        if ((*m)->drawMe)
+            return true;
+    return false;
+}
+
+// Whether the paraboloids would come out differently than when last
+// drawn: a new sky, light or shading, or a dynamic object whose box
+// comes within reflection_range of reflectionEye
+bool Scene::ReflectionsChanged()
+{
+    if (sky_dome_mode != reflectionSkyMode || lightingMode != reflectionLightingMode
+        || texture_mode != reflectionTextureMode || lightPos != reflectionLightPos)
+        return true;
+
+    glm::vec3 minP(FLT_MAX), maxP(-FLT_MAX);
+    objectRoot->DynamicBounds(Identity, minP, maxP);
+    if (minP.x > maxP.x)
+        return false;
+    glm::vec3 nearest = glm::max(minP, glm::min(reflectionEye, maxP));
+    return glm::length(nearest - reflectionEye) <= reflection_range;
+}
+
+void Scene::ShadowBlurHPass(int cascade)
+{
+    int loc;
+    GLuint imageUnit;
     ////////////////////////////////////////////////////////////////////////////////
     // Shadow pass blur
     ////////////////////////////////////////////////////////////////////////////////
@@ -1001,23 +1787,27 @@ void Scene::DrawScene()
     glUniform1i(loc, kernel_width);
 
 
-    GLuint imageUnit = 0 ; // Perhaps 0 for input image and 1 for output image
+    imageUnit = 0; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(shadowBlur_H_Program->programId, "src");
-    glBindImageTexture(imageUnit, shadowPassRenderTarget.textureID[0],
-                       0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, shadowPassRenderTarget.textureID,
+                       0, GL_FALSE, cascade, GL_READ_ONLY, GL_RGBA32F);
     glUniform1i(loc, imageUnit);
 
 
     imageUnit = 1; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(shadowBlur_H_Program->programId, "dst");
-    glBindImageTexture(imageUnit, shadowBlurOutput.textureID[0],
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_shadowBlur),
                        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
     glUniform1i(loc, imageUnit);
-    // Tiles WxH image with groups sized 128x1
-    glDispatchCompute(glm::ceil(fbo_width / 128.0f), fbo_height, 1);
+    shadowBlurHKernel->Dispatch(fbo_width, fbo_height);
 
     shadowBlur_H_Program->Unuse();
+}
 
+void Scene::ShadowBlurVPass(int cascade)
+{
+    int loc;
+    GLuint imageUnit;
     shadowBlur_V_Program->Use();
 
     loc = glGetUniformLocation(shadowBlur_V_Program->programId, "width");
@@ -1025,26 +1815,71 @@ void Scene::DrawScene()
 
     imageUnit = 0; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(shadowBlur_V_Program->programId, "src");
-    glBindImageTexture(imageUnit, shadowBlurOutput.textureID[0],
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_shadowBlur),
         0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
     glUniform1i(loc, imageUnit);
 
 
     imageUnit = 1; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(shadowBlur_V_Program->programId, "dst");
-    glBindImageTexture(imageUnit, shadowPassRenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, shadowPassRenderTarget.textureID,
+        0, GL_FALSE, cascade, GL_WRITE_ONLY, GL_RGBA32F);
     glUniform1i(loc, imageUnit);
-    // Set all uniform and image variables
-    // Tiles WxH image with groups sized 128x1
-    glDispatchCompute(fbo_width, glm::ceil(fbo_height / 128.0f), 1);
+    shadowBlurVKernel->Dispatch(fbo_width, fbo_height);
 
     shadowBlur_V_Program->Unuse();
 
     ////////////////////////////////////////////////////////////////////////////////
     // End of Shadow pass blur
     ////////////////////////////////////////////////////////////////////////////////
+}
+
+// Prefix sums along the rows of one cascade's moments, less 0.5 to keep
+// the table's sums small
+void Scene::ShadowSATRowsPass(int cascade)
+{
+    satRows_Program->Use();
+    int loc = glGetUniformLocation(satRows_Program->programId, "center");
+    glUniform1f(loc, 0.5f);
+
+    loc = glGetUniformLocation(satRows_Program->programId, "src");
+    glBindImageTexture(0, shadowPassRenderTarget.textureID,
+                       0, GL_FALSE, cascade, GL_READ_ONLY, GL_RGBA32F);
+    glUniform1i(loc, 0);
+    loc = glGetUniformLocation(satRows_Program->programId, "dst");
+    glBindImageTexture(1, frameGraph.TextureId(rg_shadowBlur),
+                       0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glUniform1i(loc, 1);
+    // One thread group per row
+    satRowsKernel->DispatchGroups(fbo_height, 1);
+    satRows_Program->Unuse();
+}
 
+// Prefix sums down the columns, completing the summed-area table in
+// the cascade's layer
+void Scene::ShadowSATColumnsPass(int cascade)
+{
+    satColumns_Program->Use();
+    int loc = glGetUniformLocation(satColumns_Program->programId, "center");
+    glUniform1f(loc, 0.0f);
+
+    loc = glGetUniformLocation(satColumns_Program->programId, "src");
+    glBindImageTexture(0, frameGraph.TextureId(rg_shadowBlur),
+                       0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glUniform1i(loc, 0);
+    loc = glGetUniformLocation(satColumns_Program->programId, "dst");
+    glBindImageTexture(1, shadowPassRenderTarget.textureID,
+                       0, GL_FALSE, cascade, GL_WRITE_ONLY, GL_RGBA32F);
+    glUniform1i(loc, 1);
+    // One thread group per column
+    satColumnsKernel->DispatchGroups(fbo_width, 1);
+    satColumns_Program->Unuse();
+}
+
+void Scene::AOPass()
+{
+    int loc;
+    GLuint imageUnit;
     ////////////////////////////////////////////////////////////////////////////////
     // Ambient Occlusion pass 
     ////////////////////////////////////////////////////////////////////////////////
@@ -1053,14 +1888,30 @@ void Scene::DrawScene()
 
 
     loc = glGetUniformLocation(AOProgram->programId, "width");
-    glUniform1i(loc, width);
+    glUniform1i(loc, render_width);
 
     loc = glGetUniformLocation(AOProgram->programId, "height");
-    glUniform1i(loc, height);
+    glUniform1i(loc, render_height);
+
+    loc = glGetUniformLocation(AOProgram->programId, "aoStep");
+    glUniform1i(loc, 1 << ao_resolution_mode);
 
     loc = glGetUniformLocation(AOProgram->programId, "ao_sample_count");
     glUniform1i(loc, ao_sample_count);
 
+    // With temporal accumulation each frame turns the spiral by the
+    // golden angle and slides it by the golden ratio's fraction of a step
+    float rotation = 0.0f, offset = 0.5f;
+    if (ao_temporal_mode == 1) {
+        ao_frame++;
+        rotation = 2.399963f*(ao_frame % 1000);
+        offset = glm::fract(0.5f + 0.618034f*(ao_frame % 1000));
+    }
+    loc = glGetUniformLocation(AOProgram->programId, "sampleRotation");
+    glUniform1f(loc, rotation);
+    loc = glGetUniformLocation(AOProgram->programId, "sampleOffset");
+    glUniform1f(loc, offset);
+
     loc = glGetUniformLocation(AOProgram->programId, "range_of_influence");
     glUniform1f(loc, ao_range);
 
@@ -1070,34 +1921,28 @@ void Scene::DrawScene()
     loc = glGetUniformLocation(AOProgram->programId, "contrast");
     glUniform1f(loc, ao_contrast);
 
-    imageUnit = 0; // Perhaps 0 for input image and 1 for output image
-    loc = glGetUniformLocation(AOProgram->programId, "gBufferWorldPos");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
-
-    imageUnit = 1; 
-    loc = glGetUniformLocation(AOProgram->programId, "gBufferNormalVec");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[1],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
+    BindGbuffer(AOProgram->programId);
 
 
     imageUnit = 2; 
     loc = glGetUniformLocation(AOProgram->programId, "dst");
-    glBindImageTexture(imageUnit, AORenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_ao),
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8);
     glUniform1i(loc, imageUnit);
 
-    // Tiles WxH image with groups sized 128x1
-    glDispatchCompute(width, height, 1);
+    AOKernel->Dispatch(ao_width, ao_height);
 
     AOProgram->Unuse();
 
     ////////////////////////////////////////////////////////////////////////////////
     // End of Ambient Occlusion pass 
     ////////////////////////////////////////////////////////////////////////////////
+}
 
+void Scene::AOBlurHPass()
+{
+    int loc;
+    GLuint imageUnit;
     ////////////////////////////////////////////////////////////////////////////////
     // Bilinear Filter for AO
     ////////////////////////////////////////////////////////////////////////////////
@@ -1114,81 +1959,169 @@ void Scene::DrawScene()
     loc = glGetUniformLocation(bilinear_H_Program->programId, "width");
     glUniform1i(loc, bilinear_kernel_width);
 
+    loc = glGetUniformLocation(bilinear_H_Program->programId, "aoStep");
+    glUniform1i(loc, 1 << ao_resolution_mode);
+
 
     imageUnit = 0; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(bilinear_H_Program->programId, "src");
-    glBindImageTexture(imageUnit, AORenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_ao),
+        0, GL_FALSE, 0, GL_READ_ONLY, GL_R8);
     glUniform1i(loc, imageUnit);
 
-    imageUnit = 1; // Perhaps 0 for input image and 1 for output image
-    loc = glGetUniformLocation(bilinear_H_Program->programId, "gBufferWorldPos");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
-
-    imageUnit = 2;
-    loc = glGetUniformLocation(bilinear_H_Program->programId, "gBufferNormalVec");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[1],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
+    BindGbuffer(bilinear_H_Program->programId);
 
     imageUnit = 3; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(bilinear_H_Program->programId, "dst");
-    glBindImageTexture(imageUnit, bilinearFilterOutput.textureID[0],
-        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_aoBlurH),
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16F);
     glUniform1i(loc, imageUnit);
-    // Tiles WxH image with groups sized 128x1
-    glDispatchCompute(glm::ceil(width / 128.0f), height, 1);
+    AOBlurHKernel->Dispatch(ao_width, ao_height);
 
     bilinear_H_Program->Unuse();
+}
 
+void Scene::AOBlurVPass()
+{
+    int loc;
+    GLuint imageUnit;
     bilinear_V_Program->Use();
 
     loc = glGetUniformLocation(bilinear_V_Program->programId, "width");
     glUniform1i(loc, bilinear_kernel_width);
 
+    loc = glGetUniformLocation(bilinear_V_Program->programId, "aoStep");
+    glUniform1i(loc, 1 << ao_resolution_mode);
+
     imageUnit = 0; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(bilinear_V_Program->programId, "src");
-    glBindImageTexture(imageUnit, bilinearFilterOutput.textureID[0],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_aoBlurH),
+        0, GL_FALSE, 0, GL_READ_ONLY, GL_R16F);
     glUniform1i(loc, imageUnit);
 
-    imageUnit = 1; // Perhaps 0 for input image and 1 for output image
-    loc = glGetUniformLocation(bilinear_V_Program->programId, "gBufferWorldPos");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[0],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
-
-    imageUnit = 2;
-    loc = glGetUniformLocation(bilinear_V_Program->programId, "gBufferNormalVec");
-    glBindImageTexture(imageUnit, gbufferRenderTarget.textureID[1],
-        0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glUniform1i(loc, imageUnit);
+    BindGbuffer(bilinear_V_Program->programId);
 
     imageUnit = 3; // Perhaps 0 for input image and 1 for output image
     loc = glGetUniformLocation(bilinear_V_Program->programId, "dst");
-    glBindImageTexture(imageUnit, bilinearFilterOutput_2.textureID[0],
-        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(imageUnit, frameGraph.TextureId(rg_aoLow),
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16F);
     glUniform1i(loc, imageUnit);
-    // Set all uniform and image variables
-    // Tiles WxH image with groups sized 128x1
-    glDispatchCompute(width, glm::ceil(height / 128.0f), 1);
+    AOBlurVKernel->Dispatch(ao_width, ao_height);
 
     bilinear_V_Program->Unuse();
 
     ////////////////////////////////////////////////////////////////////////////////
     // End of Bilinear Filter for AO
     ////////////////////////////////////////////////////////////////////////////////
+}
+
+// Blends the reprojected history into this frame's AO, in place, and
+// writes the history for next frame
+void Scene::AOTemporalPass()
+{
+    AOTemporalProgram->Use();
+    int programId = AOTemporalProgram->programId;
+
+    int loc = glGetUniformLocation(programId, "aoStep");
+    glUniform1i(loc, 1 << ao_resolution_mode);
+    loc = glGetUniformLocation(programId, "historyValid");
+    glUniform1i(loc, aoHistoryValid ? 1 : 0);
+    loc = glGetUniformLocation(programId, "blend");
+    glUniform1f(loc, ao_temporal_blend);
+    loc = glGetUniformLocation(programId, "PrevViewProj");
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(prevViewProj));
+
+    BindGbuffer(programId);
+    aoHistory.BindTexture(programId, 22, "history", 1 - ao_history_index);
+
+    loc = glGetUniformLocation(programId, "ao");
+    glBindImageTexture(2, frameGraph.TextureId(rg_ao),
+        0, GL_FALSE, 0, GL_READ_WRITE, GL_R8);
+    glUniform1i(loc, 2);
+    loc = glGetUniformLocation(programId, "historyOut");
+    glBindImageTexture(3, aoHistory.textureID[ao_history_index],
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    glUniform1i(loc, 3);
+    AOTemporalKernel->Dispatch(ao_width, ao_height);
+
+    AOTemporalProgram->Unuse();
+    aoHistoryValid = true;
+}
+
+// Brings the blurred half or quarter resolution AO up to full size
+void Scene::AOUpsamplePass()
+{
+    AOUpsampleProgram->Use();
+
+    int loc = glGetUniformLocation(AOUpsampleProgram->programId, "aoStep");
+    glUniform1i(loc, 1 << ao_resolution_mode);
+
+    BindGbuffer(AOUpsampleProgram->programId);
+
+    loc = glGetUniformLocation(AOUpsampleProgram->programId, "src");
+    glBindImageTexture(0, frameGraph.TextureId(rg_aoLow),
+        0, GL_FALSE, 0, GL_READ_ONLY, GL_R16F);
+    glUniform1i(loc, 0);
+
+    loc = glGetUniformLocation(AOUpsampleProgram->programId, "dst");
+    glBindImageTexture(3, frameGraph.TextureId(rg_aoBlurV),
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R16F);
+    glUniform1i(loc, 3);
+    AOUpsampleKernel->Dispatch(render_width, render_height);
+
+    AOUpsampleProgram->Unuse();
+}
+
+// Builds the depth pyramid a level at a time, each level reading the
+// one below it
+void Scene::HiZPass()
+{
+    hizProgram->Use();
+    BindGbuffer(hizProgram->programId);
+    const GLuint hizId = frameGraph.TextureId(rg_hiz);
 
+    int loc;
+    for (int level = 0; level < hiz_levels; level++) {
+        loc = glGetUniformLocation(hizProgram->programId, "level");
+        glUniform1i(loc, level);
+        loc = glGetUniformLocation(hizProgram->programId, "src");
+        glBindImageTexture(0, hizId, std::max(level - 1, 0), GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glUniform1i(loc, 0);
+        loc = glGetUniformLocation(hizProgram->programId, "dst");
+        glBindImageTexture(1, hizId, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glUniform1i(loc, 1);
+        hizKernel->Dispatch(std::max(render_width >> level, 1), std::max(render_height >> level, 1));
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    CHECKERROR;
+
+    hizProgram->Unuse();
+}
+
+// Keeps last frame's lit image for the screen space reflections
+void Scene::ReflectionHistoryPass()
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, postProcessingBuffer.fboID);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ssrHistory.fboID);
+    glBlitFramebuffer(0, 0, render_width, render_height, 0, 0, render_width, render_height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    CHECKERROR;
+}
+
+void Scene::ReflectionPass(int hemisphereSign)
+{
+    int loc, programId;
 	////////////////////////////////////////////////////////////////////////////////
-	// Reflection pass 1
+	// Reflection pass (one paraboloid per call, or with hemisphereSign 0
+	// both at once through the layered program)
 	////////////////////////////////////////////////////////////////////////////////
-	int hemisphereSign = 1;
+	ShaderProgram* program = hemisphereSign == 0 ? reflectionLayeredProgram : reflectionProgram;
 
 	// Choose the reflection shader
-	reflectionProgram->Use();
-	programId = reflectionProgram->programId;
+	program->Use();
+	programId = program->programId;
 
     //Bind the skydome texture
     switch (sky_dome_mode)
@@ -1207,22 +2140,23 @@ void Scene::DrawScene()
         p_barca_sky->Bind(13, programId, "SkydomeTex");
         sky_dome_width = p_barca_sky->width;
         sky_dome_height = p_barca_sky->height;
-        p_barca_irr_map->Bind(14, programId, "IrrMapTex");
         break;
     case 3:
         p_mon_valley_sky->Bind(13, programId, "SkydomeTex");
         sky_dome_width = p_mon_valley_sky->width;
         sky_dome_height = p_mon_valley_sky->height;
-        p_mon_valley_irr_map->Bind(14, programId, "IrrMapTex");
         break;
     }
     CHECKERROR;
 
-    shadowPassRenderTarget.BindTexture(reflectionProgram->programId, 15, "shadowMap");
+    BindShadowCascades(programId, 15);
     CHECKERROR;
-	// Set the viewport, and clear the screen
+	// Set the viewport, and clear the screen (every layer when layered)
 	glViewport(0, 0, fbo_width, fbo_height);
-	upperReflectionRenderTarget.Bind();
+	if (hemisphereSign == 0)
+		reflectionRenderTarget.BindLayered();
+	else
+		reflectionRenderTarget.BindLayer(hemisphereSign > 0 ? 0 : 1);
 	glClearColor(0.5, 0.5, 0.5, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -1237,8 +2171,6 @@ void Scene::DrawScene()
 	glUniform1i(loc, hemisphereSign);
 	loc = glGetUniformLocation(programId, "LightView");
 	glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(LightView));
-	loc = glGetUniformLocation(programId, "ShadowMatrix");
-	glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(ShadowMatrix));
 	loc = glGetUniformLocation(programId, "lightPos");
 	glUniform3fv(loc, 1, &(lightPos[0]));
 	loc = glGetUniformLocation(programId, "light");
@@ -1258,43 +2190,32 @@ void Scene::DrawScene()
 	CHECKERROR;
 
 	// Draw all objects (This recursively traverses the object hierarchy.)
-	objectRoot->Draw(reflectionProgram, Identity);
-	CHECKERROR;
-	upperReflectionRenderTarget.Unbind();
-	// Turn off the shader
-
-	////////////////////////////////////////////////////////////////////////////////
-	// End of reflection pass 1
-	////////////////////////////////////////////////////////////////////////////////
-
-	////////////////////////////////////////////////////////////////////////////////
-	// Reflection pass 2
-	////////////////////////////////////////////////////////////////////////////////
-	hemisphereSign = -1;
-
-	// Set the viewport, and clear the screen
-	glViewport(0, 0, fbo_width, fbo_height);
-	lowerReflectionRenderTarget.Bind();
-	glClearColor(0.5, 0.5, 0.5, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	loc = glGetUniformLocation(programId, "HemisphereSign");
-	glUniform1i(loc, hemisphereSign);
+	{
+		TRACE_SCOPE("Reflection traversal");
+		objectRoot->Draw(program, Identity);
+	}
 	CHECKERROR;
-
-	// Draw all objects (This recursively traverses the object hierarchy.)
-	objectRoot->Draw(reflectionProgram, Identity);
-	CHECKERROR;
-	lowerReflectionRenderTarget.Unbind();
+	reflectionRenderTarget.Unbind();
     p_sky_dome->Unbind();
-    p_barca_irr_map->Unbind();
     CHECKERROR;
+
+    const int drawn = hemisphereSign == 0 ? 3 : hemisphereSign > 0 ? 1 : 2;
+    reflectionLayersValid |= drawn;
+    reflections_drawn += drawn == 3 ? 2 : 1;
+    reflectionSkyMode = sky_dome_mode;
+    reflectionLightingMode = lightingMode;
+    reflectionTextureMode = texture_mode;
+    reflectionLightPos = lightPos;
 	// Turn off the shader
-	reflectionProgram->Unuse();
+	program->Unuse();
 	////////////////////////////////////////////////////////////////////////////////
-	// End of Reflection pass 2
+	// End of Reflection pass
 	////////////////////////////////////////////////////////////////////////////////
+}
 
+void Scene::LightingPass()
+{
+    int loc, programId;
 	////////////////////////////////////////////////////////////////////////////////
 	// Lighting pass
 	////////////////////////////////////////////////////////////////////////////////
@@ -1306,63 +2227,50 @@ void Scene::DrawScene()
 
     postProcessingBuffer.Bind();
 
-    //Bind the skydome texture
-    switch (sky_dome_mode)
-    {
-    case 0:
-        p_sky_dome->Bind(13, programId, "SkydomeTex");
-        sky_dome_width = p_sky_dome->width;
-        sky_dome_height = p_sky_dome->height;
-        break;
-    case 1:
-        p_sky_dome_cage->Bind(13, programId, "SkydomeTex");
-        sky_dome_width = p_sky_dome_cage->width;
-        sky_dome_height = p_sky_dome_cage->height;
-        break;
-    case 2:
-        p_barca_sky->Bind(13, programId, "SkydomeTex");
-        sky_dome_width = p_barca_sky->width;
-        sky_dome_height = p_barca_sky->height;
-        p_barca_irr_map->Bind(14, programId, "IrrMapTex");
-        break;
-    case 3:
-        p_mon_valley_sky->Bind(13, programId, "SkydomeTex");
-        sky_dome_width = p_mon_valley_sky->width;
-        sky_dome_height = p_mon_valley_sky->height;
-        p_mon_valley_irr_map->Bind(14, programId, "IrrMapTex");
-        break;
-    }
-    CHECKERROR;
-
-    loc = glGetUniformLocation(programId, "skydome_width");
-    glUniform1i(loc, sky_dome_width);
-
-    loc = glGetUniformLocation(programId, "skydome_height");
-    glUniform1i(loc, sky_dome_height);
-
-    shadowPassRenderTarget.BindTexture(lightingProgram->programId, 15, "shadowMap");
-    
-    upperReflectionRenderTarget.BindTexture(lightingProgram->programId, 16, "upperReflectionMap");
-    
-    lowerReflectionRenderTarget.BindTexture(lightingProgram->programId, 17, "lowerReflectionMap");
-
-    gbufferRenderTarget.BindTexture(lightingProgram->programId, 18, "gBufferWorldPos", 0);
-
-    gbufferRenderTarget.BindTexture(lightingProgram->programId, 19, "gBufferNormalVec", 1);
-
-    gbufferRenderTarget.BindTexture(lightingProgram->programId, 20, "gBufferDiffuse", 2);
+    BindShadowCascades(lightingProgram->programId, 15);
     
-    gbufferRenderTarget.BindTexture(lightingProgram->programId, 21, "gBufferSpecular", 3);
-
-    AORenderTarget.BindTexture(lightingProgram->programId, 22, "AOMap");
-
-    bilinearFilterOutput.BindTexture(lightingProgram->programId, 23, "AOMap_1");
+    reflectionRenderTarget.BindTexture(lightingProgram->programId, 16, "reflectionMaps");
+
+    BindGbuffer(lightingProgram->programId);
+    if (gbuffer_mode == 1)      // The compact G-buffer does not store the sky's color
+        CurrentSkyDome()->Bind(13, lightingProgram->programId, "SkydomeTex");
+
+    frameGraph.BindTexture(rg_ao, lightingProgram->programId, 22, "AOMap");
+
+    frameGraph.BindTexture(rg_aoBlurH, lightingProgram->programId, 23, "AOMap_1");
+
+    frameGraph.BindTexture(rg_aoBlurV, lightingProgram->programId, 24, "AOMap_2");
+
+    specular_env.Bind(25, lightingProgram->programId, "SpecularEnvTex");
+
+    specular_env.BindBrdfLUT(26, lightingProgram->programId, "BrdfLUT");
+
+    if (reflection_source == 1) {
+        frameGraph.BindTexture(rg_hiz, programId, 28, "HiZTex");
+        ssrHistory.BindTexture(programId, 29, "ReflectionHistory");
+        loc = glGetUniformLocation(programId, "PrevViewProj");
+        glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(prevViewProj));
+        loc = glGetUniformLocation(programId, "front");
+        glUniform1f(loc, front);
+        loc = glGetUniformLocation(programId, "hizLevels");
+        glUniform1i(loc, hiz_levels);
+        loc = glGetUniformLocation(programId, "ssrHistoryValid");
+        glUniform1i(loc, ssrHistoryValid ? 1 : 0);
+        loc = glGetUniformLocation(programId, "ssrMaxSteps");
+        glUniform1i(loc, ssr_max_steps);
+        loc = glGetUniformLocation(programId, "ssrThickness");
+        glUniform1f(loc, ssr_thickness);
+        loc = glGetUniformLocation(programId, "ssrMaxDistance");
+        glUniform1f(loc, ssr_max_distance);
+    }
 
-    bilinearFilterOutput_2.BindTexture(lightingProgram->programId, 24, "AOMap_2");
+    loc = glGetUniformLocation(programId, "specularEnvLevels");
+    glUniform1i(loc, specular_env.levels);
 
-    // Set the viewport, and clear the screen
-    glViewport(0, 0, width, height);
-    glClearColor(0.5, 0.5, 0.5, 1.0);
+    // Set the viewport, and clear the screen.  The clear reaches past
+    // the viewport, and black there keeps it out of the bloom.
+    glViewport(0, 0, render_width, render_height);
+    glClearColor(0.0, 0.0, 0.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT| GL_DEPTH_BUFFER_BIT);
     CHECKERROR;
 
@@ -1376,8 +2284,6 @@ void Scene::DrawScene()
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(WorldView));
     loc = glGetUniformLocation(programId, "LightView");
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(LightView));
-    loc = glGetUniformLocation(programId, "ShadowMatrix");
-    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(ShadowMatrix));
     loc = glGetUniformLocation(programId, "WorldInverse");
     glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(WorldInverse));
     loc = glGetUniformLocation(programId, "lightPos");
@@ -1404,11 +2310,6 @@ void Scene::DrawScene()
     glUniform1i(loc, ao_enabled);
     CHECKERROR;
 
-    loc = glGetUniformLocation(programId, "min_depth");
-    glUniform1f(loc, min_depth);
-    loc = glGetUniformLocation(programId, "max_depth");
-    glUniform1f(loc, max_depth);
-
     loc = glGetUniformLocation(programId, "bloomThreshold");
     glUniform1f(loc, bloom_threshold);
 
@@ -1427,11 +2328,45 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
     // End of Lighting pass
     ////////////////////////////////////////////////////////////////////////////////
+}
+
+// Resolves this frame's jittered samples, with the reprojected
+// history, into the window sized output
+void Scene::TAAPass()
+{
+    taaProgram->Use();
+    int programId = taaProgram->programId;
+
+    BindGbuffer(programId);
+    postProcessingBuffer.BindTexture(programId, 22, "color", 0);
+    taaHistory.BindTexture(programId, 23, "history", 1 - taa_history_index);
+
+    int loc = glGetUniformLocation(programId, "jitter");
+    glUniform2f(loc, taaJitter.x, taaJitter.y);
+    loc = glGetUniformLocation(programId, "historyValid");
+    glUniform1i(loc, taaHistoryValid ? 1 : 0);
+    loc = glGetUniformLocation(programId, "blend");
+    glUniform1f(loc, taa_blend);
+
+    loc = glGetUniformLocation(programId, "dst");
+    glBindImageTexture(0, taaHistory.textureID[taa_history_index],
+        0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+    glUniform1i(loc, 0);
+    taaKernel->Dispatch(width, height);
+    CHECKERROR;
+
+    taaProgram->Unuse();
+    taaHistoryValid = true;
+}
 
+void Scene::BloomBlurPass()
+{
+    int loc;
+    GLuint imageUnit;
     ////////////////////////////////////////////////////////////////////////////////
     // Bloom pass blur
     ////////////////////////////////////////////////////////////////////////////////
-    if (bloom_mode == 1) {
+    {
         RecalculateBloomKernel();
 
         glBindBuffer(GL_ARRAY_BUFFER, blur_kernel_block_id);
@@ -1440,48 +2375,47 @@ void Scene::DrawScene()
         CHECKERROR;
 
         for (unsigned int i = 0; i < bloom_pass_count; ++i) {
-            shadowBlur_H_Program->Use();
-            loc = glGetUniformLocation(shadowBlur_H_Program->programId, "width");
+            bloomBlur_H_Program->Use();
+            loc = glGetUniformLocation(bloomBlur_H_Program->programId, "width");
             glUniform1i(loc, bloom_kernerl_width);
             imageUnit = 0; // Perhaps 0 for input image and 1 for output image
-            loc = glGetUniformLocation(shadowBlur_H_Program->programId, "src");
+            loc = glGetUniformLocation(bloomBlur_H_Program->programId, "src");
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[1],
-                0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+                0, GL_FALSE, 0, GL_READ_ONLY, GL_R11F_G11F_B10F);
             glUniform1i(loc, imageUnit);
 
 
             imageUnit = 1; // Perhaps 0 for input image and 1 for output image
-            loc = glGetUniformLocation(shadowBlur_H_Program->programId, "dst");
+            loc = glGetUniformLocation(bloomBlur_H_Program->programId, "dst");
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[2],
-                0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+                0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R11F_G11F_B10F);
             glUniform1i(loc, imageUnit);
-            // Tiles WxH image with groups sized 128x1
-            glDispatchCompute(glm::ceil(width / 128.0f), height, 1);
+            bloomBlurHKernel->Dispatch(render_width, render_height);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
-            shadowBlur_H_Program->Unuse();
+            bloomBlur_H_Program->Unuse();
             CHECKERROR;
 
-            shadowBlur_V_Program->Use();
+            bloomBlur_V_Program->Use();
 
-            loc = glGetUniformLocation(shadowBlur_V_Program->programId, "width");
+            loc = glGetUniformLocation(bloomBlur_V_Program->programId, "width");
             glUniform1i(loc, bloom_kernerl_width);
             imageUnit = 0; // Perhaps 0 for input image and 1 for output image
-            loc = glGetUniformLocation(shadowBlur_V_Program->programId, "src");
+            loc = glGetUniformLocation(bloomBlur_V_Program->programId, "src");
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[2],
-                0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+                0, GL_FALSE, 0, GL_READ_ONLY, GL_R11F_G11F_B10F);
             glUniform1i(loc, imageUnit);
 
 
             imageUnit = 1; // Perhaps 0 for input image and 1 for output image
-            loc = glGetUniformLocation(shadowBlur_V_Program->programId, "dst");
+            loc = glGetUniformLocation(bloomBlur_V_Program->programId, "dst");
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[1],
-                0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+                0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R11F_G11F_B10F);
             glUniform1i(loc, imageUnit);
-            // Set all uniform and image variables
-            // Tiles WxH image with groups sized 128x1
-            glDispatchCompute(width, glm::ceil(height / 128.0f), 1);
+            bloomBlurVKernel->Dispatch(render_width, render_height);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
-            shadowBlur_V_Program->Unuse();
+            bloomBlur_V_Program->Unuse();
             CHECKERROR;
         }
     }
@@ -1489,52 +2423,44 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
     // End of Bloom pass blur
     ////////////////////////////////////////////////////////////////////////////////
+}
 
+void Scene::BloomMipChainPass()
+{
+    int loc;
+    GLuint imageUnit;
     ////////////////////////////////////////////////////////////////////////////////
     // Bloom pass downsampling
     ////////////////////////////////////////////////////////////////////////////////
-    if (bloom_mode == 0) {
-        int start_width = width;
-        int start_height = height;
-        int downsampling_width = width / 2;
-        int downsampling_height = height / 2;
-        std::vector<int> width_list;
-        std::vector<int> height_list;
-        width_list.push_back(start_width);
-        height_list.push_back(start_height);
+    {
+        // Every level in one dispatch, one image unit per level
+        int mip_count = std::min(downsampling_passes, postProcessingBuffer.levels[1] - 1);
         downsampling_Compute->Use();
         postProcessingBuffer.BindTexture(downsampling_Compute->programId, 0, "inputTex", 1);
 
-        for (unsigned int mip_level = 0; mip_level < downsampling_passes; ++mip_level) {
-            loc = glGetUniformLocation(downsampling_Compute->programId, "mip_level");
-            glUniform1f(loc, float(mip_level));
-
-            imageUnit = 1; // Perhaps 0 for input image and 1 for output image
-            loc = glGetUniformLocation(downsampling_Compute->programId, "dst");
+        for (int mip_level = 1; mip_level <= mip_count; ++mip_level) {
+            imageUnit = mip_level - 1;
+            std::string name = "dst[" + std::to_string(mip_level - 1) + "]";
+            loc = glGetUniformLocation(downsampling_Compute->programId, name.c_str());
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[1],
-                mip_level + 1, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-            CHECKERROR;
+                mip_level, GL_FALSE, 0, GL_READ_WRITE, GL_R11F_G11F_B10F);
             glUniform1i(loc, imageUnit);
-
-            //width and height before the downsampling is performed
-            loc = glGetUniformLocation(downsampling_Compute->programId, "width");
-            glUniform1i(loc, start_width);
-            loc = glGetUniformLocation(downsampling_Compute->programId, "height");
-            glUniform1i(loc, start_height);
-            CHECKERROR;
-
-            // Runs with half width and half height of the previous pass.
-            glDispatchCompute(downsampling_width, downsampling_height, 1);
-            CHECKERROR;
-
-            start_width = downsampling_width;
-            start_height = downsampling_height;
-            downsampling_width /= 2;
-            downsampling_height /= 2;
-
-            width_list.push_back(start_width);
-            height_list.push_back(start_height);
         }
+        CHECKERROR;
+
+        loc = glGetUniformLocation(downsampling_Compute->programId, "mip_count");
+        glUniform1i(loc, mip_count);
+        loc = glGetUniformLocation(downsampling_Compute->programId, "width");
+        glUniform1i(loc, width);
+        loc = glGetUniformLocation(downsampling_Compute->programId, "height");
+        glUniform1i(loc, height);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, downsample_counter_id);
+
+        // One group per 64x64 tile of level 0's rendered part
+        downsampleKernel->DispatchGroups((render_width + 63)/64, (render_height + 63)/64);
+        // The upsample reads the levels, and the next frame's groups
+        // must see the last group's reset of groupsDone
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
         downsampling_Compute->Unuse();
         CHECKERROR;
 
@@ -1549,26 +2475,26 @@ void Scene::DrawScene()
         upsampling_Compute->Use();
         postProcessingBuffer.BindTexture(upsampling_Compute->programId, 0, "inputTex", 1);
 
-        for (int mip_level = downsampling_passes; mip_level > 0; --mip_level) {
+        for (int mip_level = mip_count; mip_level > 0; --mip_level) {
             loc = glGetUniformLocation(upsampling_Compute->programId, "mip_level");
             glUniform1f(loc, (float)mip_level);
 
             imageUnit = 1; // Perhaps 0 for input image and 1 for output image
             loc = glGetUniformLocation(upsampling_Compute->programId, "dst");
             glBindImageTexture(imageUnit, postProcessingBuffer.textureID[2],
-                mip_level - 1, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+                mip_level - 1, GL_FALSE, 0, GL_WRITE_ONLY, GL_R11F_G11F_B10F);
             CHECKERROR;
             glUniform1i(loc, imageUnit);
 
             //width and height before the upsampling is performed
             loc = glGetUniformLocation(upsampling_Compute->programId, "width");
-            glUniform1i(loc, width_list[mip_level]);
+            glUniform1i(loc, std::max(1, width >> mip_level));
             loc = glGetUniformLocation(upsampling_Compute->programId, "height");
-            glUniform1i(loc, height_list[mip_level]);
+            glUniform1i(loc, std::max(1, height >> mip_level));
             CHECKERROR;
 
             // Runs with double width and double height of the previous pass.
-            glDispatchCompute(width_list[mip_level - 1], height_list[mip_level - 1], 1);
+            upsampleKernel->Dispatch(std::max(1, render_width >> (mip_level - 1)), std::max(1, render_height >> (mip_level - 1)));
             CHECKERROR;
         }
         upsampling_Compute->Unuse();
@@ -1577,7 +2503,11 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
     // End of Bloom pass upsample + additive blending
     ////////////////////////////////////////////////////////////////////////////////
+}
 
+void Scene::PostProcessingPass()
+{
+    int loc, programId;
     ////////////////////////////////////////////////////////////////////////////////
     // Post Processing pass
     ////////////////////////////////////////////////////////////////////////////////
@@ -1587,7 +2517,11 @@ void Scene::DrawScene()
     programId = postProcessing_Program->programId;
     CHECKERROR;
 
-    postProcessingBuffer.BindTexture(programId, 15, "renderBuffer", 0);
+    // TAA's output is already at the window's size
+    if (taa_mode == 1)
+        taaHistory.BindTexture(programId, 15, "renderBuffer", taa_history_index);
+    else
+        postProcessingBuffer.BindTexture(programId, 15, "renderBuffer", 0);
     postProcessingBuffer.BindTexture(programId, 16, "bloomBuffer", 1);
     postProcessingBuffer.BindTexture(programId, 17, "upsampleBuffer", 2);
     // Set the viewport, and clear the screen
@@ -1606,6 +2540,13 @@ void Scene::DrawScene()
     glUniform1i(loc, width);
     loc = glGetUniformLocation(programId, "height");
     glUniform1i(loc, height);
+    loc = glGetUniformLocation(programId, "renderScale");
+    glUniform2f(loc, float(render_width)/width, float(render_height)/height);
+    loc = glGetUniformLocation(programId, "colorScale");
+    if (taa_mode == 1)
+        glUniform2f(loc, 1.0f, 1.0f);
+    else
+        glUniform2f(loc, float(render_width)/width, float(render_height)/height);
     CHECKERROR;
 
     
@@ -1641,10 +2582,11 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
     // Post Processing pass
     ////////////////////////////////////////////////////////////////////////////////
+}
 
-    if (local_lights_on == 0)
-        return; //Skip local lights pass
-
+void Scene::LocalLightsPass()
+{
+    int loc, programId;
     ////////////////////////////////////////////////////////////////////////////////
     // Local Lights pass
     ////////////////////////////////////////////////////////////////////////////////
@@ -1662,14 +2604,7 @@ void Scene::DrawScene()
     programId = localLightsProgram->programId;
     CHECKERROR;
 
-    gbufferRenderTarget.BindTexture(programId, 18, "gBufferWorldPos", 0);
-
-    gbufferRenderTarget.BindTexture(programId, 19, "gBufferNormalVec", 1);
-
-    gbufferRenderTarget.BindTexture(programId, 20, "gBufferDiffuse", 2);
-
-    gbufferRenderTarget.BindTexture(programId, 21, "gBufferSpecular", 3);
-    CHECKERROR;
+    BindGbuffer(programId);
 
     // @@ The scene specific parameters (uniform variables) used by
     // the shader are set here.  Object specific parameters are set in
@@ -1691,7 +2626,6 @@ void Scene::DrawScene()
     glUniform1i(loc, height);
     CHECKERROR;
 
-    //Draw a full screen quad to activate every pixel shader
     DrawLocalLights(localLightsProgram);
     CHECKERROR;
 
@@ -1708,6 +2642,42 @@ void Scene::DrawScene()
     ////////////////////////////////////////////////////////////////////////////////
 }
 
+// The local lights in one full screen pass: the lights are binned into
+// clusters on the CPU, then each pixel loops over its cluster's list
+void Scene::ClusteredLightsPass()
+{
+    lightClusters.Build(lightSystem, WorldView, WorldProj, render_width, render_height, front, back);
+
+    glDisable(GL_DEPTH_TEST);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glEnable(GL_BLEND);
+
+    clusteredLightsProgram->Use();
+    int programId = clusteredLightsProgram->programId;
+
+    BindGbuffer(programId);
+    lightClusters.Bind(lightSystem, programId);
+
+    int loc = glGetUniformLocation(programId, "WorldInverse");
+    glUniformMatrix4fv(loc, 1, GL_FALSE, Pntr(WorldInverse));
+    loc = glGetUniformLocation(programId, "ambient");
+    glUniform3fv(loc, 1, &(ambient[0]));
+    loc = glGetUniformLocation(programId, "lightingMode");
+    glUniform1i(loc, lightingMode);
+    loc = glGetUniformLocation(programId, "width");
+    glUniform1i(loc, width);
+    loc = glGetUniformLocation(programId, "height");
+    glUniform1i(loc, height);
+    CHECKERROR;
+
+    DrawFullScreenQuad();
+    CHECKERROR;
+
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    clusteredLightsProgram->Unuse();
+}
+
 
 void Scene::RecalculateKernel() {
     kernel_vals.clear();
@@ -1748,17 +2718,94 @@ void Scene::RecalculateBilinearKernel() {
     }
 }
 
-void Scene::RecalculateHBlock() {
-    int kk;
-    int pos = 0;
-    float u, v, p;
-    for (int k = 0; k < sampling_count; k++) {
-        for (p = 0.5f, kk = k, u = 0.5f; kk; p *= 0.5f, kk >>= 1) {
-            if (kk & 1)
-                u += p;
-        }
-        v = (k + 0.5f) / sampling_count;
-        h_block.hammersly[pos++] = u;
-        h_block.hammersly[pos++] = v;
+Texture* Scene::CurrentSkyDome() {
+    switch (sky_dome_mode)
+    {
+    case 0:
+        return p_sky_dome;
+    case 1:
+        return p_sky_dome_cage;
+    case 2:
+        return p_barca_sky;
+    default:
+        return p_mon_valley_sky;
     }
-}
\ No newline at end of file
+}
+
+void Scene::UploadIrradianceSH() {
+    //Padded to vec4s to match the std140 layout of IrradianceBlock
+    glm::vec4 coeffs[IRRADIANCE_SH_COUNT];
+    Texture* sky_dome = CurrentSkyDome();
+    for (int i = 0; i < IRRADIANCE_SH_COUNT; i++)
+        coeffs[i] = glm::vec4(sky_dome->irradianceSH[i], 0.0f);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, irr_sh_block_id);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(coeffs), coeffs);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    CHECKERROR;
+    irr_sh_sky_mode = sky_dome_mode;
+}
+
+void Scene::PrefilterSpecularEnv() {
+    env_sky_mode = sky_dome_mode;
+    env_sampling_count = sampling_count;
+    env_prefiltered_mode = env_prefilter_mode;
+
+    double start = glfwGetTime();
+    if (env_prefilter_mode == 0) {
+        specular_env.PrefilterGPU(prefilterEnvKernel, CurrentSkyDome(), sampling_count);
+        glFinish();
+    }
+    else
+        specular_env.PrefilterCPU(CurrentSkyDome(), sampling_count);
+    env_prefilter_ms = 1000.0*(glfwGetTime() - start);
+}
+
+// Points lightingProgram, localLightsProgram and postProcessing_Program
+// at the permutations with the current menu selections compiled in.
+// Debug views that a shader does not draw itself share one permutation.
+void Scene::SelectShaderVariants() {
+    // Only defined for the compact layout, as the shaders test #ifdef
+    std::string gbufferLayout = gbuffer_mode == 1 ? ShaderDefine("COMPACT_GBUFFER", 1) : "";
+
+    gbufferProgram = gbufferVariants->Get(gbufferLayout);
+    AOProgram = AOKernel->Select(gbufferLayout);
+    AOUpsampleProgram = AOUpsampleKernel->Select(gbufferLayout);
+    AOTemporalProgram = AOTemporalKernel->Select(gbufferLayout);
+    hizProgram = hizKernel->Select(gbufferLayout);
+    taaProgram = taaKernel->Select(gbufferLayout);
+    bilinear_H_Program = AOBlurHKernel->Select(gbufferLayout);
+    bilinear_V_Program = AOBlurVKernel->Select(gbufferLayout);
+
+    // The compute kernels at their current (or autotuned) group sizes
+    shadowBlur_H_Program = shadowBlurHKernel->Select();
+    shadowBlur_V_Program = shadowBlurVKernel->Select();
+    bloomBlur_H_Program = bloomBlurHKernel->Select("#define IMAGE_FORMAT r11f_g11f_b10f\n");
+    bloomBlur_V_Program = bloomBlurVKernel->Select("#define IMAGE_FORMAT r11f_g11f_b10f\n");
+    satRows_Program = satRowsKernel->Select();
+    satColumns_Program = satColumnsKernel->Select("#define SCAN_COLUMNS\n");
+    downsampling_Compute = downsampleKernel->Select();
+    upsampling_Compute = upsampleKernel->Select();
+
+    lightingProgram = lightingVariants->Get(
+        gbufferLayout
+        + ShaderDefine("LIGHTING_MODE", lightingMode)
+        + ShaderDefine("REFLECTION_MODE", reflectionMode)
+        + ShaderDefine("REFLECTION_SOURCE", reflection_source)
+        + ShaderDefine("AO_ENABLED", ao_enabled)
+        + ShaderDefine("DRAW_FBO", draw_fbo <= 12 ? draw_fbo : 15));
+
+    localLightsProgram = localLightsVariants->Get(
+        gbufferLayout
+        + ShaderDefine("LIGHTING_MODE", lightingMode));
+
+    clusteredLightsProgram = clusteredLightsVariants->Get(
+        gbufferLayout
+        + ShaderDefine("LIGHTING_MODE", lightingMode));
+
+    postProcessing_Program = postProcessingVariants->Get(
+        ShaderDefine("DRAW_FBO", draw_fbo <= 12 ? 0 : draw_fbo)
+        + ShaderDefine("TONE_MAPPING_MODE", tone_map_mode)
+        + ShaderDefine("BLOOM_ENABLED", bloom_enabled)
+        + ShaderDefine("BLOOM_MODE", bloom_mode));
+}
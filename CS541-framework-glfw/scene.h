@@ -16,6 +16,13 @@
 #include "object.h"
 #include "texture.h"
 #include "fbo.h"
+#include "envmap.h"
+#include "rendergraph.h"
+#include "compute.h"
+#include "clusters.h"
+#include "lights.h"
+#include "profiler.h"
+#include "trace.h"
 
 enum ObjectIds {
     nullId = 0,
@@ -35,11 +42,6 @@ enum ObjectIds {
 class Shader;
 
 
-struct HBlock {
-    float N;
-    float hammersly[2 * 40];
-};
-
 class Scene
 {
 public:
@@ -75,7 +77,7 @@ public:
     int width, height;
 
     // Transformations
-    glm::mat4 WorldProj, WorldView, WorldInverse, LightView, LightProj;
+    glm::mat4 WorldProj, WorldView, WorldInverse, LightView;
 
     // All objects in the scene are children of this single root object.
     Object* objectRoot;
@@ -88,69 +90,197 @@ public:
 
     std::vector<Object*> animated;
     ProceduralGround* proceduralground;
-    std::vector<Object*> LocalLights;
-    std::vector<glm::vec3> local_light_positions;
-    std::vector<float> local_light_radii;
+    LightSystem lightSystem;
+    double local_light_time, local_light_clock;
+    // Light volume mode: one icosphere instance per light left after
+    // frustum rejection
+    Shape* lightVolume;
+    int visible_local_lights;
+    LightClusters lightClusters;
     float local_light_range;
 
     // Shader programs
-    ShaderProgram* lightingProgram;
+    ShaderVariants* lightingVariants;
+    ShaderVariants* localLightsVariants;
+    ShaderVariants* clusteredLightsVariants;
+    ShaderVariants* postProcessingVariants;
+    ShaderVariants* gbufferVariants;
+    ShaderProgram* lightingProgram;     // Current permutations of the above
     ShaderProgram* shadowProgram;
     ShaderProgram* reflectionProgram;
+    ShaderProgram* reflectionLayeredProgram;    // Both paraboloids in one traversal, or NULL
     ShaderProgram* gbufferProgram;
     ShaderProgram* localLightsProgram;
+    ShaderProgram* clusteredLightsProgram;
     ShaderProgram* shadowBlur_H_Program;
     ShaderProgram* shadowBlur_V_Program;
+    ShaderProgram* bloomBlur_H_Program;
+    ShaderProgram* satRows_Program;
+    ShaderProgram* satColumns_Program;
+    ShaderProgram* bloomBlur_V_Program;
     ShaderProgram* AOProgram;
+    ShaderProgram* AOUpsampleProgram;
+    ShaderProgram* AOTemporalProgram;
+    ShaderProgram* hizProgram;
+    ShaderProgram* taaProgram;
     ShaderProgram* bilinear_H_Program;
     ShaderProgram* bilinear_V_Program;
     ShaderProgram* postProcessing_Program;
     ShaderProgram* postProcessing_Compute;
     ShaderProgram* downsampling_Compute;
     ShaderProgram* upsampling_Compute;
+
+    // Compute shaders with tunable work group sizes (see compute.h);
+    // the *_Program members above hold their current permutations
+    ComputeKernel* shadowBlurHKernel;
+    ComputeKernel* shadowBlurVKernel;
+    ComputeKernel* bloomBlurHKernel;
+    ComputeKernel* bloomBlurVKernel;
+    ComputeKernel* satRowsKernel;
+    ComputeKernel* satColumnsKernel;
+    ComputeKernel* AOKernel;
+    ComputeKernel* AOBlurHKernel;
+    ComputeKernel* AOBlurVKernel;
+    ComputeKernel* AOUpsampleKernel;
+    ComputeKernel* AOTemporalKernel;
+    ComputeKernel* hizKernel;
+    ComputeKernel* taaKernel;
+    ComputeKernel* downsampleKernel;
+    ComputeKernel* upsampleKernel;
+    ComputeKernel* prefilterEnvKernel;
+    ComputeKernel* brdfLutKernel;
     // @@ Declare additional shaders if necessary
 
     //FBO decleration
-    FBO shadowPassRenderTarget, upperReflectionRenderTarget, lowerReflectionRenderTarget, gbufferRenderTarget;
-    FBO AORenderTarget;
+    FBO gbufferRenderTarget;
+    LayeredFBO reflectionRenderTarget;  // Layer 0 the upper paraboloid, layer 1 the lower
+    LayeredFBO shadowPassRenderTarget;  // One layer of moments per cascade
+    LayeredFBO shadowStaticTarget;      // Moments of the static casters alone, unblurred
     int fbo_width, fbo_height;
 
-    glm::mat4 BMatrix, ShadowMatrix;
+    glm::mat4 BMatrix;
+
+    // Cascaded shadow maps: the view frustum is split by distance into
+    // cascade_count slices, each with an orthographic light projection
+    // fitted to it by FitShadowCascades.  MaxCascades agrees with
+    // MAX_CASCADES in shadow_cascades.glsl.
+    static const int MaxCascades = 4;
+    int cascade_count = 4;
+    float cascade_split_lambda = 0.75f;         // 0 uniform splits, 1 logarithmic
+    float cascadeSplits[MaxCascades + 1];       // View depths bounding the slices
+    glm::mat4 CascadeProj[MaxCascades];         // Follows LightView
+    glm::mat4 ShadowMatrices[MaxCascades];      // World to shadow map coordinates
 
     Texture* p_sky_dome;
     Texture* p_sky_dome_cage;
     Texture* p_sky_dome_night;
     Texture* p_barca_sky;
-    Texture* p_barca_irr_map;
     Texture* p_mon_valley_sky;
-    Texture* p_mon_valley_irr_map;
 
     int sky_dome_mode = 2;
     int texture_mode = 1;
     int draw_fbo = 15;
     int local_lights_on = 0;
+    int local_lights_mode = 1;  // 0 a light volume per light, 1 clustered
+    bool local_lights_animate = true;
 
     int ao_enabled = 1;
+    int ao_resolution_mode = 1; // 0 full, 1 half, 2 quarter resolution
+    int ao_width, ao_height;    // Rendered size of the AO and its blur at that resolution
+    int gbuffer_mode = 0;       // 0 full RGBA32F, 1 compact; see gbuffer.glsl
+    int gbuffer_built_mode;
     int tone_map_mode = 1;
     // Options menu stuff
     bool show_demo_window;
+    bool show_profiler = false;
 
-    int ao_sample_count = 20;
+    int ao_sample_count = 6;    // Per frame; the temporal accumulation adds up the frames
     float ao_range = 1.0f;
     float ao_scale = 1;
     float ao_contrast = 1;
 
+    // Temporal accumulation of the AO, see ao_temporal.comp
+    int ao_temporal_mode = 1;   // 0 off, 1 on
+    float ao_temporal_blend = 0.9f;     // Weight of the reprojected history
+    FBO aoHistory;              // Attachments 0 and 1 take turns as this and last frame's history
+    int ao_history_index = 0;   // Attachment written this frame
+    bool aoHistoryValid = false;
+    int ao_frame = 0;           // Turns the AO sample spiral
+    glm::mat4 prevViewProj;     // Last frame's WorldProj*WorldView
+
+    // Screen space reflections, see ssr.glsl
+    int reflection_source = 0;  // 0 paraboloid maps, 1 screen space
+    int reflection_layered_mode = 1;    // 0 a traversal per paraboloid, 1 one for both
+
+    // Paraboloid map updates: every frame, round robin one paraboloid
+    // per frame, or only those that are stale because the sky, the
+    // light, or a dynamic object within reflection_range of
+    // reflectionEye has changed since they were drawn
+    int reflection_update_mode = 0; // 0 every frame, 1 a paraboloid per frame, 2 on change
+    float reflection_range = 20.0f;
+    int reflectionLayersValid = 0;  // Bit 0 the upper paraboloid, bit 1 the lower
+    int redrawReflections = 3;      // This frame's paraboloids, same bits
+    int reflection_next_layer = 0;  // Next in the round robin
+    int reflections_drawn = 0;      // Paraboloids drawn this frame
+    // What the paraboloids were last drawn with
+    int reflectionSkyMode = -1;
+    int reflectionLightingMode = -1;
+    int reflectionTextureMode = -1;
+    glm::vec3 reflectionLightPos;
+    int ssr_max_steps = 96;
+    float ssr_thickness = 0.5f;
+    float ssr_max_distance = 50.0f;
+    int rg_hiz;                 // Nearest view depth pyramid
+    int hiz_levels;
+    FBO ssrHistory;             // Last frame's lit image, copied before the lighting pass
+    bool ssrHistoryValid = false;
+
+    // Dynamic resolution: the G-buffer, AO, lighting and bloom passes
+    // draw into the lower left render_width x render_height pixels of
+    // their targets, which stay allocated at the window's size, and the
+    // post processing pass scales the result up.  In mode 1 a PI
+    // controller on the GPU frame time picks the scale.
+    int dynamic_resolution_mode = 0;    // 0 fixed scale, 1 held to target_frame_ms
+    float resolution_scale = 1.0f;
+    float min_resolution_scale = 0.5f;
+    float target_frame_ms = 16.7f;
+    float resolution_integral = 1.0f;   // The controller's integral term, as a scale
+    int resolution_hold = 0;    // Frames until a change shows in the timings
+    int render_width = 0, render_height = 0;
+
+    // Temporal anti-aliasing, see taa.comp.  It resolves the jittered
+    // render samples to the window's size, so the post processing pass
+    // takes its output instead of scaling up the lit image.
+    int taa_mode = 0;           // 0 off, 1 on
+    float taa_blend = 0.9f;     // Weight of the history
+    FBO taaHistory;             // Attachments 0 and 1 take turns as this and last frame's output
+    int taa_history_index = 0;  // Attachment written this frame
+    bool taaHistoryValid = false;
+    int taa_frame = 0;          // Index into the jitter sequence
+    glm::vec2 taaJitter;        // This frame's sample offset, in render pixels
+    glm::mat4 ViewProj;         // WorldProj*WorldView without the jitter
+
     //Deferred shading reqs
     GLuint screen_quad_vao;
 
     int shadow_blur_kernel_width;
     GLuint blur_kernel_block_id;
     GLuint bilinear_kernel_block_id;
-    FBO shadowBlurOutput;
-    FBO bilinearFilterOutput;
-    FBO bilinearFilterOutput_2;
+    GLuint downsample_counter_id;  // Atomic group counter of downsample.comp
     FBO postProcessingBuffer;
     int kernel_width = 3;
+
+    // Shadow map caching: static casters are drawn into
+    // shadowStaticTarget once per snapped cascade placement and copied
+    // into the shadow map, then only the dynamic ones are drawn each frame.
+    int shadow_cache_mode = 1;
+    bool shadowCacheValid = false;
+    glm::mat4 shadowCacheMatrices[MaxCascades];    // ShadowMatrices the cache was drawn with
+    int shadowCacheCascades = 0;
+    bool redrawShadowMap = true;
+    int shadowMapKernelWidth = -1;  // Blur width of the current shadow map
+    int shadowMapFilterMode = -1;
+    int shadow_filter_mode = 1;     // 0 separable Gaussian blur, 1 summed-area table
     int bilinear_kernel_width = 3;
     int bloom_kernerl_width = 10;
     float exposure = 6.0f;
@@ -167,24 +297,78 @@ public:
     std::vector<float> kernel_vals;
     std::vector<float> bilinear_kernel_vals;
 
-    HBlock h_block;
-    int sampling_count = 20;
-    GLuint h_block_id;
+    //Specular IBL as a GGX prefiltered skydome (split-sum approximation)
+    PrefilteredEnvMap specular_env;
+    int sampling_count = 64;    // Importance samples per texel when prefiltering
+    int sampling_count_slider = 64; // Applied to sampling_count when the slider is released
+    int env_prefilter_mode = 0; // 0 compute shader, 1 CPU threads
+    int env_sky_mode = -1;
+    int env_sampling_count = -1;
+    int env_prefiltered_mode = -1;
+    double env_prefilter_ms = 0.0;  // Time of the last prefilter
 
     int sky_dome_width;
     int sky_dome_height;
 
+    //Diffuse IBL as spherical harmonics of the current skydome
+    GLuint irr_sh_block_id;
+    int irr_sh_sky_mode = -1;
+
+    //Per frame pass graph; the transient targets it allocates each frame
+    RenderGraph frameGraph;
+    int rg_shadowBlur, rg_ao, rg_aoBlurH, rg_aoBlurV;
+    int rg_aoLow;               // Blurred AO before the upsample; rg_aoBlurV at full resolution
+
     void InitializeScene();
     void BuildTransforms();
     void DrawMenu();
+    void DrawVramReport();
+    void DrawComputeReport();
     void DrawScene();
     void CreateFullScreenQuad();
     void DrawFullScreenQuad();
-    void CreateLocalLights(Shape* SpherePolygons);
+    void CreateLocalLights();
     void DrawLocalLights(ShaderProgram* program);
+    void CreateGbuffer(int w, int h);
+    void BindGbuffer(const int programId);
+    void FitShadowCascades();
+    void BindShadowCascades(const int programId, const int unit);
+    void CreatePostProcessingBuffer(int w, int h);
     void RebuildGbuffer(int w, int h);
     void RecalculateKernel();
     void RecalculateBloomKernel();
     void RecalculateBilinearKernel();
-    void RecalculateHBlock();
+    Texture* CurrentSkyDome();
+    void UploadIrradianceSH();
+    void PrefilterSpecularEnv();
+    void SelectShaderVariants();
+
+    // Passes of DrawScene, run through frameGraph
+    void UpdateResolutionScale();
+    void BuildFrameGraph();
+    void GbufferPass();
+    void DrawShadowCasters(LayeredFBO& target, int cascade, ShaderProgram::DrawFilter filter, bool clear);
+    void StaticShadowPass();
+    void ShadowPass();
+    bool DynamicCastersVisible();
+    bool ReflectionsChanged();
+    void ShadowBlurHPass(int cascade);
+    void ShadowBlurVPass(int cascade);
+    void ShadowSATRowsPass(int cascade);
+    void ShadowSATColumnsPass(int cascade);
+    void AOPass();
+    void AOBlurHPass();
+    void AOBlurVPass();
+    void AOUpsamplePass();
+    void AOTemporalPass();
+    void HiZPass();
+    void ReflectionHistoryPass();
+    void ReflectionPass(int hemisphereSign);
+    void LightingPass();
+    void TAAPass();
+    void BloomBlurPass();
+    void BloomMipChainPass();
+    void PostProcessingPass();
+    void LocalLightsPass();
+    void ClusteredLightsPass();
 };
@@ -5,15 +5,48 @@
 // loaded (method "Use"), its vertex shader and pixel shader will be
 // invoked for all geometry passing through the graphics pipeline.
 // When done, unload it with method "Unuse".
+//
+// Linked programs are cached on disk; see shader.h.
 ////////////////////////////////////////////////////////////////////////
 
 #include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+#ifdef _WIN32
+#include <direct.h>             // For _mkdir
+#else
+#include <sys/stat.h>           // For mkdir
+#endif
 
 #include <glbinding/gl/gl.h>
 #include <glbinding/Binding.h>
 using namespace gl;
 
 #include "shader.h"
+#include "trace.h"
+
+// Directory (relative to the working directory) holding the cached binaries
+static const char* cacheDir = "shader_cache";
+
+double ShaderProgram::compileSeconds = 0.0;
+double ShaderProgram::cacheLoadSeconds = 0.0;
+int ShaderProgram::compileCount = 0;
+int ShaderProgram::cacheLoadCount = 0;
+bool ShaderProgram::parallelCompile = false;
+std::vector<ShaderProgram*> ShaderProgram::pendingPrograms;
+std::vector<ShaderProgram*> ShaderProgram::queuedPrograms;
+bool ShaderProgram::batching = false;
+
+// 64 bit FNV-1a hash, accumulated over several strings
+static unsigned long long HashString(unsigned long long hash, const std::string& str)
+{
+    for (unsigned int i = 0; i < str.size(); i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
 
 // Reads a specified file into a string and returns the string.  The
 // file is examined first to determine the needed string size.
@@ -33,16 +66,113 @@ char* ReadFile(const char* name)
     return content;
 }
 
+// Replaces each line of the form
+//     #include "file"
+// with the (recursively expanded) contents of that file.
+static std::string ExpandIncludes(const std::string& src, const int depth)
+{
+    std::string result;
+    size_t pos = 0;
+    while (pos < src.size()) {
+        size_t end = src.find('\n', pos);
+        if (end == std::string::npos)
+            end = src.size();
+        std::string line = src.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t start = line.find_first_not_of(" \t");
+        size_t open = line.find('"');
+        size_t close = line.rfind('"');
+        if (start != std::string::npos && line.compare(start, 8, "#include") == 0
+            && open != std::string::npos && close > open) {
+            if (depth > 8) {
+                printf("Shader #include nested too deeply: %s\n", line.c_str());
+                continue;
+            }
+            std::string name = line.substr(open + 1, close - open - 1);
+            char* included = ReadFile(name.c_str());
+            result += ExpandIncludes(included, depth + 1);
+            result += '\n';
+            delete included;
+        }
+        else {
+            result += line;
+            result += '\n';
+        }
+    }
+    return result;
+}
+
+// Inserts the preamble right after the #version line (which must stay first)
+static std::string InsertDefines(const std::string& src, const std::string& defines)
+{
+    if (defines.empty())
+        return src;
+    size_t version = src.find("#version");
+    if (version == std::string::npos)
+        return defines + src;
+    size_t end = src.find('\n', version);
+    if (end == std::string::npos)
+        return src + '\n' + defines;
+    return src.substr(0, end + 1) + defines + src.substr(end + 1);
+}
+
+// Worker thread body: reads a file and expands its #includes
+static std::string ReadShaderSource(const std::string fileName)
+{
+    char* src = ReadFile(fileName.c_str());
+    std::string text = ExpandIncludes(src, 0);
+    delete src;
+    return text;
+}
+
+std::string ShaderDefine(const char* name, const int value)
+{
+    return std::string("#define ") + name + " " + std::to_string(value) + "\n";
+}
+
+// Asks the driver to compile on its own threads, if it is able to.
+void ShaderProgram::EnableParallelCompile()
+{
+    static bool checked = false;
+    if (checked)
+        return;
+    checked = true;
+
+    int count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int i = 0; i < count; i++) {
+        std::string name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (name == "GL_KHR_parallel_shader_compile") {
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);  // Implementation chosen count
+            parallelCompile = true;
+        }
+        else if (name == "GL_ARB_parallel_shader_compile" && !parallelCompile) {
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+            parallelCompile = true;
+        }
+    }
+    printf("Parallel shader compile %s\n", parallelCompile ? "enabled" : "not available");
+}
+
 // Creates an empty shader program.
 ShaderProgram::ShaderProgram()
 { 
+    EnableParallelCompile();
     programId = glCreateProgram();
 	isReflectionShader = false;
+    drawFilter = DrawAll;
+    layers = 1;
+    linkQueued = false;
+    linkPending = false;
+    issueSeconds = 0.0;
 }
 
 // Use a shader program
 void ShaderProgram::Use()
 {
+    if (linkQueued || linkPending)
+        FinishLink();
     glUseProgram(programId);
 }
 
@@ -52,44 +182,132 @@ void ShaderProgram::Unuse()
     glUseProgram(0);
 }
 
-// Read, send to OpenGL, and compile a single file into a shader
-// program.  In case of an error, retrieve and print the error log
-// string.
+// Start reading a single file of shader source on a worker thread.
+// LinkProgram compiles it only if no usable cached binary exists.
 void ShaderProgram::AddShader(const char* fileName, GLenum type)
 {
-    // Read the source from the named file
-    char* src = ReadFile(fileName);
-    const char* psrc[1] = {src};
+    Source source;
+    source.fileName = fileName;
+    source.type = type;
+    source.pending = std::async(std::launch::async, ReadShaderSource, std::string(fileName)).share();
+    sources.push_back(source);
+}
 
-    // Create a shader and attach, hand it the source, and compile it.
-    int shader = glCreateShader(type);
-    glAttachShader(programId, shader);
-    glShaderSource(shader, 1, psrc, NULL);
-    glCompileShader(shader);
-    delete src;
+// Records a uniform block binding, applied once the program is linked
+void ShaderProgram::UniformBlockBinding(const char* name, const int bindpoint)
+{
+    uniformBlocks.push_back(std::make_pair(std::string(name), bindpoint));
+    if (!linkQueued && !linkPending)
+        ApplyUniformBlocks();
+}
 
-    // Get the compilation status
-    int status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    
-    // If compilation status is not OK, get and print the log message.
-    if (status != 1) {
-        int length;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
-        char* buffer = new char[length];
-        glGetShaderInfoLog(shader, length, NULL, buffer);
-        printf("Compile log for %s:\n%s\n", fileName, buffer);
-        delete buffer;
+void ShaderProgram::ApplyUniformBlocks()
+{
+    for (unsigned int i = 0; i < uniformBlocks.size(); i++) {
+        GLuint loc = glGetUniformBlockIndex(programId, uniformBlocks[i].first.c_str());
+        if (loc != GL_INVALID_INDEX)   // Blocks unused by this permutation are optimized away
+            glUniformBlockBinding(programId, loc, uniformBlocks[i].second);
     }
 }
 
 // Link a shader program after all the shader files have been added
-// with the AddShader method.  In case of an error, retrieve and print
-// the error log string.
+// with the AddShader method.  Inside a batch it is only queued, to be
+// issued by IssueBatch; otherwise it is issued now.
 void ShaderProgram::LinkProgram()
 {
-    // Link program and check the status
-    glLinkProgram(programId);
+    if (batching) {
+        linkQueued = true;
+        queuedPrograms.push_back(this);
+        return;
+    }
+    IssueLink();
+}
+
+// Link programs requested from here on are queued ...
+void ShaderProgram::BeginBatch()
+{
+    batching = true;
+}
+
+// ... and issued here, by which time their files have been read
+void ShaderProgram::IssueBatch()
+{
+    batching = false;
+    while (!queuedPrograms.empty())
+        queuedPrograms.front()->IssueLink();
+}
+
+// Waits for this program's files.  A cached binary of the same sources
+// for the same renderer and driver is used if possible, otherwise the
+// compile and link are issued here and finished by FinishLink.
+void ShaderProgram::IssueLink()
+{
+    TRACE_SCOPE_DETAIL("Shader link", sources.empty() ? NULL : sources[0].fileName.c_str());
+    if (linkQueued) {
+        linkQueued = false;
+        queuedPrograms.erase(std::find(queuedPrograms.begin(), queuedPrograms.end(), this));
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < sources.size(); i++)
+        sources[i].text = sources[i].pending.get();
+    cachePath = CachePath();
+
+    if (!cachePath.empty() && LoadCachedBinary(cachePath)) {
+        ApplyUniformBlocks();
+        cacheLoadSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cacheLoadCount++;
+        return;
+    }
+
+    IssueCompileAndLink();
+    linkPending = true;
+    pendingPrograms.push_back(this);
+    issueSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// True once the program can be used without waiting: never while
+// queued, and while compiling only if the driver says it is done
+bool ShaderProgram::Linked()
+{
+    if (linkQueued)
+        return false;
+    if (!linkPending || !parallelCompile)
+        return true;
+    int done = 0;
+    glGetProgramiv(programId, GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+
+// Waits for the compile and link issued by LinkProgram (issuing it
+// first if it is still queued), prints any error logs, applies the
+// uniform block bindings and caches the binary.
+void ShaderProgram::FinishLink()
+{
+    if (linkQueued)
+        IssueLink();
+    if (!linkPending)
+        return;
+    TRACE_SCOPE_DETAIL("Shader finish link", sources.empty() ? NULL : sources[0].fileName.c_str());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    linkPending = false;
+    pendingPrograms.erase(std::find(pendingPrograms.begin(), pendingPrograms.end(), this));
+
+    for (unsigned int i = 0; i < shaderIds.size(); i++) {
+        // Get the compilation status
+        int status;
+        glGetShaderiv(shaderIds[i], GL_COMPILE_STATUS, &status);
+    
+        // If compilation status is not OK, get and print the log message.
+        if (status != 1) {
+            int length;
+            glGetShaderiv(shaderIds[i], GL_INFO_LOG_LENGTH, &length);
+            char* buffer = new char[length];
+            glGetShaderInfoLog(shaderIds[i], length, NULL, buffer);
+            printf("Compile log for %s:\n%s\n", sources[i].fileName.c_str(), buffer);
+            delete buffer;
+        }
+    }
+
     int status;
     glGetProgramiv(programId, GL_LINK_STATUS, &status);
     
@@ -102,4 +320,178 @@ void ShaderProgram::LinkProgram()
         printf("Link log:\n%s\n", buffer);
         delete buffer;
     }
+    else {
+        ApplyUniformBlocks();
+        if (!cachePath.empty())
+            SaveCachedBinary(cachePath);
+    }
+
+    compileSeconds += issueSeconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    compileCount++;
+}
+
+// Finishes every program still compiling.  Those the driver reports
+// complete are handled first, so no time is spent waiting on one
+// program while others are ready.
+void ShaderProgram::FinishPending()
+{
+    IssueBatch();
+    while (!pendingPrograms.empty()) {
+        ShaderProgram* next = pendingPrograms.front();
+        if (parallelCompile)
+            for (unsigned int i = 0; i < pendingPrograms.size(); i++) {
+                int done = 0;
+                glGetProgramiv(pendingPrograms[i]->programId, GL_COMPLETION_STATUS_KHR, &done);
+                if (done) {
+                    next = pendingPrograms[i];
+                    break;
+                }
+            }
+        next->FinishLink();
+    }
+}
+
+// Returns the cache file name for this program, or an empty string if
+// the driver supports no program binary formats.
+std::string ShaderProgram::CachePath()
+{
+    int formatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    if (formatCount == 0)
+        return std::string();
+
+    unsigned long long hash = 14695981039346656037ull;
+    hash = HashString(hash, (const char*)glGetString(GL_RENDERER));
+    hash = HashString(hash, (const char*)glGetString(GL_VERSION));
+    hash = HashString(hash, defines);
+    for (unsigned int i = 0; i < sources.size(); i++) {
+        hash = HashString(hash, sources[i].fileName);
+        hash = HashString(hash, std::to_string((int)sources[i].type));
+        hash = HashString(hash, sources[i].text);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s/%016llx.bin", cacheDir, hash);
+    return std::string(name);
+}
+
+// Hands a cached binary to the driver.  Returns false if there is no
+// such file, or if the driver rejects it (e.g. after a driver update).
+bool ShaderProgram::LoadCachedBinary(const std::string& path)
+{
+    std::ifstream f(path.c_str(), std::ios_base::binary);
+    if (!f)
+        return false;
+    f.seekg(0, std::ios_base::end);
+    int length = (int)f.tellg() - (int)sizeof(unsigned int);
+    if (length <= 0)
+        return false;
+
+    // The file holds the binary format followed by the binary itself
+    unsigned int format;
+    std::vector<char> binary(length);
+    f.seekg(0, std::ios_base::beg);
+    f.read((char*)&format, sizeof(format));
+    f.read(&binary[0], length);
+    if (!f)
+        return false;
+
+    glProgramBinary(programId, (GLenum)format, &binary[0], length);
+    int status;
+    glGetProgramiv(programId, GL_LINK_STATUS, &status);
+    if (status != 1) {
+        printf("Cached program %s rejected, recompiling\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void ShaderProgram::SaveCachedBinary(const std::string& path)
+{
+    int status, length;
+    glGetProgramiv(programId, GL_LINK_STATUS, &status);
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (status != 1 || length <= 0)
+        return;
+
+    GLenum format;
+    std::vector<char> binary(length);
+    glGetProgramBinary(programId, length, NULL, &format, &binary[0]);
+
+#ifdef _WIN32
+    _mkdir(cacheDir);
+#else
+    mkdir(cacheDir, 0755);
+#endif
+    std::ofstream f(path.c_str(), std::ios_base::binary);
+    if (!f) {
+        printf("Could not write program cache %s\n", path.c_str());
+        return;
+    }
+    unsigned int fmt = (unsigned int)format;
+    f.write((const char*)&fmt, sizeof(fmt));
+    f.write(&binary[0], length);
+}
+
+// Compile each source into a shader, attach them, and link the
+// program, without waiting for any of it to complete.
+void ShaderProgram::IssueCompileAndLink()
+{
+    shaderIds.clear();
+    for (unsigned int i = 0; i < sources.size(); i++) {
+        std::string text = InsertDefines(sources[i].text, defines);
+        const char* psrc[1] = {text.c_str()};
+
+        // Create a shader and attach, hand it the source, and compile it.
+        int shader = glCreateShader(sources[i].type);
+        glAttachShader(programId, shader);
+        glShaderSource(shader, 1, psrc, NULL);
+        glCompileShader(shader);
+        shaderIds.push_back(shader);
+    }
+
+    glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, (int)GL_TRUE);
+    glLinkProgram(programId);
+}
+
+void ShaderProgram::PrintBuildTimes()
+{
+    printf("Shader programs: %d compiled in %.1f ms, %d loaded from cache in %.1f ms\n",
+           compileCount, 1000.0*compileSeconds, cacheLoadCount, 1000.0*cacheLoadSeconds);
+}
+
+void ShaderVariants::AddShader(const char* fileName, const GLenum type)
+{
+    files.push_back(std::make_pair(std::string(fileName), type));
+}
+
+void ShaderVariants::BindAttribLocation(const int index, const char* name)
+{
+    attributes.push_back(std::make_pair(index, std::string(name)));
+}
+
+void ShaderVariants::UniformBlockBinding(const char* name, const int bindpoint)
+{
+    uniformBlocks.push_back(std::make_pair(std::string(name), bindpoint));
+}
+
+// Returns the permutation for this preamble, building it on first use.
+ShaderProgram* ShaderVariants::Get(const std::string& defines)
+{
+    std::map<std::string, ShaderProgram*>::iterator found = variants.find(defines);
+    if (found != variants.end())
+        return found->second;
+
+    ShaderProgram* program = new ShaderProgram();
+    program->defines = defines;
+    for (unsigned int i = 0; i < files.size(); i++)
+        program->AddShader(files[i].first.c_str(), files[i].second);
+    for (unsigned int i = 0; i < attributes.size(); i++)
+        glBindAttribLocation(program->programId, attributes[i].first, attributes[i].second.c_str());
+    for (unsigned int i = 0; i < uniformBlocks.size(); i++)
+        program->UniformBlockBinding(uniformBlocks[i].first.c_str(), uniformBlocks[i].second);
+    program->LinkProgram();
+
+    variants[defines] = program;
+    return program;
 }
@@ -5,17 +5,117 @@
 // loaded (method "Use"), its vertex shader and pixel shader will be
 // invoked for all geometry passing through the graphics pipeline.
 // When done, unload it with method "Unuse".
+//
+// Linked programs are cached on disk with glGetProgramBinary, keyed
+// by a hash of the shader sources, the GL_RENDERER string and the
+// driver version.  LinkProgram loads a cached binary when one exists
+// and is accepted by the driver, otherwise it compiles the sources.
+//
+// Compiling is asynchronous: source files are read on worker threads,
+// LinkProgram only issues the compile and link commands, and their
+// status is queried when the program is first used (or when
+// FinishPending is called).  With KHR_parallel_shader_compile the
+// driver compiles on its own threads meanwhile.  Between BeginBatch
+// and IssueBatch, LinkProgram only queues the program, so every file
+// of the batch is read in parallel before any is waited on.  Nothing
+// queries a program before its link is finished: uniform block
+// bindings are recorded and applied by FinishLink.
+//
+// Shader files may #include other files, and a program may be given
+// a preamble of #defines (inserted after the #version line) to build
+// a specialised permutation; see ShaderVariants below.
 ////////////////////////////////////////////////////////////////////////
 
+#include <vector>
+#include <string>
+#include <map>
+#include <future>
+#include <functional>
+#include <glm/glm.hpp>
+
 class ShaderProgram
 {
 public:
     int programId;
 	bool isReflectionShader;
+    // Which part of the scene Object::Draw draws with this program
+    enum DrawFilter { DrawAll, DrawStatic, DrawDynamic };
+    DrawFilter drawFilter;
+    // Layered rendering: Object::Draw draws each shape as this many
+    // instances, which the vertex shader sends to gl_Layer firstLayer +
+    // gl_InstanceID.  layerMask, if set, gives the layers a world space
+    // bounding sphere (center, radius) can reach, as bits; the range
+    // between its lowest and highest bits is drawn.
+    int layers;
+    std::function<unsigned int(const glm::vec3&, const float)> layerMask;
+
+    // Sources handed to AddShader, compiled only on a cache miss
+    struct Source {
+        std::string fileName;
+        GLenum type;
+        std::shared_future<std::string> pending;  // Read on a worker thread
+        std::string text;
+    };
+    std::vector<Source> sources;
+    std::string defines;        // Preamble of #define lines, set before LinkProgram
+    std::vector<std::pair<std::string, int> > uniformBlocks;  // Applied once linked
+
+    // Startup totals over all programs, see PrintBuildTimes
+    static double compileSeconds, cacheLoadSeconds;
+    static int compileCount, cacheLoadCount;
+    static bool parallelCompile;    // KHR/ARB_parallel_shader_compile in use
+    static std::vector<ShaderProgram*> pendingPrograms;
+    static std::vector<ShaderProgram*> queuedPrograms;
+    static bool batching;
     
     ShaderProgram();
     void AddShader(const char* fileName, const GLenum type);
+    void UniformBlockBinding(const char* name, const int bindpoint);
     void LinkProgram();
+    bool Linked();              // Finished linking, without waiting
     void Use();
     void Unuse();
+
+    void FinishLink();
+    static void BeginBatch();
+    static void IssueBatch();
+    static void FinishPending();
+    static void PrintBuildTimes();
+
+private:
+    bool linkQueued;
+    bool linkPending;
+    std::string cachePath;
+    std::vector<int> shaderIds;
+    double issueSeconds;        // Time spent issuing the compile and link
+
+    static void EnableParallelCompile();
+    std::string CachePath();
+    bool LoadCachedBinary(const std::string& path);
+    void SaveCachedBinary(const std::string& path);
+    void IssueLink();
+    void IssueCompileAndLink();
+    void ApplyUniformBlocks();
+};
+
+// Returns the preamble line "#define name value"
+std::string ShaderDefine(const char* name, const int value);
+
+// A family of programs built from the same shader files, one for each
+// distinct #define preamble.  Each permutation is compiled the first
+// time Get asks for it and kept for later frames.  Attribute and
+// uniform block bindings are recorded here and applied to every
+// permutation as it is built.
+class ShaderVariants
+{
+public:
+    std::vector<std::pair<std::string, GLenum> > files;
+    std::vector<std::pair<int, std::string> > attributes;
+    std::vector<std::pair<std::string, int> > uniformBlocks;
+    std::map<std::string, ShaderProgram*> variants;
+
+    void AddShader(const char* fileName, const GLenum type);
+    void BindAttribLocation(const int index, const char* name);
+    void UniformBlockBinding(const char* name, const int bindpoint);
+    ShaderProgram* Get(const std::string& defines);
 };
@@ -8,11 +8,13 @@ const float PI = 3.14159f;
 in vec4 position;
 
 uniform int debugMode;
-uniform float min_depth, max_depth;
 
 void main()
 {
-    float relative_depth = (position.w - min_depth)/ (max_depth - min_depth);
+    // The cascades use orthographic projections, so NDC z is already
+    // linear in the light's depth.  Casters in front of the cascade are
+    // depth clamped onto its near plane.
+    float relative_depth = clamp(position.z*0.5 + 0.5, 0.0, 1.0);
     gl_FragData[0].x = relative_depth;
     gl_FragData[0].y = pow(relative_depth, 2);
     gl_FragData[0].z = pow(relative_depth, 3);
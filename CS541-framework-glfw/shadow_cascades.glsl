@@ -0,0 +1,60 @@
+/////////////////////////////////////////////////////////////////////////
+// Cascaded shadow map lookup, shared by the passes that receive
+// shadows.
+//
+// The view frustum is split by distance into cascadeCount slices, each
+// with its own orthographic light projection fitted by
+// Scene::FitShadowCascades.  Layer i of shadowMap holds the moments of
+// cascade i; ShadowMatrices[i] takes a world position to its texture
+// coordinates in xy and its normalized light depth in z.
+//
+// With shadowFilterMode 1 each layer holds a summed-area table of the
+// moments less 0.5 (see parallel_sum.comp), and ShadowMoments averages
+// a box of 2*shadowFilterWidth+1 texels from its four corners.  With
+// mode 0 the layers hold moments already blurred by the separable
+// Gaussian.
+////////////////////////////////////////////////////////////////////////
+
+#define MAX_CASCADES 4
+
+uniform mat4 ShadowMatrices[MAX_CASCADES];
+uniform int cascadeCount;
+uniform sampler2DArray shadowMap;
+uniform int shadowFilterMode;
+uniform int shadowFilterWidth;
+
+// Shadow map coordinates of a world position in the first (i.e. the
+// sharpest) cascade covering it, with the cascade index in w.  Returns
+// w = -1 outside every cascade.
+vec4 ShadowCascadeCoord(vec3 worldPos)
+{
+    for (int i = 0; i < cascadeCount; i++) {
+        vec3 c = (ShadowMatrices[i] * vec4(worldPos, 1.0)).xyz;
+        if (all(greaterThanEqual(c, vec3(0))) && all(lessThanEqual(c, vec3(1))))
+            return vec4(c, i);
+    }
+    return vec4(0, 0, 0, -1);
+}
+
+// Filtered moments around the coordinates from ShadowCascadeCoord
+vec4 ShadowMoments(vec4 cascade)
+{
+    if (shadowFilterMode == 0)
+        return texture(shadowMap, cascade.xyw);
+
+    // Box corners in texels, kept between the first and last texel
+    // centers.  Linear filtering of the table at a corner gives the sum
+    // of everything below and left of it.
+    vec2 size = vec2(textureSize(shadowMap, 0).xy);
+    vec2 p = cascade.xy*size;
+    float r = shadowFilterWidth + 0.5;
+    vec2 lo = clamp(p - r, vec2(0.5), size - 0.5) / size;
+    vec2 hi = clamp(p + r, vec2(0.5), size - 0.5) / size;
+
+    vec4 sum = texture(shadowMap, vec3(hi.x, hi.y, cascade.w))
+             - texture(shadowMap, vec3(lo.x, hi.y, cascade.w))
+             - texture(shadowMap, vec3(hi.x, lo.y, cascade.w))
+             + texture(shadowMap, vec3(lo.x, lo.y, cascade.w));
+    vec2 extent = max((hi - lo)*size, vec2(1.0));
+    return sum/(extent.x*extent.y) + 0.5;
+}
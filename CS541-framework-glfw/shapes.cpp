@@ -21,6 +21,7 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include <vector>
+#include <map>
 #include <fstream>
 #include <stdlib.h>
 
@@ -40,6 +41,7 @@ using namespace gl;
 #include "shapes.h"
 #include "rply.h"
 #include "simplexnoise.h"
+#include "trace.h"
 
 const float PI = 3.14159f;
 const float rad = PI/180.0f;
@@ -139,12 +141,15 @@ void Shape::MakeVAO()
     count = Tri.size();
 }
 
-void Shape::DrawVAO()
+void Shape::DrawVAO(const int instances)
 {
     CHECKERROR;
     glBindVertexArray(vaoID);
     CHECKERROR;
-    glDrawElements(GL_TRIANGLES, 3*count, GL_UNSIGNED_INT, 0);
+    if (instances > 1)
+        glDrawElementsInstanced(GL_TRIANGLES, 3*count, GL_UNSIGNED_INT, 0, instances);
+    else
+        glDrawElements(GL_TRIANGLES, 3*count, GL_UNSIGNED_INT, 0);
     CHECKERROR;
     glBindVertexArray(0);
 }
@@ -306,6 +311,7 @@ glm::vec3 TeapotPoints[] = {
 // patches is represented by an n by n grid of quads triangulated.
 Teapot::Teapot(const int n)
 {
+    TRACE_SCOPE("Teapot");
     diffuseColor = glm::vec3(0.5, 0.5, 0.1);
     specularColor = glm::vec3(1.0, 1.0, 1.0);
     shininess = 120.0;
@@ -476,6 +482,64 @@ Sphere::Sphere(const int n)
     MakeVAO();
 }
 
+////////////////////////////////////////////////////////////////////////
+// Generates a low polygon sphere by subdividing an icosahedron n times.
+// Meant as a bounding proxy: the result is scaled so its faces lie
+// just outside the unit sphere rather than its vertices on it.
+Icosphere::Icosphere(const int n)
+{
+    diffuseColor = glm::vec3(0.5, 0.5, 1.0);
+    specularColor = glm::vec3(1.0, 1.0, 1.0);
+    shininess = 120.0;
+
+    const float t = (1.0f + sqrt(5.0f))/2.0f;
+    glm::vec3 corners[12] = {
+        glm::vec3(-1, t, 0), glm::vec3(1, t, 0), glm::vec3(-1, -t, 0), glm::vec3(1, -t, 0),
+        glm::vec3(0, -1, t), glm::vec3(0, 1, t), glm::vec3(0, -1, -t), glm::vec3(0, 1, -t),
+        glm::vec3(t, 0, -1), glm::vec3(t, 0, 1), glm::vec3(-t, 0, -1), glm::vec3(-t, 0, 1) };
+    int faces[20][3] = {
+        {0,11,5}, {0,5,1}, {0,1,7}, {0,7,10}, {0,10,11}, {1,5,9}, {5,11,4}, {11,10,2}, {10,7,6}, {7,1,8},
+        {3,9,4}, {3,4,2}, {3,2,6}, {3,6,8}, {3,8,9}, {4,9,5}, {2,4,11}, {6,2,10}, {8,6,7}, {9,8,1} };
+
+    std::vector<glm::vec3> V;
+    for (int i=0;  i<12;  i++)
+        V.push_back(glm::normalize(corners[i]));
+    for (int i=0;  i<20;  i++)
+        Tri.push_back(glm::ivec3(faces[i][0], faces[i][1], faces[i][2]));
+
+    // Split each triangle in four, sharing the new midpoint vertices
+    for (int level=0;  level<n;  level++) {
+        std::map<std::pair<int,int>, int> midpoints;
+        std::vector<glm::ivec3> split;
+        for (unsigned int i=0;  i<Tri.size();  i++) {
+            int mid[3];
+            for (int e=0;  e<3;  e++) {
+                int a = Tri[i][e], b = Tri[i][(e+1)%3];
+                std::pair<int,int> key(std::min(a, b), std::max(a, b));
+                if (midpoints.count(key) == 0) {
+                    midpoints[key] = V.size();
+                    V.push_back(glm::normalize(V[a] + V[b])); }
+                mid[e] = midpoints[key]; }
+            split.push_back(glm::ivec3(Tri[i][0], mid[0], mid[2]));
+            split.push_back(glm::ivec3(Tri[i][1], mid[1], mid[0]));
+            split.push_back(glm::ivec3(Tri[i][2], mid[2], mid[1]));
+            split.push_back(glm::ivec3(mid[0], mid[1], mid[2])); }
+        Tri = split; }
+
+    // The nearest face plane sets the scale that puts every face
+    // outside the unit sphere
+    float inner = 1.0f;
+    for (unsigned int i=0;  i<Tri.size();  i++) {
+        glm::vec3 N = glm::normalize(glm::cross(V[Tri[i][1]] - V[Tri[i][0]], V[Tri[i][2]] - V[Tri[i][0]]));
+        inner = std::min(inner, glm::dot(N, V[Tri[i][0]])); }
+
+    for (unsigned int i=0;  i<V.size();  i++) {
+        Pnt.push_back(glm::vec4(V[i]/inner, 1.0f));
+        Nrm.push_back(V[i]); }
+    ComputeSize();
+    MakeVAO();
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Generates a radius disk aroudn the origin in the XY plane
 //   n specifies the number of polygonal subdivisions
@@ -542,6 +606,7 @@ Cylinder::Cylinder(const int n)
 // sufficient, but that works poorly with the reflection map.
 Ply::Ply(const char* name, const bool reverse)
 {
+    TRACE_SCOPE_DETAIL("Ply", name);
     diffuseColor = glm::vec3(0.8, 0.8, 0.5);
     specularColor = glm::vec3(1.0, 1.0, 1.0);
     shininess = 120.0;
@@ -683,6 +748,7 @@ Plane::Plane(const float r, const int n)
 
     vaoID = VaoFromTris(Pnt, Nrm, Tex, Tan, Tri);
     count = Tri.size();
+    ComputeSize();
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -695,6 +761,7 @@ ProceduralGround::ProceduralGround(const float _range, const int n,
     :range(_range), octaves(_octaves), persistence(_persistence), scale(_scale), 
      low(_low), high(_high)
 {
+    TRACE_SCOPE("ProceduralGround");
     diffuseColor = glm::vec3(0.3, 0.2, 0.1);
     specularColor = glm::vec3(1.0, 1.0, 1.0);
     shininess = 10.0;
@@ -726,6 +793,7 @@ ProceduralGround::ProceduralGround(const float _range, const int n,
 
     vaoID = VaoFromTris(Pnt, Nrm, Tex, Tan, Tri);
     count = Tri.size();
+    ComputeSize();
 }
 
 float ProceduralGround::HeightAt(const float x, const float y)
@@ -767,4 +835,5 @@ Quad::Quad(const int n)
 
     vaoID = VaoFromTris(Pnt, Nrm, Tex, Tan, Tri);
     count = Tri.size();
+    ComputeSize();
 }
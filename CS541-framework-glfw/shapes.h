@@ -62,7 +62,7 @@ public:
 
     virtual void ComputeSize();
     virtual void MakeVAO();
-    virtual void DrawVAO();
+    virtual void DrawVAO(const int instances=1);
 };
 
 class Box: public Shape
@@ -78,6 +78,12 @@ public:
     Sphere(const int n);
 };
 
+class Icosphere: public Shape
+{
+public:
+    Icosphere(const int n);
+};
+
 class Disk: public Shape
 {
 public:
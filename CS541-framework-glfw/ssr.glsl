@@ -0,0 +1,97 @@
+/////////////////////////////////////////////////////////////////////////
+// Screen space reflections for the lighting pass (final.frag)
+//
+// The reflected ray is clipped to the front plane and projected to the
+// screen, where its position, and 1/depth, change linearly.  It is
+// marched over HiZTex, a pyramid of the nearest view depth per texel
+// (hiz.comp): while the ray stays in front of a texel's depth it skips
+// the whole texel and climbs a level, otherwise it descends, until at
+// level 0 it passes behind a surface by less than ssrThickness.  The
+// hit's color is last frame's lit image, found by reprojecting the hit
+// point with PrevViewProj.
+////////////////////////////////////////////////////////////////////////
+
+uniform mat4 WorldView, WorldProj;
+uniform mat4 PrevViewProj;
+uniform float front;
+
+uniform sampler2D HiZTex;
+uniform sampler2D ReflectionHistory;
+uniform int hizLevels;
+uniform int ssrHistoryValid;
+uniform int ssrMaxSteps;
+uniform float ssrThickness;
+uniform float ssrMaxDistance;
+
+// Returns how much of the reflection the hit supplies (0 for a miss),
+// and the hit's color in color
+float ScreenSpaceReflection(vec3 P, vec3 R, out vec3 color)
+{
+    color = vec3(0);
+    if (ssrHistoryValid == 0)
+        return 0.0;
+
+    vec2 size = vec2(gbufferSize);
+    vec4 H0 = WorldProj*WorldView*vec4(P, 1.0);
+    vec4 H1 = WorldProj*WorldView*vec4(P + R*ssrMaxDistance, 1.0);
+    if (H1.w < front)
+        H1 = mix(H0, H1, (H0.w - front)/(H0.w - H1.w));
+
+    vec2 S0 = (H0.xy/H0.w*0.5 + 0.5)*size;
+    vec2 S1 = (H1.xy/H1.w*0.5 + 0.5)*size;
+    float k0 = 1.0/H0.w, k1 = 1.0/H1.w;
+    vec2 dS = S1 - S0;
+    float pixelStep = 1.0/max(max(abs(dS.x), abs(dS.y)), 1e-4);
+
+    // Start a pixel out, so the surface does not hit itself
+    float t = pixelStep;
+    int level = 0;
+    for (int i = 0; i < ssrMaxSteps && t <= 1.0; i++) {
+        vec2 S = S0 + dS*t;
+        if (S.x < 0.0 || S.y < 0.0 || S.x >= size.x || S.y >= size.y)
+            return 0.0;
+
+        // Where the ray leaves its texel at this level
+        float cellSize = float(1 << level);
+        vec2 cell = floor(S/cellSize);
+        vec2 edge = (cell + step(0.0, dS))*cellSize;
+        float tx = abs(dS.x) > 1e-4 ? (edge.x - S0.x)/dS.x : 2.0;
+        float ty = abs(dS.y) > 1e-4 ? (edge.y - S0.y)/dS.y : 2.0;
+        float tExit = min(min(tx, ty), 1.0);
+
+        float depthIn = 1.0/(k0 + (k1 - k0)*t);
+        float depthOut = 1.0/(k0 + (k1 - k0)*tExit);
+        // hiz.comp builds each level only to the rendered size shifted
+        // down, folding an odd last row and column into the last texel
+        ivec2 levelSize = max(gbufferSize >> level, ivec2(1));
+        float surface = texelFetch(HiZTex, min(ivec2(cell), levelSize - 1), level).x;
+
+        if (max(depthIn, depthOut) < surface) {
+            // In front of everything under this texel
+            t = tExit + 0.01*pixelStep;
+            level = min(level + 1, hizLevels - 1);
+        }
+        else if (level > 0)
+            level--;
+        else if (min(depthIn, depthOut) < surface + ssrThickness) {
+            ivec2 pixel = ivec2(cell);
+            // A surface facing away from the ray cannot be what it sees
+            if (dot(GbufferNormal(pixel), R) > 0.0)
+                return 0.0;
+            vec4 prev = PrevViewProj*vec4(GbufferPosition(pixel).xyz, 1.0);
+            vec2 uv = prev.xy/prev.w*0.5 + 0.5;
+            if (uv.x < 0.0 || uv.y < 0.0 || uv.x > 1.0 || uv.y > 1.0)
+                return 0.0;
+            // The history was copied from the rendered part of the HDR target
+            color = texture(ReflectionHistory, uv*size/vec2(textureSize(ReflectionHistory, 0))).xyz;
+
+            // Fade out toward the screen's edges and the ray's end
+            vec2 border = min(uv, 1.0 - uv);
+            return clamp(min(border.x, border.y)*10.0, 0.0, 1.0) * (1.0 - t*t);
+        }
+        else
+            // Behind the surface by more than its thickness
+            t = tExit + 0.01*pixelStep;
+    }
+    return 0.0;
+}
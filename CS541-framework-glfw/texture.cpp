@@ -17,6 +17,7 @@ using namespace gl;
 #include <glm/glm.hpp>
 
 #include "texture.h"
+#include "trace.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_FAILURE_USERMSG
@@ -25,8 +26,9 @@ using namespace gl;
 #include <glu.h>                // For gluErrorString
 #define CHECKERROR {GLenum err = glGetError(); if (err != GL_NO_ERROR) { fprintf(stderr, "OpenGL error (at line texture.cpp:%d): %s\n", __LINE__, gluErrorString(err)); exit(-1);} }
 
-Texture::Texture(const std::string &path, bool repeat) : textureId(0)
+Texture::Texture(const std::string &path, bool repeat, bool projectIrradiance) : textureId(0)
 {
+    TRACE_SCOPE_DETAIL("Texture load", path.c_str());
     stbi_set_flip_vertically_on_load(true);
     image = stbi_load(path.c_str(), &width, &height, &depth, 4);
     depth = 4;
@@ -49,6 +51,11 @@ Texture::Texture(const std::string &path, bool repeat) : textureId(0)
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, (int)GL_REPEAT);
     }
     glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Environment maps get their diffuse irradiance computed here, while
+    // the pixels are still in memory.
+    if (projectIrradiance)
+        ProjectIrradianceSH(image, width, height, depth, irradianceSH);
     stbi_image_free(image);
 
 }
@@ -11,7 +11,11 @@
 // This class reads an image from a file, stores it on the graphics
 // card as a texture, and stores the (small integer) texture id which
 // identifies it.  It also supplies two methods for binding and
-// unbinding the texture to/from a shader.
+// unbinding the texture to/from a shader.  If requested, the image is
+// also projected onto spherical harmonics for diffuse image based
+// lighting (see irradiance.h) before it is freed.
+
+#include "irradiance.h"
 
 class Texture
 {
@@ -19,7 +23,8 @@ class Texture
     unsigned int textureId;
     int width, height, depth;
     unsigned char* image;
-    Texture(const std::string &filename, bool repeat=false);
+    glm::vec3 irradianceSH[IRRADIANCE_SH_COUNT];
+    Texture(const std::string &filename, bool repeat=false, bool projectIrradiance=false);
 
     void Bind(const int unit, const int programId, const std::string& name);
     void Unbind();
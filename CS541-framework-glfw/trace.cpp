@@ -0,0 +1,166 @@
+///////////////////////////////////////////////////////////////////////
+// CPU trace zones.  See trace.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "trace.h"
+
+namespace {
+
+struct Event {
+    char name[Trace::NameLength];
+    char detail[Trace::NameLength];
+    double start, duration;
+};
+
+struct Ring {
+    Event events[Trace::Capacity];
+    std::atomic<unsigned long long> count;  // Events ever written
+    std::atomic<bool> owned;
+    int thread;                             // tid in the trace
+};
+
+std::atomic<Ring*> rings[Trace::MaxThreads];
+
+// Claims a free ring, or makes one in the first empty slot.  NULL if
+// MaxThreads threads are already tracing.
+Ring* Claim()
+{
+    for (int i = 0; i < Trace::MaxThreads; i++) {
+        Ring* ring = rings[i].load();
+        if (!ring) {
+            Ring* fresh = new Ring();
+            fresh->count = 0;
+            fresh->owned = true;
+            fresh->thread = i;
+            if (rings[i].compare_exchange_strong(ring, fresh))
+                return fresh;
+            delete fresh;
+        }
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true))
+            return ring;
+    }
+    return NULL;
+}
+
+// The calling thread's ring, given back when the thread exits
+struct ThreadRing {
+    Ring* ring = NULL;
+    bool claimed = false;
+    ~ThreadRing() { if (ring) ring->owned = false; }
+    Ring* Get() {
+        if (!claimed) {
+            ring = Claim();
+            claimed = true;
+        }
+        return ring;
+    }
+};
+thread_local ThreadRing threadRing;
+
+void CopyName(char* dst, const char* src)
+{
+    if (!src) {
+        dst[0] = 0;
+        return;
+    }
+    strncpy(dst, src, Trace::NameLength - 1);
+    dst[Trace::NameLength - 1] = 0;
+}
+
+// JSON string contents: quotes and backslashes (as in Windows paths) escaped
+void WriteEscaped(FILE* file, const char* s)
+{
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', file);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, file);
+    }
+}
+
+}
+
+double Trace::Now()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Trace::Add(const char* name, const char* detail, const double start, const double end)
+{
+    Ring* ring = threadRing.Get();
+    if (!ring)
+        return;
+    const unsigned long long n = ring->count.load(std::memory_order_relaxed);
+    Event& event = ring->events[n % Capacity];
+    CopyName(event.name, name);
+    CopyName(event.detail, detail);
+    event.start = start;
+    event.duration = end - start;
+    ring->count.store(n + 1, std::memory_order_release);
+}
+
+bool Trace::Write(const char* fileName)
+{
+    FILE* file = fopen(fileName, "w");
+    if (!file) {
+        printf("Could not open trace file %s\n", fileName);
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    int written = 0;
+    std::vector<Event> copy;
+    for (int i = 0; i < MaxThreads; i++) {
+        Ring* ring = rings[i].load();
+        if (!ring)
+            continue;
+
+        // Copy the newest Capacity events, then drop any the thread
+        // overwrote meanwhile
+        const unsigned long long end = ring->count.load(std::memory_order_acquire);
+        const unsigned long long begin = end > (unsigned long long)Capacity ? end - Capacity : 0;
+        copy.resize((size_t)(end - begin));
+        for (unsigned long long n = begin; n < end; n++)
+            copy[(size_t)(n - begin)] = ring->events[n % Capacity];
+        const unsigned long long after = ring->count.load(std::memory_order_acquire);
+        const unsigned long long valid = after > (unsigned long long)Capacity ? after - Capacity : 0;
+        const size_t skip = (size_t)(std::min(std::max(valid, begin), end) - begin);
+
+        // The main thread traces first, so takes the first ring
+        char threadName[32];
+        if (ring->thread == 0)
+            sprintf(threadName, "Main");
+        else
+            sprintf(threadName, "Thread %d", ring->thread);
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", ring->thread, threadName);
+        first = false;
+        for (size_t e = skip; e < copy.size(); e++) {
+            fprintf(file, ",\n{\"name\":\"");
+            WriteEscaped(file, copy[e].name);
+            fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    ring->thread, copy[e].start, copy[e].duration);
+            if (copy[e].detail[0]) {
+                fprintf(file, ",\"args\":{\"detail\":\"");
+                WriteEscaped(file, copy[e].detail);
+                fprintf(file, "\"}");
+            }
+            fprintf(file, "}");
+            written++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Wrote %d trace events to %s\n", written, fileName);
+    return true;
+}
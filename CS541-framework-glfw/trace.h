@@ -0,0 +1,50 @@
+///////////////////////////////////////////////////////////////////////
+// CPU trace zones, written out as a Chrome trace (JSON, for
+// chrome://tracing or ui.perfetto.dev).
+//
+// TRACE_SCOPE("name") times the enclosing block, and
+// TRACE_SCOPE_DETAIL("name", detail) adds a string such as a file
+// name.  Each thread records its zones into its own ring buffer of
+// Capacity events: a single writer with an atomic count, so recording
+// takes no lock and never waits for Write.  Once a ring is full the
+// oldest events are overwritten.  A thread claims a ring on its first
+// zone and gives it back when it exits.
+//
+// Write gathers the rings into one file; events a thread overwrites
+// while they are being copied are dropped.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _TRACE_
+#define _TRACE_
+
+class Trace
+{
+public:
+    static const int Capacity = 1 << 14;    // Events per thread
+    static const int MaxThreads = 64;
+    static const int NameLength = 64;
+
+    // Microseconds since the first call
+    static double Now();
+
+    // Records a zone that ran from start to end (in Now's microseconds)
+    static void Add(const char* name, const char* detail, const double start, const double end);
+
+    static bool Write(const char* fileName);
+};
+
+struct TraceZone
+{
+    const char* name;
+    const char* detail;
+    double start;
+    TraceZone(const char* _name, const char* _detail=0) : name(_name), detail(_detail), start(Trace::Now()) {}
+    ~TraceZone() { Trace::Add(name, detail, start, Trace::Now()); }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_SCOPE_DETAIL(name, detail) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name, detail)
+
+#endif
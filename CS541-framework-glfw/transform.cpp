@@ -96,6 +96,21 @@ glm::mat4 Perspective(const float rx, const float ry,
     return P;
 }
 
+// Returns an orthographic projection matrix of the box
+// [left,right]x[bottom,top] between the front and back planes
+glm::mat4 Orthographic(const float left, const float right, const float bottom, const float top,
+                       const float front, const float back)
+{
+    glm::mat4 O;
+    O[0].x = 2 / (right - left);
+    O[1].y = 2 / (top - bottom);
+    O[2].z = -2 / (back - front);
+    O[3].x = -(right + left) / (right - left);
+    O[3].y = -(top + bottom) / (top - bottom);
+    O[3].z = -(back + front) / (back - front);
+    return O;
+}
+
 glm::mat4 LookAt(const glm::vec3 Eye, const glm::vec3 Center, const glm::vec3 Up) {
     glm::vec3 V, A, B;
     glm::mat4 rotMat;
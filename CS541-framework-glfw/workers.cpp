@@ -0,0 +1,99 @@
+///////////////////////////////////////////////////////////////////////
+// Persistent worker threads.  See workers.h.
+////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include "workers.h"
+
+namespace {
+
+struct Pool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+
+    // The current loop, guarded by mutex
+    const Workers::Body* body = NULL;
+    int count = 0, tasks = 0, perTask = 0;
+    int next = 0;           // Next range to take
+    int finished = 0;
+    bool quit = false;
+
+    // Takes ranges until none are left; called with the lock held
+    void RunTasks(std::unique_lock<std::mutex>& lock) {
+        while (next < tasks) {
+            const int task = next++;
+            const Workers::Body& run = *body;
+            const int first = task*perTask;
+            const int last = std::min(count, first + perTask);
+            lock.unlock();
+            run(task, first, last);
+            lock.lock();
+            if (++finished == tasks)
+                done.notify_all();
+        }
+    }
+
+    void Work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this]() { return quit || next < tasks; });
+            if (quit)
+                return;
+            RunTasks(lock);
+        }
+    }
+
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (unsigned int t = 0; t < threads.size(); t++)
+            threads[t].join();
+    }
+};
+
+Pool pool;
+
+}
+
+int Workers::Tasks(const int count)
+{
+    const int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    return std::max(1, std::min(threadCount, count/ItemsPerTask));
+}
+
+void Workers::ParallelFor(const int count, const Body& body)
+{
+    const int tasks = Tasks(count);
+    if (tasks == 1) {
+        body(0, 0, count);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    // The calling thread takes ranges too, so the pool needs one less
+    const int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    while ((int)pool.threads.size() < threadCount - 1)
+        pool.threads.push_back(std::thread([]() { pool.Work(); }));
+
+    pool.body = &body;
+    pool.count = count;
+    pool.perTask = (count + tasks - 1)/tasks;
+    pool.next = 0;
+    pool.finished = 0;
+    pool.tasks = tasks;
+    pool.wake.notify_all();
+    pool.RunTasks(lock);
+    pool.done.wait(lock, []() { return pool.finished == pool.tasks; });
+    pool.tasks = 0;
+    pool.body = NULL;
+}
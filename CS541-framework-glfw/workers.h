@@ -0,0 +1,32 @@
+///////////////////////////////////////////////////////////////////////
+// A persistent pool of worker threads for the per-frame parallel loops
+// (the light animation and binning).
+//
+// ParallelFor(count, body) splits [0, count) into Tasks(count) ranges
+// and calls body(task, first, last) on each, some on the calling thread
+// and the rest on the pool, returning once all are done.  The threads
+// are started on first use and sleep between loops, so a loop costs a
+// wakeup rather than creating and joining a thread per range.  One loop
+// runs at a time, and a body must not start another.
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _WORKERS_
+#define _WORKERS_
+
+#include <functional>
+
+class Workers
+{
+public:
+    // Below this many items per range, a loop uses fewer ranges
+    static const int ItemsPerTask = 1024;
+
+    typedef std::function<void(int task, int first, int last)> Body;
+
+    // Ranges ParallelFor will split count items into, at least 1
+    static int Tasks(const int count);
+
+    static void ParallelFor(const int count, const Body& body);
+};
+
+#endif